@@ -0,0 +1,567 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "agent.h"
+
+static void __agent_disconnect(pingtcp_agent_t* _agent)
+{
+	if (_agent->fd != -1)
+		if (unlikely(close(_agent->fd) == -1))
+			panic("close");
+	_agent->fd = -1;
+	_agent->connected = 0;
+	_agent->reporting = 0;
+	_agent->out.used = 0;
+	_agent->in.used = 0;
+
+	/* Unless acknowledged, removed targets are sent again on the next connection */
+	for (size_t i = 0; i < _agent->retired_count; i++)
+		_agent->retired[i].frame = 0;
+
+	return;
+}
+
+static void __agent_retired_drop(pingtcp_agent_t* _agent)
+{
+	size_t kept = 0;
+
+	for (size_t i = 0; i < _agent->retired_count; i++)
+	{
+		if (_agent->retired[i].frame && _agent->retired[i].frame <= _agent->acked)
+		{
+			pfcq_free(_agent->retired[i].dst);
+			continue;
+		}
+		if (kept != i)
+			memcpy(&_agent->retired[kept], &_agent->retired[i], sizeof(pingtcp_agent_retired_t));
+		kept++;
+	}
+	_agent->retired_count = kept;
+
+	return;
+}
+
+/* Frames are numbered per connection, as the aggregator counts them in its ACKs */
+static int __agent_frame_end(pingtcp_agent_t* _agent, size_t _frame)
+{
+	int ret = pingtcp_buffer_frame_end(&_agent->out, _frame);
+
+	if (likely(ret == 0))
+		_agent->frames++;
+
+	return ret;
+}
+
+static void __agent_connect(pingtcp_agent_t* _agent)
+{
+	size_t frame = 0;
+
+	_agent->fd = socket(_agent->address.address.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (unlikely(_agent->fd == -1))
+		return;
+
+	/* Completion is not waited for: until then, writes just queue up */
+	if (connect(_agent->fd, &_agent->address.address, _agent->address_length) == -1 && errno != EINPROGRESS)
+	{
+		__agent_disconnect(_agent);
+		return;
+	}
+
+	/*
+	 * Every target is announced again on a new connection, and reported in full,
+	 * since what was queued on the dropped one may never have arrived
+	 */
+	pfcq_zero(_agent->announced, _agent->capacity * sizeof(uint8_t));
+	pfcq_zero(_agent->last, _agent->capacity * sizeof(pingtcp_stats_t));
+	_agent->frames = 0;
+	_agent->acked = 0;
+
+	frame = pingtcp_buffer_frame_begin(&_agent->out, PINGTCP_WIRE_HELLO);
+	pingtcp_buffer_put_varint(&_agent->out, WIRE_VERSION);
+	pingtcp_buffer_put_varint(&_agent->out, HISTOGRAM_BUCKETS);
+	pingtcp_buffer_put_string(&_agent->out, _agent->name);
+	if (unlikely(__agent_frame_end(_agent, frame)))
+		__agent_disconnect(_agent);
+
+	return;
+}
+
+static int __agent_established(pingtcp_agent_t* _agent)
+{
+	struct pollfd pollfd;
+	int error = 0;
+	socklen_t error_length = sizeof(error);
+
+	if (_agent->connected)
+		return 1;
+
+	pfcq_zero(&pollfd, sizeof(struct pollfd));
+	pollfd.fd = _agent->fd;
+	pollfd.events = POLLOUT;
+	if (poll(&pollfd, 1, 0) <= 0)
+		return 0;
+
+	if (getsockopt(_agent->fd, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1 || error)
+	{
+		__agent_disconnect(_agent);
+		return 0;
+	}
+	_agent->connected = 1;
+
+	return 1;
+}
+
+/* ACKs are all the aggregator sends, and the latest one is all that matters */
+static void __agent_receive(pingtcp_agent_t* _agent)
+{
+	pingtcp_reader_t stream;
+	pingtcp_reader_t frame;
+	ssize_t res = 0;
+	int ret = 0;
+
+	while (_agent->fd != -1)
+	{
+		if (_agent->in.size - _agent->in.used < AGENT_READ_CHUNK)
+		{
+			_agent->in.size = _agent->in.size ? _agent->in.size * 2 : AGENT_READ_CHUNK * 2;
+			_agent->in.data = _agent->in.data ? pfcq_realloc(_agent->in.data, _agent->in.size) : pfcq_alloc(_agent->in.size);
+		}
+
+		res = recv(_agent->fd, _agent->in.data + _agent->in.used, _agent->in.size - _agent->in.used, MSG_DONTWAIT);
+		if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			break;
+		if (res <= 0)
+		{
+			__agent_disconnect(_agent);
+			return;
+		}
+		_agent->in.used += res;
+
+		pingtcp_reader_init(&stream, _agent->in.data, _agent->in.used);
+		while ((ret = pingtcp_reader_frame(&stream, &frame)) == 1)
+		{
+			uint64_t acked = 0;
+
+			if (pingtcp_reader_get_u8(&frame) != PINGTCP_WIRE_ACK)
+				continue;
+			acked = pingtcp_reader_get_varint(&frame);
+			if (likely(!frame.error && acked > _agent->acked && acked <= _agent->frames))
+				_agent->acked = acked;
+		}
+		if (unlikely(ret == -1))
+		{
+			__agent_disconnect(_agent);
+			return;
+		}
+		pingtcp_buffer_consume(&_agent->in, stream.offset);
+	}
+
+	__agent_retired_drop(_agent);
+
+	return;
+}
+
+static void __agent_send(pingtcp_agent_t* _agent)
+{
+	ssize_t res = 0;
+
+	while (_agent->fd != -1 && _agent->out.used > 0)
+	{
+		res = send(_agent->fd, _agent->out.data, _agent->out.used, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (res == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN || errno == EINTR)
+				break;
+			__agent_disconnect(_agent);
+			break;
+		}
+		pingtcp_buffer_consume(&_agent->out, res);
+	}
+
+	return;
+}
+
+static void __agent_grow(pingtcp_agent_t* _agent)
+{
+	size_t capacity = _agent->engine->targets.capacity;
+
+#define __AGENT_RESIZE(A) \
+	_agent->A = _agent->A ? pfcq_realloc(_agent->A, capacity * sizeof(*_agent->A)) : pfcq_alloc(capacity * sizeof(*_agent->A)); \
+	pfcq_zero(_agent->A + _agent->capacity, (capacity - _agent->capacity) * sizeof(*_agent->A))
+
+	__AGENT_RESIZE(announced);
+	__AGENT_RESIZE(ports);
+	__AGENT_RESIZE(dsts);
+	__AGENT_RESIZE(instances);
+	__AGENT_RESIZE(last);
+
+#undef __AGENT_RESIZE
+
+	_agent->capacity = capacity;
+
+	return;
+}
+
+/* A target seen for the first time, or a slot holding another target now, is a new instance */
+static void __agent_track(pingtcp_agent_t* _agent, size_t _target)
+{
+	const pingtcp_targets_t* targets = &_agent->engine->targets;
+
+	if (_agent->dsts[_target] && _agent->ports[_target] == targets->port[_target] &&
+		strcmp(_agent->dsts[_target], targets->dst[_target]) == 0)
+		return;
+
+	if (_agent->dsts[_target])
+		pfcq_free(_agent->dsts[_target]);
+	_agent->dsts[_target] = pfcq_strdup(targets->dst[_target]);
+	_agent->ports[_target] = targets->port[_target];
+	_agent->instances[_target] = pfcq_fprng_get_u64(&_agent->prng);
+	pfcq_zero(&_agent->last[_target], sizeof(pingtcp_stats_t));
+	_agent->announced[_target] = 0;
+
+	return;
+}
+
+static int __agent_put_target(pingtcp_agent_t* _agent, size_t _id, int _port, const char* _dst, uint64_t _instance)
+{
+	size_t frame = pingtcp_buffer_frame_begin(&_agent->out, PINGTCP_WIRE_TARGET);
+
+	pingtcp_buffer_put_varint(&_agent->out, _id);
+	pingtcp_buffer_put_varint(&_agent->out, _port);
+	pingtcp_buffer_put_string(&_agent->out, _dst);
+	pingtcp_buffer_put_varint(&_agent->out, _instance);
+
+	return __agent_frame_end(_agent, frame);
+}
+
+/* Totals of one target, with just the histogram buckets that changed since the last ones, if any */
+static void __agent_put_totals(pingtcp_agent_t* _agent, size_t _id_delta, const pingtcp_stats_t* _stats, const pingtcp_stats_t* _last)
+{
+	int64_t counters[PINGTCP_WIRE_COUNTERS];
+	size_t buckets = 0;
+	size_t bucket = 0;
+
+	pingtcp_wire_counters(_stats, counters);
+	pingtcp_buffer_put_varint(&_agent->out, _id_delta);
+	for (int i = 0; i < PINGTCP_WIRE_COUNTERS; i++)
+		pingtcp_buffer_put_varint(&_agent->out, counters[i]);
+
+	/* Only RTT samples touch the histogram */
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS && (!_last || _stats->rtt_count != _last->rtt_count); i++)
+		if (_stats->rtt_histogram[i] != (_last ? _last->rtt_histogram[i] : 0))
+			buckets++;
+	pingtcp_buffer_put_varint(&_agent->out, buckets);
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS && buckets > 0; i++)
+	{
+		if (_stats->rtt_histogram[i] == (_last ? _last->rtt_histogram[i] : 0))
+			continue;
+		pingtcp_buffer_put_varint(&_agent->out, i - bucket);
+		pingtcp_buffer_put_varint(&_agent->out, _stats->rtt_histogram[i]);
+		bucket = i;
+		buckets--;
+	}
+
+	return;
+}
+
+/* Results of a removed target are dropped, so what it has got by now is final */
+static void __agent_retire(pingtcp_engine_t* _engine, size_t _target, void* _data)
+{
+	pingtcp_agent_t* agent = _data;
+	pingtcp_agent_retired_t* retired = NULL;
+
+	if (agent->capacity < _engine->targets.capacity)
+		__agent_grow(agent);
+	__agent_track(agent, _target);
+
+	if (agent->retired_count == agent->retired_capacity)
+	{
+		agent->retired_capacity = agent->retired_capacity ? agent->retired_capacity * 2 : 16;
+		agent->retired = agent->retired ?
+			pfcq_realloc(agent->retired, agent->retired_capacity * sizeof(pingtcp_agent_retired_t)) :
+			pfcq_alloc(agent->retired_capacity * sizeof(pingtcp_agent_retired_t));
+	}
+	retired = &agent->retired[agent->retired_count++];
+	pfcq_zero(retired, sizeof(pingtcp_agent_retired_t));
+	retired->target = _target;
+	retired->dst = agent->dsts[_target];
+	retired->port = agent->ports[_target];
+	retired->instance = agent->instances[_target];
+	memcpy(&retired->stats, &_engine->targets.stats[_target], sizeof(pingtcp_stats_t));
+
+	/* Whatever takes the slot next is another instance */
+	agent->dsts[_target] = NULL;
+	agent->announced[_target] = 0;
+
+	return;
+}
+
+int pingtcp_agent_init(pingtcp_agent_t* _agent, pingtcp_engine_t* _engine, const char* _aggregator, const char* _name)
+{
+	struct addrinfo* server = NULL;
+	struct addrinfo hints;
+	char* host = NULL;
+	char* port = NULL;
+	int ret = 0;
+
+	pfcq_zero(_agent, sizeof(pingtcp_agent_t));
+	_agent->engine = _engine;
+	_agent->fd = -1;
+	_agent->name = pfcq_strdup(_name);
+	pfcq_fprng_init(&_agent->prng);
+	pingtcp_buffer_init(&_agent->out);
+	pingtcp_buffer_init(&_agent->in);
+
+	/* host:port, with the host possibly being a bracketed IPv6 address */
+	host = pfcq_strdup(_aggregator[0] == '[' ? _aggregator + 1 : _aggregator);
+	port = strrchr(host, ':');
+	if (unlikely(!port))
+	{
+		pfcq_free(host);
+		return EAI_NONAME;
+	}
+	*port++ = '\0';
+	if (port - host >= 2 && port[-2] == ']')
+		port[-2] = '\0';
+
+	pfcq_zero(&hints, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(host, port, &hints, &server);
+	pfcq_free(host);
+	if (unlikely(ret))
+		return ret;
+	memcpy(&_agent->address, server->ai_addr, server->ai_addrlen);
+	_agent->address_length = server->ai_addrlen;
+	freeaddrinfo(server);
+
+	_engine->on_remove = __agent_retire;
+	_engine->on_remove_data = _agent;
+
+	return 0;
+}
+
+/*
+ * Queues the next part of the report in progress, as long as there is room:
+ * totals of removed targets not sent on this connection yet, then the live
+ * targets AGENT_REPORT_TARGETS at a time, each batch announcing its new
+ * targets before a REPORT frame of those that changed. Frames stay well
+ * within WIRE_FRAME_MAX, and one that does not fit is a broken connection
+ */
+static void __agent_fill(pingtcp_agent_t* _agent)
+{
+	const pingtcp_targets_t* targets = &_agent->engine->targets;
+	int64_t counters[PINGTCP_WIRE_COUNTERS];
+	int64_t last[PINGTCP_WIRE_COUNTERS];
+
+	/* Before their slots are announced again, so that ids refer to the right target meanwhile */
+	for (size_t i = 0; i < _agent->retired_count; i++)
+	{
+		pingtcp_agent_retired_t* retired = &_agent->retired[i];
+		size_t frame = 0;
+
+		if (retired->frame)
+			continue;
+		if (_agent->out.used >= AGENT_QUEUE_SIZE)
+			return;
+		if (unlikely(__agent_put_target(_agent, retired->target, retired->port, retired->dst, retired->instance)))
+			goto broken;
+		frame = pingtcp_buffer_frame_begin(&_agent->out, PINGTCP_WIRE_REPORT);
+		__agent_put_totals(_agent, retired->target, &retired->stats, NULL);
+		if (unlikely(__agent_frame_end(_agent, frame)))
+			goto broken;
+		retired->frame = _agent->frames;
+		_agent->announced[retired->target] = 0;
+	}
+
+	while (_agent->reporting && _agent->out.used < AGENT_QUEUE_SIZE)
+	{
+		size_t end = _agent->cursor + AGENT_REPORT_TARGETS;
+		size_t frame = 0;
+		size_t previous = 0;
+		size_t entries = 0;
+
+		if (_agent->cursor >= targets->count)
+		{
+			_agent->reporting = 0;
+			break;
+		}
+		if (end > targets->count)
+			end = targets->count;
+
+		for (size_t i = _agent->cursor; i < end; i++)
+		{
+			if (targets->state[i] != PINGTCP_TARGET_ACTIVE && targets->state[i] != PINGTCP_TARGET_DONE)
+				continue;
+			__agent_track(_agent, i);
+			if (_agent->announced[i])
+				continue;
+			if (unlikely(__agent_put_target(_agent, i, _agent->ports[i], _agent->dsts[i], _agent->instances[i])))
+				goto broken;
+			_agent->announced[i] = 1;
+		}
+
+		frame = pingtcp_buffer_frame_begin(&_agent->out, PINGTCP_WIRE_REPORT);
+		for (size_t i = _agent->cursor; i < end; i++)
+		{
+			const pingtcp_stats_t* stats = &targets->stats[i];
+
+			if (targets->state[i] != PINGTCP_TARGET_ACTIVE && targets->state[i] != PINGTCP_TARGET_DONE)
+				continue;
+
+			pingtcp_wire_counters(stats, counters);
+			pingtcp_wire_counters(&_agent->last[i], last);
+			if (memcmp(counters, last, sizeof(counters)) == 0)
+				continue;
+
+			__agent_put_totals(_agent, i - previous, stats, &_agent->last[i]);
+			previous = i;
+			entries++;
+		}
+
+		if (entries == 0)
+			_agent->out.used = frame;
+		else if (unlikely(__agent_frame_end(_agent, frame)))
+			goto broken;
+		else
+			for (size_t i = _agent->cursor; i < end; i++)
+				memcpy(&_agent->last[i], &targets->stats[i], sizeof(pingtcp_stats_t));
+
+		_agent->cursor = end;
+	}
+
+	return;
+
+broken:
+	__agent_disconnect(_agent);
+
+	return;
+}
+
+void pingtcp_agent_report(pingtcp_agent_t* _agent)
+{
+	if (_agent->capacity < _agent->engine->targets.capacity)
+		__agent_grow(_agent);
+
+	if (_agent->fd == -1)
+		__agent_connect(_agent);
+	/* Totals stay pending until there is somewhere to send them */
+	if (_agent->fd == -1 || !__agent_established(_agent))
+		return;
+
+	/* One still being queued is carried on rather than started over */
+	if (!_agent->reporting)
+	{
+		_agent->reporting = 1;
+		_agent->cursor = 0;
+	}
+	pingtcp_agent_pump(_agent);
+
+	return;
+}
+
+/* Whether pingtcp_agent_pump() has something to write out */
+int pingtcp_agent_pending(const pingtcp_agent_t* _agent)
+{
+	return _agent->fd != -1 && (_agent->reporting || _agent->out.used > 0);
+}
+
+void pingtcp_agent_pump(pingtcp_agent_t* _agent)
+{
+	if (_agent->fd == -1 || !__agent_established(_agent))
+		return;
+
+	if (_agent->capacity < _agent->engine->targets.capacity)
+		__agent_grow(_agent);
+
+	__agent_receive(_agent);
+	if (_agent->fd == -1)
+		return;
+
+	/* Queued again as soon as the socket has taken all of it */
+	for (;;)
+	{
+		__agent_fill(_agent);
+		__agent_send(_agent);
+		if (_agent->fd == -1 || !_agent->reporting || _agent->out.used > 0)
+			break;
+	}
+
+	return;
+}
+
+/* Until written out and the totals of removed targets acknowledged, or the time is up */
+void pingtcp_agent_flush(pingtcp_agent_t* _agent, int _timeout_ms)
+{
+	struct pollfd pfd;
+	int64_t deadline_ns = pingtcp_now_ns() + (int64_t)_timeout_ms * 1000000LL;
+
+	while (_agent->fd != -1 && (pingtcp_agent_pending(_agent) || _agent->retired_count > 0))
+	{
+		int64_t left_ns = deadline_ns - pingtcp_now_ns();
+
+		if (left_ns <= 0)
+			break;
+		pfd.fd = _agent->fd;
+		pfd.events = POLLIN | (pingtcp_agent_pending(_agent) || !_agent->connected ? POLLOUT : 0);
+		pfd.revents = 0;
+		if (poll(&pfd, 1, (int)(left_ns / 1000000LL) + 1) <= 0)
+			continue;
+		pingtcp_agent_pump(_agent);
+	}
+
+	return;
+}
+
+void pingtcp_agent_done(pingtcp_agent_t* _agent)
+{
+	__agent_disconnect(_agent);
+	if (_agent->engine->on_remove == __agent_retire)
+		_agent->engine->on_remove = NULL;
+	for (size_t i = 0; i < _agent->capacity; i++)
+		if (_agent->dsts[i])
+			pfcq_free(_agent->dsts[i]);
+	if (_agent->capacity)
+	{
+		pfcq_free(_agent->announced);
+		pfcq_free(_agent->ports);
+		pfcq_free(_agent->dsts);
+		pfcq_free(_agent->instances);
+		pfcq_free(_agent->last);
+	}
+	for (size_t i = 0; i < _agent->retired_count; i++)
+		pfcq_free(_agent->retired[i].dst);
+	if (_agent->retired)
+		pfcq_free(_agent->retired);
+	pingtcp_buffer_done(&_agent->out);
+	pingtcp_buffer_done(&_agent->in);
+	pfcq_free(_agent->name);
+	pfcq_zero(_agent, sizeof(pingtcp_agent_t));
+
+	return;
+}
+
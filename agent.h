@@ -0,0 +1,93 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifndef __AGENT_H__
+#define __AGENT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "engine.h"
+#include "wire.h"
+
+#define AGENT_NAME_MAX			256
+#define AGENT_REPORT_TARGETS	256
+#define AGENT_QUEUE_SIZE		(256 * 1024)
+#define AGENT_PUMP_MS			10
+#define AGENT_READ_CHUNK		4096
+
+/* Final statistics of a removed target, kept until the aggregator acknowledges them */
+typedef struct pingtcp_agent_retired
+{
+	size_t target;
+	char* dst;
+	int port;
+	uint64_t frame;
+	uint64_t instance;
+	pingtcp_stats_t stats;
+} pingtcp_agent_retired_t;
+
+/*
+ * Streams the running totals of the engine statistics to an aggregator,
+ * every interval for the targets that changed since the previous report.
+ * A report is queued AGENT_REPORT_TARGETS targets per frame, and no more
+ * than AGENT_QUEUE_SIZE at a time: the rest waits for pingtcp_agent_pump()
+ * to find the socket drained. Nothing is queued until the connection is
+ * established, and after a reconnect every target is reported in full.
+ * The agent takes over on_remove of the engine, and the final totals of
+ * a removed target are sent on every connection until acknowledged
+ */
+typedef struct pingtcp_agent
+{
+	pingtcp_engine_t* engine;
+	char* name;
+	int fd;
+	int connected;
+	int reporting;
+	size_t cursor;
+	uint64_t frames;
+	uint64_t acked;
+	pfcq_net_address_t address;
+	socklen_t address_length;
+	size_t capacity;
+	uint8_t* announced;
+	int* ports;
+	char** dsts;
+	uint64_t* instances;
+	pingtcp_stats_t* last;
+	pfcq_fprng_context_t prng;
+	size_t retired_count;
+	size_t retired_capacity;
+	pingtcp_agent_retired_t* retired;
+	pingtcp_buffer_t out;
+	pingtcp_buffer_t in;
+} pingtcp_agent_t;
+
+int pingtcp_agent_init(pingtcp_agent_t* _agent, pingtcp_engine_t* _engine, const char* _aggregator, const char* _name) __attribute__((nonnull(1, 2, 3), warn_unused_result));
+void pingtcp_agent_report(pingtcp_agent_t* _agent) __attribute__((nonnull(1)));
+int pingtcp_agent_pending(const pingtcp_agent_t* _agent) __attribute__((nonnull(1), warn_unused_result));
+void pingtcp_agent_pump(pingtcp_agent_t* _agent) __attribute__((nonnull(1)));
+void pingtcp_agent_flush(pingtcp_agent_t* _agent, int _timeout_ms) __attribute__((nonnull(1)));
+void pingtcp_agent_done(pingtcp_agent_t* _agent) __attribute__((nonnull(1)));
+
+#endif /* __AGENT_H__ */
+
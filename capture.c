@@ -0,0 +1,339 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+#define PCAP_MAGIC				0xa1b2c3d4
+#define PCAP_MAGIC_NS			0xa1b23c4d
+#define PCAP_HEADER				24
+#define PCAP_RECORD				16
+#define PCAPNG_SHB				0x0a0d0d0a
+#define PCAPNG_IDB				0x00000001
+#define PCAPNG_EPB				0x00000006
+#define PCAPNG_BYTE_ORDER		0x1a2b3c4d
+#define PCAPNG_OPTION_TSRESOL	9
+#define PCAPNG_INTERFACES_MAX	256
+
+#define LINKTYPE_NULL			0
+#define LINKTYPE_ETHERNET		1
+#define LINKTYPE_RAW			101
+#define LINKTYPE_LOOP			108
+#define LINKTYPE_LINUX_SLL		113
+#define LINKTYPE_IPV4			228
+#define LINKTYPE_IPV6			229
+#define LINKTYPE_LINUX_SLL2		276
+
+#define ETHERTYPE_IPV4			0x0800
+#define ETHERTYPE_IPV6			0x86dd
+#define ETHERTYPE_VLAN			0x8100
+#define ETHERTYPE_QINQ			0x88a8
+
+/* Link type and timestamp units of one pcapng interface */
+typedef struct capture_interface
+{
+	uint32_t linktype;
+	int binary;
+	uint8_t resolution;
+} capture_interface_t;
+
+static inline uint16_t __get16(const uint8_t* _data, int _swapped)
+{
+	uint16_t ret = 0;
+
+	memcpy(&ret, _data, sizeof(uint16_t));
+
+	return _swapped ? __builtin_bswap16(ret) : ret;
+}
+
+static inline uint32_t __get32(const uint8_t* _data, int _swapped)
+{
+	uint32_t ret = 0;
+
+	memcpy(&ret, _data, sizeof(uint32_t));
+
+	return _swapped ? __builtin_bswap32(ret) : ret;
+}
+
+static inline uint16_t __get16_be(const uint8_t* _data)
+{
+	return (uint16_t)(_data[0] << 8 | _data[1]);
+}
+
+/* Strips the link layer header, leaving the IP packet if there is one */
+static void __capture_packet(pingtcp_passive_t* _passive, uint32_t _linktype, const uint8_t* _data, size_t _length, int64_t _ts_ns)
+{
+	uint16_t ethertype = 0;
+	size_t header = 0;
+
+	switch (_linktype)
+	{
+		case LINKTYPE_ETHERNET:
+			if (_length < 14)
+				return;
+			ethertype = __get16_be(_data + 12);
+			header = 14;
+			while ((ethertype == ETHERTYPE_VLAN || ethertype == ETHERTYPE_QINQ) && _length >= header + 4)
+			{
+				ethertype = __get16_be(_data + header + 2);
+				header += 4;
+			}
+			if (ethertype != ETHERTYPE_IPV4 && ethertype != ETHERTYPE_IPV6)
+				return;
+			break;
+		case LINKTYPE_LINUX_SLL:
+			if (_length < 16)
+				return;
+			ethertype = __get16_be(_data + 14);
+			header = 16;
+			if (ethertype != ETHERTYPE_IPV4 && ethertype != ETHERTYPE_IPV6)
+				return;
+			break;
+		case LINKTYPE_LINUX_SLL2:
+			if (_length < 20)
+				return;
+			ethertype = __get16_be(_data);
+			header = 20;
+			if (ethertype != ETHERTYPE_IPV4 && ethertype != ETHERTYPE_IPV6)
+				return;
+			break;
+		/* Address family in either byte order, the IP version tells anyway */
+		case LINKTYPE_NULL:
+		case LINKTYPE_LOOP:
+			header = 4;
+			break;
+		case LINKTYPE_RAW:
+		case LINKTYPE_IPV4:
+		case LINKTYPE_IPV6:
+			header = 0;
+			break;
+		default:
+			return;
+	}
+
+	if (_length > header)
+		pingtcp_passive_ip(_passive, _data + header, _length - header, 0, _ts_ns);
+
+	return;
+}
+
+static int __capture_pcap(pingtcp_passive_t* _passive, const uint8_t* _data, size_t _size)
+{
+	uint32_t magic = 0;
+	uint32_t linktype = 0;
+	int swapped = 0;
+	int nanoseconds = 0;
+	size_t offset = PCAP_HEADER;
+
+	memcpy(&magic, _data, sizeof(uint32_t));
+	swapped = magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_MAGIC_NS);
+	nanoseconds = __get32(_data, swapped) == PCAP_MAGIC_NS;
+	/* The upper bits may carry the FCS length */
+	linktype = __get32(_data + 20, swapped) & 0x0fffffff;
+
+	while (offset + PCAP_RECORD <= _size)
+	{
+		uint32_t seconds = __get32(_data + offset, swapped);
+		uint32_t fraction = __get32(_data + offset + 4, swapped);
+		uint32_t length = __get32(_data + offset + 8, swapped);
+		int64_t ts_ns = (int64_t)seconds * 1000000000LL + (nanoseconds ? fraction : (int64_t)fraction * 1000LL);
+
+		offset += PCAP_RECORD;
+		if (offset + length > _size)
+			break;
+		__capture_packet(_passive, linktype, _data + offset, length, ts_ns);
+		offset += length;
+	}
+
+	return 0;
+}
+
+static int64_t __pcapng_ts(const capture_interface_t* _interface, uint64_t _ts)
+{
+	uint64_t units = 1;
+
+	if (_interface->binary)
+		return (int64_t)ldexp((double)_ts * 1000000000.0, -(int)_interface->resolution);
+
+	if (_interface->resolution <= 9)
+	{
+		for (uint8_t i = _interface->resolution; i < 9; i++)
+			units *= 10;
+		return (int64_t)(_ts * units);
+	}
+
+	for (uint8_t i = 9; i < _interface->resolution && i < 28; i++)
+		units *= 10;
+
+	return (int64_t)(_ts / units);
+}
+
+static void __pcapng_interface(capture_interface_t* _interface, const uint8_t* _body, size_t _length, int _swapped)
+{
+	size_t offset = 8;
+
+	_interface->linktype = __get16(_body, _swapped);
+	_interface->binary = 0;
+	_interface->resolution = 6;
+
+	while (offset + 4 <= _length)
+	{
+		uint16_t code = __get16(_body + offset, _swapped);
+		uint16_t length = __get16(_body + offset + 2, _swapped);
+
+		if (code == 0 || offset + 4 + length > _length)
+			break;
+		if (code == PCAPNG_OPTION_TSRESOL && length >= 1)
+		{
+			_interface->binary = _body[offset + 4] >> 7;
+			_interface->resolution = _body[offset + 4] & 0x7f;
+		}
+		offset += 4 + ((length + 3) & ~3U);
+	}
+
+	return;
+}
+
+/*
+ * Blocks other than section headers, interface descriptions and
+ * enhanced packets carry nothing needed here and are skipped
+ */
+static int __capture_pcapng(pingtcp_passive_t* _passive, const uint8_t* _data, size_t _size)
+{
+	capture_interface_t interfaces[PCAPNG_INTERFACES_MAX];
+	size_t interfaces_count = 0;
+	size_t offset = 0;
+	int swapped = 0;
+
+	while (offset + 12 <= _size)
+	{
+		uint32_t type = __get32(_data + offset, swapped);
+		uint32_t length = 0;
+		const uint8_t* body = _data + offset + 8;
+
+		/* Every section may have its own byte order */
+		if (type == PCAPNG_SHB)
+		{
+			uint32_t order = 0;
+
+			memcpy(&order, _data + offset + 8, sizeof(uint32_t));
+			if (order == PCAPNG_BYTE_ORDER)
+				swapped = 0;
+			else if (order == __builtin_bswap32(PCAPNG_BYTE_ORDER))
+				swapped = 1;
+			else
+				return EINVAL;
+			interfaces_count = 0;
+		}
+
+		length = __get32(_data + offset + 4, swapped);
+		if (length < 12 || length % 4 != 0 || offset + length > _size)
+			break;
+
+		switch (type)
+		{
+			case PCAPNG_IDB:
+				if (interfaces_count < PCAPNG_INTERFACES_MAX && length >= 20)
+					__pcapng_interface(&interfaces[interfaces_count++], body, length - 12, swapped);
+				break;
+			case PCAPNG_EPB:
+			{
+				uint32_t interface = 0;
+				uint32_t captured = 0;
+				uint64_t ts = 0;
+
+				if (length < 32)
+					break;
+				interface = __get32(body, swapped);
+				ts = (uint64_t)__get32(body + 4, swapped) << 32 | __get32(body + 8, swapped);
+				captured = __get32(body + 12, swapped);
+				if (interface >= interfaces_count || 20 + (size_t)captured > length - 12)
+					break;
+				__capture_packet(_passive, interfaces[interface].linktype, body + 20, captured,
+						__pcapng_ts(&interfaces[interface], ts));
+				break;
+			}
+			default:
+				break;
+		}
+
+		offset += length;
+	}
+
+	return 0;
+}
+
+int pingtcp_capture_read(const char* _path, pingtcp_passive_t* _passive)
+{
+	struct stat st;
+	uint8_t* data = NULL;
+	uint32_t magic = 0;
+	int fd = -1;
+	int ret = 0;
+
+	fd = open(_path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return errno;
+	if (unlikely(fstat(fd, &st) == -1))
+	{
+		ret = errno;
+		goto out;
+	}
+	if ((size_t)st.st_size < PCAP_HEADER)
+	{
+		ret = EINVAL;
+		goto out;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+	{
+		ret = errno;
+		goto out;
+	}
+	/* Read once front to back, so the kernel may read ahead and drop what is behind */
+	if (unlikely(madvise(data, st.st_size, MADV_SEQUENTIAL) == -1))
+		panic("madvise");
+
+	memcpy(&magic, data, sizeof(uint32_t));
+	if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NS ||
+		magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_MAGIC_NS))
+		ret = __capture_pcap(_passive, data, st.st_size);
+	else if (magic == PCAPNG_SHB)
+		ret = __capture_pcapng(_passive, data, st.st_size);
+	else
+		ret = EINVAL;
+
+	if (unlikely(munmap(data, st.st_size) == -1))
+		panic("munmap");
+
+out:
+	if (unlikely(close(fd) == -1))
+		panic("close");
+
+	return ret;
+}
@@ -0,0 +1,37 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include "passive.h"
+
+/*
+ * Feeds every packet of a pcap or pcapng file into the passive matcher.
+ * The file is mapped rather than read, so captures larger than memory are fine.
+ * Returns 0, or the errno value of what failed, EINVAL meaning a file
+ * of neither format. A capture cut short by a stopped writer ends at its
+ * last complete packet
+ */
+int pingtcp_capture_read(const char* _path, pingtcp_passive_t* _passive) __attribute__((nonnull(1, 2), warn_unused_result));
+
+#endif /* __CAPTURE_H__ */
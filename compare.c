@@ -0,0 +1,283 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compare.h"
+
+typedef struct pingtcp_ranked
+{
+	double value;
+	int from_a;
+} pingtcp_ranked_t;
+
+static int __compare_double(const void* _a, const void* _b)
+{
+	double a = *(const double*)_a;
+	double b = *(const double*)_b;
+
+	return (a > b) - (a < b);
+}
+
+static int __compare_ranked(const void* _a, const void* _b)
+{
+	return __compare_double(&((const pingtcp_ranked_t*)_a)->value, &((const pingtcp_ranked_t*)_b)->value);
+}
+
+/* Nearest rank, since the samples themselves are at hand */
+static size_t __quantile_index(size_t _count, double _quantile)
+{
+	size_t rank = (size_t)(_quantile * (double)_count + 0.5);
+
+	if (rank < 1)
+		rank = 1;
+	if (rank > _count)
+		rank = _count;
+
+	return rank - 1;
+}
+
+/*
+ * Hoare quickselect: puts the k-th smallest value in place, with smaller
+ * values before it and greater ones after, so selecting ascending ranks
+ * one after another only narrows the range left to partition
+ */
+static double __select(double* _values, size_t _count, size_t _k)
+{
+	ptrdiff_t left = 0;
+	ptrdiff_t right = (ptrdiff_t)_count - 1;
+	ptrdiff_t k = (ptrdiff_t)_k;
+
+	while (left < right)
+	{
+		double pivot = _values[left + (right - left) / 2];
+		ptrdiff_t i = left;
+		ptrdiff_t j = right;
+
+		while (i <= j)
+		{
+			while (_values[i] < pivot)
+				i++;
+			while (_values[j] > pivot)
+				j--;
+			if (i <= j)
+			{
+				double swap = _values[i];
+
+				_values[i] = _values[j];
+				_values[j] = swap;
+				i++;
+				j--;
+			}
+		}
+
+		if (k <= j)
+			right = j;
+		else if (k >= i)
+			left = i;
+		else
+			break;
+	}
+
+	return _values[k];
+}
+
+static void __quantiles(double* _values, size_t _count, const double* _quantiles, size_t _quantiles_count, double* _results)
+{
+	size_t from = 0;
+
+	for (size_t i = 0; i < _quantiles_count; i++)
+	{
+		size_t index = __quantile_index(_count, _quantiles[i]);
+
+		/* Everything before the previous rank is already in place */
+		if (index < from)
+			from = 0;
+		_results[i] = __select(_values + from, _count - from, index - from);
+		from = index;
+	}
+
+	return;
+}
+
+static void __resample(const pingtcp_samples_t* _samples, double* _to, pfcq_fprng_context_t* _prng)
+{
+	for (size_t i = 0; i < _samples->count; i++)
+		_to[i] = _samples->values[pfcq_fprng_get_u64(_prng) % _samples->count];
+
+	return;
+}
+
+void pingtcp_samples_add(pingtcp_samples_t* _samples, double _value)
+{
+	if (_samples->count == _samples->capacity)
+	{
+		_samples->capacity = _samples->capacity ? _samples->capacity * 2 : 64;
+		_samples->values = _samples->values ?
+			pfcq_realloc(_samples->values, _samples->capacity * sizeof(double)) :
+			pfcq_alloc(_samples->capacity * sizeof(double));
+	}
+	_samples->values[_samples->count++] = _value;
+
+	return;
+}
+
+void pingtcp_samples_free(pingtcp_samples_t* _samples)
+{
+	if (_samples->values)
+		pfcq_free(_samples->values);
+	pfcq_zero(_samples, sizeof(pingtcp_samples_t));
+
+	return;
+}
+
+/*
+ * Both sets are resampled with replacement independently, since the targets
+ * are probed in turn rather than in pairs. Quickselect keeps every resample linear
+ */
+void pingtcp_compare_deltas(const pingtcp_samples_t* _a, const pingtcp_samples_t* _b, const double* _quantiles, size_t _count,
+		size_t _resamples, pfcq_fprng_context_t* _prng, pingtcp_delta_t* _deltas)
+{
+	double* a = pfcq_alloc(_a->count * sizeof(double));
+	double* b = pfcq_alloc(_b->count * sizeof(double));
+	double* qa = pfcq_alloc(_count * sizeof(double));
+	double* qb = pfcq_alloc(_count * sizeof(double));
+	double* resampled = pfcq_alloc(_count * _resamples * sizeof(double));
+	size_t lower = (size_t)((1.0 - COMPARE_CONFIDENCE) / 2.0 * (double)_resamples);
+	size_t upper = _resamples - 1 - lower;
+
+	memcpy(a, _a->values, _a->count * sizeof(double));
+	memcpy(b, _b->values, _b->count * sizeof(double));
+	__quantiles(a, _a->count, _quantiles, _count, qa);
+	__quantiles(b, _b->count, _quantiles, _count, qb);
+	for (size_t i = 0; i < _count; i++)
+	{
+		_deltas[i].quantile = _quantiles[i];
+		_deltas[i].a = qa[i];
+		_deltas[i].b = qb[i];
+		_deltas[i].delta = qb[i] - qa[i];
+		_deltas[i].lower = _deltas[i].upper = _deltas[i].delta;
+	}
+
+	if (_resamples > 0)
+	{
+		for (size_t i = 0; i < _resamples; i++)
+		{
+			__resample(_a, a, _prng);
+			__resample(_b, b, _prng);
+			__quantiles(a, _a->count, _quantiles, _count, qa);
+			__quantiles(b, _b->count, _quantiles, _count, qb);
+			for (size_t j = 0; j < _count; j++)
+				resampled[j * _resamples + i] = qb[j] - qa[j];
+		}
+
+		for (size_t i = 0; i < _count; i++)
+		{
+			double* deltas = resampled + i * _resamples;
+
+			qsort(deltas, _resamples, sizeof(double), __compare_double);
+			_deltas[i].lower = deltas[lower];
+			_deltas[i].upper = deltas[upper];
+		}
+	}
+
+	pfcq_free(resampled);
+	pfcq_free(qb);
+	pfcq_free(qa);
+	pfcq_free(b);
+	pfcq_free(a);
+
+	return;
+}
+
+void pingtcp_compare_rank_test(const pingtcp_samples_t* _a, const pingtcp_samples_t* _b, pingtcp_rank_test_t* _test)
+{
+	size_t total = _a->count + _b->count;
+	pingtcp_ranked_t* ranked = NULL;
+	double n_a = (double)_a->count;
+	double n_b = (double)_b->count;
+	double n = (double)total;
+	double rank_sum = 0;
+	double ties = 0;
+	double mean = 0;
+	double sigma = 0;
+	double shift = 0;
+
+	pfcq_zero(_test, sizeof(pingtcp_rank_test_t));
+	_test->p = 1;
+	_test->superiority = 0.5;
+	if (_a->count == 0 || _b->count == 0)
+		return;
+
+	ranked = pfcq_alloc(total * sizeof(pingtcp_ranked_t));
+	for (size_t i = 0; i < _a->count; i++)
+	{
+		ranked[i].value = _a->values[i];
+		ranked[i].from_a = 1;
+	}
+	for (size_t i = 0; i < _b->count; i++)
+	{
+		ranked[_a->count + i].value = _b->values[i];
+		ranked[_a->count + i].from_a = 0;
+	}
+	qsort(ranked, total, sizeof(pingtcp_ranked_t), __compare_ranked);
+
+	/* Tied values share the average of their ranks */
+	for (size_t i = 0; i < total;)
+	{
+		size_t j = i;
+		double rank = 0;
+		double tied = 0;
+
+		while (j < total && ranked[j].value == ranked[i].value)
+			j++;
+		rank = (double)(i + 1 + j) / 2.0;
+		tied = (double)(j - i);
+		for (size_t k = i; k < j; k++)
+			if (ranked[k].from_a)
+				rank_sum += rank;
+		ties += tied * tied * tied - tied;
+		i = j;
+	}
+	pfcq_free(ranked);
+
+	_test->u = rank_sum - n_a * (n_a + 1.0) / 2.0;
+	_test->superiority = 1.0 - _test->u / (n_a * n_b);
+
+	mean = n_a * n_b / 2.0;
+	if (total > 1)
+		sigma = sqrt(n_a * n_b / 12.0 * ((n + 1.0) - ties / (n * (n - 1.0))));
+	if (sigma <= 0)
+		return;
+
+	shift = _test->u - mean;
+	if (shift > 0.5)
+		shift -= 0.5;
+	else if (shift < -0.5)
+		shift += 0.5;
+	else
+		shift = 0;
+	_test->z = shift / sigma;
+	_test->p = erfc(fabs(_test->z) / sqrt(2.0));
+
+	return;
+}
@@ -0,0 +1,77 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifndef __COMPARE_H__
+#define __COMPARE_H__
+
+#include <stddef.h>
+
+#include "contrib/pfcq/pfcq.h"
+
+#define COMPARE_RESAMPLES		1000
+#define COMPARE_CONFIDENCE		0.95
+#define COMPARE_ALPHA			0.05
+
+/* Raw handshake times of one target, kept for the comparison */
+typedef struct pingtcp_samples
+{
+	size_t count;
+	size_t capacity;
+	double* values;
+} pingtcp_samples_t;
+
+/*
+ * Difference of a quantile of B from the same quantile of A, with
+ * a percentile bootstrap confidence interval of COMPARE_CONFIDENCE
+ */
+typedef struct pingtcp_delta
+{
+	double quantile;
+	double a;
+	double b;
+	double delta;
+	double lower;
+	double upper;
+} pingtcp_delta_t;
+
+/*
+ * Two-sided Mann-Whitney U test of A against B under the normal approximation,
+ * corrected for ties and continuity. Superiority is the chance that a sample
+ * of B is greater than a sample of A, ties counting half
+ */
+typedef struct pingtcp_rank_test
+{
+	double u;
+	double z;
+	double p;
+	double superiority;
+} pingtcp_rank_test_t;
+
+void pingtcp_samples_add(pingtcp_samples_t* _samples, double _value) __attribute__((nonnull(1)));
+void pingtcp_samples_free(pingtcp_samples_t* _samples) __attribute__((nonnull(1)));
+
+/* Both sample sets must be non-empty, quantiles are expected in ascending order */
+void pingtcp_compare_deltas(const pingtcp_samples_t* _a, const pingtcp_samples_t* _b, const double* _quantiles, size_t _count,
+		size_t _resamples, pfcq_fprng_context_t* _prng, pingtcp_delta_t* _deltas) __attribute__((nonnull(1, 2, 3, 6, 7)));
+void pingtcp_compare_rank_test(const pingtcp_samples_t* _a, const pingtcp_samples_t* _b, pingtcp_rank_test_t* _test) __attribute__((nonnull(1, 2, 3)));
+
+#endif /* __COMPARE_H__ */
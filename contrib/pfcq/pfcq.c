@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <sysexits.h>
 #include <syslog.h>
 #include <time.h>
@@ -42,6 +43,37 @@
 #define STACKITEM_PREFIX_STDERR	"\t"STACKITEM_PREFIX_SYSLOG
 #define WARNING_SUFFIX_SYSLOG	"Warning #%d"
 #define WARNING_SUFFIX_STDERR	WARNING_SUFFIX_SYSLOG", "
+#define LOG_RING_SIZE			65536
+#define LOG_RECORD_MAX			4096
+#define LOG_IOV_MAX				64
+#define LOG_IDLE_NS				1000000ULL
+#define LOG_WRAP				UINT32_MAX
+#define LOG_ALIGN(A)			(((A) + 7) & ~(size_t)7)
+
+/*
+ * Records never wrap around the ring end: a LOG_WRAP header
+ * tells the writer to go on from the ring start
+ */
+typedef struct pfcq_log_record
+{
+	uint32_t length;
+	int32_t fd;
+} pfcq_log_record_t;
+
+/*
+ * Single-producer single-consumer byte ring, one per logging thread.
+ * head and tail are running byte counts, only ever advanced by the producer
+ * and the writer thread respectively
+ */
+typedef struct pfcq_log_ring
+{
+	struct pfcq_log_ring* next;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t dropped;
+	int orphaned;
+	char data[LOG_RING_SIZE] __attribute__((aligned(8)));
+} pfcq_log_ring_t;
 
 static pfcq_size_unit_t pfcq_units[] =
 {
@@ -62,6 +94,50 @@ static int pfcq_do_debug;
 static int pfcq_warnings_count;
 static int pfcq_use_syslog;
 static pthread_mutex_t pfcq_warning_ordering_lock;
+static int pfcq_log_active;
+static int pfcq_log_stopping;
+static int pfcq_log_atexit;
+static int pfcq_log_fatal;
+static unsigned int pfcq_log_generation;
+static uint64_t pfcq_log_orphans_dropped;
+static uint64_t pfcq_log_dropped_count;
+static uint64_t pfcq_log_dropped_reported;
+static pfcq_log_ring_t* pfcq_log_rings;
+static pthread_t pfcq_log_writer;
+static pthread_key_t pfcq_log_key;
+static __thread pfcq_log_ring_t* pfcq_log_ring;
+static __thread unsigned int pfcq_log_ring_generation;
+
+static void __pfcq_log_push(int _fd, const char* _data, size_t _length);
+static size_t __pfcq_log_drain(pfcq_log_ring_t* _ring);
+static size_t __pfcq_append(char* _buffer, size_t _size, size_t _offset, const char* _format, ...) __attribute__((format(printf, 4, 5)));
+
+/* Once stop() or panic() is under way, everything is written directly */
+static int __pfcq_log_queued(void)
+{
+	return __atomic_load_n(&pfcq_log_active, __ATOMIC_ACQUIRE) && !__atomic_load_n(&pfcq_log_fatal, __ATOMIC_ACQUIRE);
+}
+
+/* snprintf() at _offset that never runs past _size, returning the new offset */
+static size_t __pfcq_append(char* _buffer, size_t _size, size_t _offset, const char* _format, ...)
+{
+	va_list arguments;
+	int length = 0;
+
+	if (_offset + 1 >= _size)
+		return _offset;
+
+	va_start(arguments, _format);
+	length = vsnprintf(_buffer + _offset, _size - _offset, _format, arguments);
+	va_end(arguments);
+
+	if (unlikely(length < 0))
+		return _offset;
+	if ((size_t)length >= _size - _offset)
+		return _size - 1;
+
+	return _offset + length;
+}
 
 void __pfcq_debug(int _direct, const char* _format, ...)
 {
@@ -72,7 +148,14 @@ void __pfcq_debug(int _direct, const char* _format, ...)
 	{
 		if (pfcq_use_syslog)
 			vsyslog(LOG_DEBUG, _format, arguments);
-		else
+		else if (__pfcq_log_queued())
+		{
+			char buffer[LOG_RECORD_MAX];
+			int length = vsnprintf(buffer, LOG_RECORD_MAX, _format, arguments);
+
+			if (likely(length > 0))
+				__pfcq_log_push(STDERR_FILENO, buffer, length < LOG_RECORD_MAX ? (size_t)length : LOG_RECORD_MAX - 1);
+		} else
 			vfprintf(stderr, _format, arguments);
 	}
 	va_end(arguments);
@@ -80,7 +163,8 @@ void __pfcq_debug(int _direct, const char* _format, ...)
 	return;
 }
 
-static void show_stacktrace(void)
+/* Printed right away, or appended to _buffer if one is given */
+static size_t show_stacktrace(char* _buffer, size_t _size)
 {
 	unw_cursor_t cursor;
 	unw_context_t uc;
@@ -88,6 +172,7 @@ static void show_stacktrace(void)
 	unw_word_t sp = 0;
 	unw_word_t offp = 0;
 	size_t index = 0;
+	size_t length = 0;
 	char name[STACKITEM_NAME_SIZE];
 
 	pfcq_zero(&cursor, sizeof(unw_cursor_t));
@@ -97,21 +182,45 @@ static void show_stacktrace(void)
 	unw_getcontext(&uc);
 	unw_init_local(&cursor, &uc);
 
-	__pfcq_debug(1, "Stacktrace:\n");
+	if (_buffer)
+		length = __pfcq_append(_buffer, _size, length, "Stacktrace:\n");
+	else
+		__pfcq_debug(1, "Stacktrace:\n");
 	while (unw_step(&cursor) > 0)
 	{
 		unw_get_proc_name(&cursor, name, STACKITEM_NAME_SIZE, &offp);
 		unw_get_reg(&cursor, UNW_REG_IP, &ip);
 		unw_get_reg(&cursor, UNW_REG_SP, &sp);
-		__pfcq_debug(1, pfcq_use_syslog ? STACKITEM_PREFIX_SYSLOG : STACKITEM_PREFIX_STDERR,
-			++index, name, (long)offp, (long)ip, (long)sp);
+		if (_buffer)
+			length = __pfcq_append(_buffer, _size, length, STACKITEM_PREFIX_STDERR,
+				++index, name, (long)offp, (long)ip, (long)sp);
+		else
+			__pfcq_debug(1, pfcq_use_syslog ? STACKITEM_PREFIX_SYSLOG : STACKITEM_PREFIX_STDERR,
+				++index, name, (long)offp, (long)ip, (long)sp);
 	}
 
-	return;
+	return length;
 }
 
 void __pfcq_warning(const char* _message, const int _errno, const char* _file, int _line, int _direct)
 {
+	/* Composed into a single record, so it stays in one piece without the lock */
+	if (__pfcq_log_queued() && !pfcq_use_syslog)
+	{
+		char buffer[LOG_RECORD_MAX];
+		size_t length = 0;
+
+		if (likely(_direct))
+			length = __pfcq_append(buffer, LOG_RECORD_MAX, length, WARNING_SUFFIX_STDERR,
+				__atomic_add_fetch(&pfcq_warnings_count, 1, __ATOMIC_RELAXED));
+		length = __pfcq_append(buffer, LOG_RECORD_MAX, length, "File=%s, line=%d\n", _file, _line);
+		length = __pfcq_append(buffer, LOG_RECORD_MAX, length, "%s: %s\n", _message, strerror(_errno));
+		length += show_stacktrace(buffer + length, LOG_RECORD_MAX - length);
+		__pfcq_log_push(STDERR_FILENO, buffer, length);
+
+		return;
+	}
+
 	if (unlikely(pthread_mutex_lock(&pfcq_warning_ordering_lock)))
 		exit(EX_SOFTWARE);
 	if (likely(_direct))
@@ -121,7 +230,7 @@ void __pfcq_warning(const char* _message, const int _errno, const char* _file, i
 	}
 	__pfcq_debug(1, "File=%s, line=%d\n", _file, _line);
 	__pfcq_debug(1, "%s: %s\n", _message, strerror(_errno));
-	show_stacktrace();
+	show_stacktrace(NULL, 0);
 	if (unlikely(pthread_mutex_unlock(&pfcq_warning_ordering_lock)))
 		exit(EX_SOFTWARE);
 
@@ -135,14 +244,43 @@ void __pfcq_fail(const char* _message, const int _errno)
 	return;
 }
 
+/*
+ * A fatal message must not be lost to a full ring: whatever is queued goes out
+ * first, and the message itself is written directly. Rings are not freed here,
+ * since other threads may still be pushing into them
+ */
+static void __pfcq_log_fatal(void)
+{
+	if (__atomic_exchange_n(&pfcq_log_fatal, 1, __ATOMIC_ACQ_REL))
+		return;
+	if (!__atomic_load_n(&pfcq_log_active, __ATOMIC_ACQUIRE))
+		return;
+
+	/* The writer is the only consumer, so it drains the rings itself */
+	if (pthread_equal(pthread_self(), pfcq_log_writer))
+	{
+		for (pfcq_log_ring_t* ring = __atomic_load_n(&pfcq_log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+			__pfcq_log_drain(ring);
+		return;
+	}
+
+	__atomic_store_n(&pfcq_log_stopping, 1, __ATOMIC_RELEASE);
+	if (likely(pthread_join(pfcq_log_writer, NULL) == 0))
+		__atomic_store_n(&pfcq_log_active, 0, __ATOMIC_RELEASE);
+
+	return;
+}
+
 void __pfcq_stop(const char* _message)
 {
+	__pfcq_log_fatal();
 	__pfcq_debug(1, "%s\n", _message);
 	exit(EX_SOFTWARE);
 }
 
 void __pfcq_panic(const char* _message, const int _errno, const char* _file, int _line)
 {
+	__pfcq_log_fatal();
 	__pfcq_warning(_message, _errno, _file, _line, 0);
 	exit(EX_SOFTWARE);
 }
@@ -171,6 +309,334 @@ void pfcq_debug_done(void)
 	return;
 }
 
+/* Runs on thread exit, so that the writer frees the ring once it is drained */
+static void __pfcq_log_orphan(void* _ring)
+{
+	pfcq_log_ring_t* ring = _ring;
+
+	__atomic_store_n(&ring->orphaned, 1, __ATOMIC_RELEASE);
+
+	return;
+}
+
+/*
+ * The only allocation on the logging path, made once per thread.
+ * Rings are pushed onto the list head lock-free and never removed from the head,
+ * so the writer may unlink other rings without racing with the push
+ */
+static pfcq_log_ring_t* __pfcq_log_ring(void)
+{
+	pfcq_log_ring_t* ring = NULL;
+	unsigned int generation = __atomic_load_n(&pfcq_log_generation, __ATOMIC_ACQUIRE);
+
+	if (likely(pfcq_log_ring && pfcq_log_ring_generation == generation))
+		return pfcq_log_ring;
+
+	ring = pfcq_alloc(sizeof(pfcq_log_ring_t));
+	ring->next = __atomic_load_n(&pfcq_log_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&pfcq_log_rings, &ring->next, ring, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		continue;
+	if (unlikely(pthread_setspecific(pfcq_log_key, ring)))
+		panic("pthread_setspecific");
+
+	pfcq_log_ring = ring;
+	pfcq_log_ring_generation = generation;
+
+	return ring;
+}
+
+/* Never blocks: with no room left, the record is dropped and counted */
+static void __pfcq_log_push(int _fd, const char* _data, size_t _length)
+{
+	pfcq_log_ring_t* ring = __pfcq_log_ring();
+	pfcq_log_record_t* record = NULL;
+	uint64_t head = ring->head;
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	size_t offset = head % LOG_RING_SIZE;
+	size_t size = 0;
+	size_t pad = 0;
+
+	if (unlikely(_length > LOG_RECORD_MAX))
+		_length = LOG_RECORD_MAX;
+	size = LOG_ALIGN(sizeof(pfcq_log_record_t) + _length);
+	if (LOG_RING_SIZE - offset < size)
+		pad = LOG_RING_SIZE - offset;
+
+	if (unlikely(head + pad + size - tail > LOG_RING_SIZE))
+	{
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	if (pad)
+	{
+		((pfcq_log_record_t*)(ring->data + offset))->length = LOG_WRAP;
+		head += pad;
+		offset = 0;
+	}
+
+	record = (pfcq_log_record_t*)(ring->data + offset);
+	record->length = _length;
+	record->fd = _fd;
+	memcpy(record + 1, _data, _length);
+	__atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+
+	return;
+}
+
+static void __pfcq_log_write(int _fd, struct iovec* _iov, int _iov_count)
+{
+	ssize_t res = 0;
+
+	while (_iov_count > 0)
+	{
+		res = writev(_fd, _iov, _iov_count);
+		if (unlikely(res == -1))
+		{
+			if (errno == EINTR)
+				continue;
+			/* Nowhere to write to, so the batch is lost */
+			return;
+		}
+
+		/* Partial write, so the rest is tried again */
+		while (_iov_count > 0 && (size_t)res >= _iov->iov_len)
+		{
+			res -= _iov->iov_len;
+			_iov++;
+			_iov_count--;
+		}
+		if (_iov_count > 0)
+		{
+			_iov->iov_base = (char*)_iov->iov_base + res;
+			_iov->iov_len -= res;
+		}
+	}
+
+	return;
+}
+
+/*
+ * Consecutive records for the same descriptor go out in one writev().
+ * The space is handed back to the producer only once it is written
+ */
+static size_t __pfcq_log_drain(pfcq_log_ring_t* _ring)
+{
+	uint64_t head = __atomic_load_n(&_ring->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = _ring->tail;
+	size_t ret = 0;
+	int fd = -1;
+	int iov_count = 0;
+	struct iovec iov[LOG_IOV_MAX];
+
+	while (tail < head)
+	{
+		pfcq_log_record_t* record = (pfcq_log_record_t*)(_ring->data + tail % LOG_RING_SIZE);
+
+		if (record->length == LOG_WRAP)
+		{
+			tail += LOG_RING_SIZE - tail % LOG_RING_SIZE;
+			continue;
+		}
+
+		if (iov_count == LOG_IOV_MAX || (iov_count > 0 && record->fd != fd))
+		{
+			__pfcq_log_write(fd, iov, iov_count);
+			iov_count = 0;
+			__atomic_store_n(&_ring->tail, tail, __ATOMIC_RELEASE);
+		}
+
+		fd = record->fd;
+		iov[iov_count].iov_base = record + 1;
+		iov[iov_count].iov_len = record->length;
+		iov_count++;
+		tail += LOG_ALIGN(sizeof(pfcq_log_record_t) + record->length);
+		ret++;
+	}
+
+	if (iov_count > 0)
+		__pfcq_log_write(fd, iov, iov_count);
+	__atomic_store_n(&_ring->tail, tail, __ATOMIC_RELEASE);
+
+	return ret;
+}
+
+static void __pfcq_log_drops(void)
+{
+	uint64_t dropped = pfcq_log_orphans_dropped;
+	char buffer[LOG_RECORD_MAX];
+	int length = 0;
+
+	for (pfcq_log_ring_t* ring = __atomic_load_n(&pfcq_log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+		dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	__atomic_store_n(&pfcq_log_dropped_count, dropped, __ATOMIC_RELEASE);
+
+	if (likely(dropped == pfcq_log_dropped_reported))
+		return;
+
+	length = snprintf(buffer, LOG_RECORD_MAX, "Log overloaded, %ju record(s) dropped\n", (uintmax_t)(dropped - pfcq_log_dropped_reported));
+	if (likely(length > 0))
+		if (write(STDERR_FILENO, buffer, length) == -1)
+			__noop;
+	pfcq_log_dropped_reported = dropped;
+
+	return;
+}
+
+/* Polls rather than being woken up, so that producers never make a syscall */
+static void* __pfcq_log_writer(void* _data)
+{
+	(void)_data;
+
+	for (;;)
+	{
+		int stopping = __atomic_load_n(&pfcq_log_stopping, __ATOMIC_ACQUIRE);
+		size_t drained = 0;
+		pfcq_log_ring_t* previous = NULL;
+		pfcq_log_ring_t* ring = __atomic_load_n(&pfcq_log_rings, __ATOMIC_ACQUIRE);
+
+		while (ring)
+		{
+			pfcq_log_ring_t* next = ring->next;
+
+			drained += __pfcq_log_drain(ring);
+
+			if (previous && __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE) &&
+				ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+			{
+				pfcq_log_orphans_dropped += ring->dropped;
+				previous->next = next;
+				pfcq_free(ring);
+			} else
+				previous = ring;
+
+			ring = next;
+		}
+
+		__pfcq_log_drops();
+
+		/* Everything pushed before the stop request has been drained by now */
+		if (stopping)
+			break;
+		if (!drained)
+			pfcq_sleep(LOG_IDLE_NS);
+	}
+
+	return NULL;
+}
+
+static void __pfcq_log_exit(void)
+{
+	pfcq_log_done();
+
+	return;
+}
+
+void pfcq_log_init(void)
+{
+	pthread_attr_t attr;
+	struct sched_param param;
+
+	if (__atomic_load_n(&pfcq_log_active, __ATOMIC_ACQUIRE))
+		return;
+
+	if (unlikely(pthread_key_create(&pfcq_log_key, __pfcq_log_orphan)))
+		panic("pthread_key_create");
+	pfcq_log_orphans_dropped = 0;
+	pfcq_log_dropped_reported = 0;
+	__atomic_store_n(&pfcq_log_dropped_count, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&pfcq_log_stopping, 0, __ATOMIC_RELEASE);
+	/* Rings of a previous run are gone, so every thread has to get a new one */
+	__atomic_add_fetch(&pfcq_log_generation, 1, __ATOMIC_RELEASE);
+
+	if (unlikely(pthread_attr_init(&attr)))
+		panic("pthread_attr_init");
+	pfcq_zero(&param, sizeof(struct sched_param));
+	if (unlikely(pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED) ||
+		pthread_attr_setschedpolicy(&attr, SCHED_OTHER) ||
+		pthread_attr_setschedparam(&attr, &param)))
+		panic("pthread_attr_setsched");
+	if (unlikely(pthread_create(&pfcq_log_writer, &attr, __pfcq_log_writer, NULL)))
+		panic("pthread_create");
+	if (unlikely(pthread_attr_destroy(&attr)))
+		panic("pthread_attr_destroy");
+	__atomic_store_n(&pfcq_log_active, 1, __ATOMIC_RELEASE);
+
+	/* Queued messages of stop() and panic() are written out as well */
+	if (!pfcq_log_atexit)
+	{
+		if (unlikely(atexit(__pfcq_log_exit)))
+			panic("atexit");
+		pfcq_log_atexit = 1;
+	}
+
+	return;
+}
+
+int pfcq_log_affinity(const cpu_set_t* _cpus)
+{
+	if (!__atomic_load_n(&pfcq_log_active, __ATOMIC_ACQUIRE))
+		return 0;
+
+	return pthread_setaffinity_np(pfcq_log_writer, sizeof(cpu_set_t), _cpus);
+}
+
+void pfcq_log_done(void)
+{
+	pfcq_log_ring_t* ring = NULL;
+
+	if (!__atomic_load_n(&pfcq_log_active, __ATOMIC_ACQUIRE))
+		return;
+	/* Called on exit() from the writer itself, which cannot wait for itself */
+	if (unlikely(pthread_equal(pthread_self(), pfcq_log_writer)))
+		return;
+
+	__atomic_store_n(&pfcq_log_stopping, 1, __ATOMIC_RELEASE);
+	if (unlikely(pthread_join(pfcq_log_writer, NULL)))
+		panic("pthread_join");
+	__atomic_store_n(&pfcq_log_active, 0, __ATOMIC_RELEASE);
+
+	if (unlikely(pthread_key_delete(pfcq_log_key)))
+		panic("pthread_key_delete");
+	ring = __atomic_exchange_n(&pfcq_log_rings, NULL, __ATOMIC_ACQ_REL);
+	while (ring)
+	{
+		pfcq_log_ring_t* next = ring->next;
+
+		pfcq_free(ring);
+		ring = next;
+	}
+
+	return;
+}
+
+void pfcq_log(int _fd, const char* _format, ...)
+{
+	va_list arguments;
+	char buffer[LOG_RECORD_MAX];
+	int length = 0;
+
+	va_start(arguments, _format);
+	length = vsnprintf(buffer, LOG_RECORD_MAX, _format, arguments);
+	va_end(arguments);
+	if (unlikely(length <= 0))
+		return;
+	if (length >= LOG_RECORD_MAX)
+		length = LOG_RECORD_MAX - 1;
+
+	if (likely(__pfcq_log_queued()))
+		__pfcq_log_push(_fd, buffer, length);
+	else if (write(_fd, buffer, length) == -1)
+		__noop;
+
+	return;
+}
+
+uint64_t pfcq_log_dropped(void)
+{
+	return __atomic_load_n(&pfcq_log_dropped_count, __ATOMIC_ACQUIRE);
+}
+
 void* pfcq_alloc(size_t _size)
 {
 	void* res = NULL;
@@ -22,6 +22,7 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <sched.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
@@ -106,6 +107,20 @@ void __pfcq_panic(const char* _message, const int _errno, const char* _file, int
 void pfcq_debug_init(int _verbose, int _debug, int _syslog);
 void pfcq_debug_done(void);
 
+/*
+ * Asynchronous logging: every thread appends to its own lock-free ring,
+ * and a writer thread drains them all. Once started, inform() and friends
+ * go through it as well. Records that do not fit are dropped and counted.
+ * pfcq_log_done() writes out what is queued and must not race with producers.
+ * stop() and panic() write out what is queued, then their own message directly.
+ * The writer is a SCHED_OTHER thread whatever the caller runs with
+ */
+void pfcq_log_init(void);
+void pfcq_log_done(void);
+void pfcq_log(int _fd, const char* _format, ...) __attribute__((format(printf, 2, 3), nonnull(2)));
+uint64_t pfcq_log_dropped(void) __attribute__((warn_unused_result));
+int pfcq_log_affinity(const cpu_set_t* _cpus) __attribute__((nonnull(1)));
+
 #ifdef __clang__
 void* pfcq_alloc(size_t _size) __attribute__((malloc, warn_unused_result));
 void* pfcq_realloc(void* _old_pointer, size_t _new_size) __attribute__((malloc, nonnull(1), warn_unused_result));
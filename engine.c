@@ -0,0 +1,1776 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <arpa/inet.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <float.h>
+#include <math.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "shm.h"
+#include "tls.h"
+
+#define RTO_K				4.0
+#define RTO_ALPHA			0.125
+#define RTO_BETA			0.25
+#define ERRQUEUE_CONTROL	512
+
+static const char* pingtcp_failure_names[PINGTCP_FAILURES] =
+{
+	"refused",
+	"unreachable",
+	"timeout",
+	"local",
+	"other",
+};
+
+static void __engine_launch(pingtcp_timer_t* _timer, int64_t _now_ns, void* _data);
+static void __engine_interleave(pingtcp_engine_t* _engine, int64_t _when_ns);
+static void __engine_expire(pingtcp_timer_t* _timer, int64_t _now_ns, void* _data);
+static void __probe_tls(pingtcp_engine_t* _engine, pingtcp_probe_t* _probe, int64_t _now_ns);
+
+int64_t pingtcp_now_ns(void)
+{
+	struct timespec now;
+
+	if (unlikely(clock_gettime(CLOCK_MONOTONIC, &now) == -1))
+		panic("clock_gettime");
+
+	return __pfcq_timespec_to_ns(now);
+}
+
+static void __rto_init(pingtcp_rto_t* _rto, double _floor, double _ceiling)
+{
+	pfcq_zero(_rto, sizeof(pingtcp_rto_t));
+	_rto->floor = _floor > _ceiling ? _ceiling : _floor;
+	_rto->ceiling = _ceiling;
+	/* No samples yet, so the first attempt gets the whole timeout */
+	_rto->rto = _ceiling;
+
+	return;
+}
+
+static void __rto_clamp(pingtcp_rto_t* _rto)
+{
+	if (_rto->rto < _rto->floor)
+		_rto->rto = _rto->floor;
+	if (_rto->rto > _rto->ceiling)
+		_rto->rto = _rto->ceiling;
+
+	return;
+}
+
+static void __rto_sample(pingtcp_rto_t* _rto, double _rtt)
+{
+	if (unlikely(!_rto->valid))
+	{
+		_rto->srtt = _rtt;
+		_rto->rttvar = _rtt / 2.0;
+		_rto->valid = 1;
+	} else
+	{
+		_rto->rttvar = (1.0 - RTO_BETA) * _rto->rttvar + RTO_BETA * fabs(_rto->srtt - _rtt);
+		_rto->srtt = (1.0 - RTO_ALPHA) * _rto->srtt + RTO_ALPHA * _rtt;
+	}
+	_rto->rto = _rto->srtt + RTO_K * _rto->rttvar;
+	__rto_clamp(_rto);
+
+	return;
+}
+
+static void __rto_backoff(pingtcp_rto_t* _rto)
+{
+	_rto->rto *= 2.0;
+	__rto_clamp(_rto);
+
+	return;
+}
+
+void pingtcp_stats_init(pingtcp_stats_t* _stats)
+{
+	pfcq_zero(_stats, sizeof(pingtcp_stats_t));
+	_stats->rtt_min = DBL_MAX;
+	_stats->rtt_max = DBL_MIN;
+
+	return;
+}
+
+void pingtcp_stats_rtt(pingtcp_stats_t* _stats, double _rtt)
+{
+	if (_rtt > _stats->rtt_max)
+		_stats->rtt_max = _rtt;
+	if (_rtt < _stats->rtt_min)
+		_stats->rtt_min = _rtt;
+	_stats->rtt_sum += _rtt;
+	_stats->rtt_sum_sqr += pow(_rtt, 2.0);
+	_stats->rtt_count++;
+	pingtcp_histogram_add(_stats->rtt_histogram, _rtt);
+
+	return;
+}
+
+void pingtcp_stats_failure(pingtcp_stats_t* _stats, pingtcp_failure_t _failure, double _time)
+{
+	pingtcp_failures_t* failures = &_stats->failures[_failure];
+
+	/* A timeout may turn out late afterwards, and min/max could not be undone then */
+	if (_failure == PINGTCP_FAILURE_TIMEOUT)
+	{
+		failures->time_sum += _time;
+		failures->count++;
+		return;
+	}
+
+	if (failures->count == 0 || _time > failures->time_max)
+		failures->time_max = _time;
+	if (failures->count == 0 || _time < failures->time_min)
+		failures->time_min = _time;
+	failures->time_sum += _time;
+	failures->count++;
+
+	return;
+}
+
+static void __series_init(pingtcp_series_t* _series)
+{
+	pfcq_zero(_series, sizeof(pingtcp_series_t));
+	_series->min = DBL_MAX;
+	_series->max = DBL_MIN;
+
+	return;
+}
+
+static void __series_add(pingtcp_series_t* _series, double _time)
+{
+	if (_time > _series->max)
+		_series->max = _time;
+	if (_time < _series->min)
+		_series->min = _time;
+	_series->sum += _time;
+	_series->sum_sqr += pow(_time, 2.0);
+	_series->count++;
+	pingtcp_histogram_add(_series->histogram, _time);
+
+	return;
+}
+
+static void __tls_stats_init(pingtcp_tls_stats_t* _stats)
+{
+	pfcq_zero(_stats, sizeof(pingtcp_tls_stats_t));
+	for (int i = 0; i < PINGTCP_TLS_KINDS; i++)
+	{
+		__series_init(&_stats->tls[i]);
+		__series_init(&_stats->total[i]);
+	}
+
+	return;
+}
+
+static pingtcp_failure_t __errno_failure(int _error)
+{
+	switch (_error)
+	{
+		case ECONNREFUSED:
+		case ECONNRESET:
+			return PINGTCP_FAILURE_REFUSED;
+		case EHOSTUNREACH:
+		case ENETUNREACH:
+		case EHOSTDOWN:
+		case ENETDOWN:
+		case ENONET:
+		case EPROTO:
+			return PINGTCP_FAILURE_UNREACHABLE;
+		case ETIMEDOUT:
+		case EINPROGRESS:
+		case EAGAIN:
+			return PINGTCP_FAILURE_TIMEOUT;
+		case EMFILE:
+		case ENFILE:
+		case ENOBUFS:
+		case ENOMEM:
+		case EADDRNOTAVAIL:
+		case EADDRINUSE:
+		case EPERM:
+		case EACCES:
+			return PINGTCP_FAILURE_LOCAL;
+		default:
+			return PINGTCP_FAILURE_OTHER;
+	}
+}
+
+/*
+ * Fetch the ICMP error queued by IP_RECVERR/IPV6_RECVERR, if any.
+ * It names the hop that rejected the SYN instead of the bare errno
+ */
+static int __socket_errqueue(int _fd, pingtcp_result_t* _result)
+{
+	char payload[64];
+	char control[ERRQUEUE_CONTROL];
+	struct iovec iov;
+	struct msghdr message;
+	struct cmsghdr* cmsg = NULL;
+	struct sock_extended_err* ee = NULL;
+	struct sockaddr* offender = NULL;
+
+	pfcq_zero(&message, sizeof(struct msghdr));
+	iov.iov_base = payload;
+	iov.iov_len = sizeof(payload);
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	if (recvmsg(_fd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+		return 0;
+
+	for (cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg))
+	{
+		if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+			(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+			continue;
+
+		ee = (struct sock_extended_err*)CMSG_DATA(cmsg);
+		if (ee->ee_origin != SO_EE_ORIGIN_ICMP && ee->ee_origin != SO_EE_ORIGIN_ICMP6)
+		{
+			_result->error = ee->ee_errno;
+			continue;
+		}
+
+		_result->icmp = 1;
+		_result->icmp_type = ee->ee_type;
+		_result->icmp_code = ee->ee_code;
+		_result->error = ee->ee_errno;
+		offender = SO_EE_OFFENDER(ee);
+		switch (offender->sa_family)
+		{
+			case AF_INET:
+				inet_ntop(AF_INET, &((struct sockaddr_in*)offender)->sin_addr, _result->icmp_offender.host4, INET_ADDRSTRLEN);
+				break;
+			case AF_INET6:
+				inet_ntop(AF_INET6, &((struct sockaddr_in6*)offender)->sin6_addr, _result->icmp_offender.host6, INET6_ADDRSTRLEN);
+				break;
+			default:
+				break;
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+const char* pingtcp_failure_name(pingtcp_failure_t _failure)
+{
+	if (unlikely(_failure < 0 || _failure >= PINGTCP_FAILURES))
+		return "none";
+
+	return pingtcp_failure_names[_failure];
+}
+
+static int __socket_error(int _fd)
+{
+	int error = 0;
+	socklen_t error_length = sizeof(error);
+
+	if (unlikely(getsockopt(_fd, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1))
+		panic("getsockopt");
+
+	return error;
+}
+
+/*
+ * SYNs sent by the attempt so far: the first one plus kernel retransmits,
+ * or 0 if TCP_INFO is not available
+ */
+static uint32_t __socket_syns(int _fd)
+{
+	struct tcp_info info;
+	socklen_t info_length = sizeof(info);
+
+	pfcq_zero(&info, sizeof(struct tcp_info));
+	if (unlikely(getsockopt(_fd, IPPROTO_TCP, TCP_INFO, &info, &info_length) == -1))
+		return 0;
+
+	return 1 + (info.tcpi_total_retrans > info.tcpi_retransmits ? info.tcpi_total_retrans : info.tcpi_retransmits);
+}
+
+const char* pingtcp_target_name(const pingtcp_engine_t* _engine, size_t _target)
+{
+	return _engine->targets.ptr[_target] ? _engine->targets.ptr[_target] : _engine->targets.dst[_target];
+}
+
+const char* pingtcp_target_host(const pingtcp_engine_t* _engine, size_t _target)
+{
+	return _engine->proto == PF_INET6 ? _engine->targets.host[_target].host6 : _engine->targets.host[_target].host4;
+}
+
+static int __target_exhausted(const pingtcp_engine_t* _engine, size_t _target)
+{
+	return _engine->stopped || _engine->targets.state[_target] != PINGTCP_TARGET_ACTIVE ||
+		(_engine->limit != 0 && _engine->targets.stats[_target].attempt >= _engine->limit);
+}
+
+static void __target_publish(pingtcp_engine_t* _engine, size_t _target)
+{
+	if (_engine->shm && _target < _engine->shm->header->count)
+		pingtcp_shm_publish(_engine->shm, _target, &_engine->targets.stats[_target]);
+
+	return;
+}
+
+/*
+ * A removed target keeps its slot until its last attempt is gone,
+ * so that no probe ever refers to a reused slot
+ */
+static void __target_release(pingtcp_engine_t* _engine, size_t _target)
+{
+	pingtcp_targets_t* targets = &_engine->targets;
+
+	pfcq_free(targets->dst[_target]);
+	if (targets->ptr[_target])
+		pfcq_free(targets->ptr[_target]);
+	pfcq_zero(&targets->rto[_target], sizeof(pingtcp_rto_t));
+	pfcq_zero(&targets->stats[_target], sizeof(pingtcp_stats_t));
+	if (_engine->tls)
+	{
+		if (targets->session[_target])
+			pingtcp_tls_session_free(targets->session[_target]);
+		targets->session[_target] = NULL;
+		pfcq_zero(&targets->tls[_target], sizeof(pingtcp_tls_stats_t));
+	}
+	pfcq_zero(&targets->address[_target], sizeof(pfcq_net_address_t));
+	pfcq_zero(&targets->host[_target], sizeof(pfcq_net_host_t));
+	targets->port[_target] = 0;
+	targets->state[_target] = PINGTCP_TARGET_VACANT;
+	targets->vacant[targets->vacant_count++] = _target;
+
+	/* Readers skip the slot until it is reused */
+	if (_engine->shm && _target < _engine->shm->header->count)
+	{
+		pingtcp_shm_describe(_engine->shm, _target, "", 0, &targets->host[_target]);
+		pingtcp_shm_publish(_engine->shm, _target, &targets->stats[_target]);
+	}
+
+	return;
+}
+
+static void __target_check_done(pingtcp_engine_t* _engine, size_t _target)
+{
+	pingtcp_targets_t* targets = &_engine->targets;
+
+	/* A waiting target is looked at again once it leaves the ring */
+	if (targets->current[_target] || targets->late_count[_target] || targets->queued[_target])
+		return;
+
+	switch (targets->state[_target])
+	{
+		case PINGTCP_TARGET_ACTIVE:
+			if (!__target_exhausted(_engine, _target))
+				return;
+			pingtcp_wheel_del(&_engine->wheel, &targets->timer[_target]);
+			targets->state[_target] = PINGTCP_TARGET_DONE;
+			_engine->active--;
+			break;
+		case PINGTCP_TARGET_REMOVED:
+			__target_release(_engine, _target);
+			break;
+		default:
+			break;
+	}
+
+	return;
+}
+
+static void __target_schedule(pingtcp_engine_t* _engine, size_t _target, int64_t _when_ns)
+{
+	if (__target_exhausted(_engine, _target))
+		__target_check_done(_engine, _target);
+	else if (!_engine->interleaved)
+		pingtcp_wheel_add(&_engine->wheel, &_engine->targets.timer[_target], _when_ns);
+
+	/* Whatever has finished, the next target in turn goes on */
+	if (_engine->interleaved)
+		__engine_interleave(_engine, _when_ns);
+
+	return;
+}
+
+static void __targets_grow(pingtcp_engine_t* _engine)
+{
+	pingtcp_targets_t* targets = &_engine->targets;
+	size_t capacity = targets->capacity ? targets->capacity * 2 : 16;
+	int64_t* deadlines = NULL;
+
+	/* Launch timers live in the array being moved, so they are taken off the wheel meanwhile */
+	if (_engine->running && targets->count > 0)
+	{
+		deadlines = pfcq_alloc(targets->count * sizeof(int64_t));
+		for (size_t i = 0; i < targets->count; i++)
+		{
+			deadlines[i] = WHEEL_NEVER;
+			if (!pingtcp_timer_pending(&targets->timer[i]))
+				continue;
+			deadlines[i] = pingtcp_timer_expires_ns(&_engine->wheel, &targets->timer[i]);
+			pingtcp_wheel_del(&_engine->wheel, &targets->timer[i]);
+		}
+	}
+
+	/* The ring is laid out from its head again, since its wrap point moves */
+	if (targets->waiting_count > 0 && targets->waiting_head > 0)
+	{
+		size_t* waiting = pfcq_alloc(targets->capacity * sizeof(size_t));
+
+		for (size_t i = 0; i < targets->waiting_count; i++)
+			waiting[i] = targets->waiting[(targets->waiting_head + i) % targets->capacity];
+		memcpy(targets->waiting, waiting, targets->waiting_count * sizeof(size_t));
+		pfcq_free(waiting);
+	}
+	targets->waiting_head = 0;
+
+#define __TARGETS_RESIZE(A) \
+	targets->A = targets->A ? pfcq_realloc(targets->A, capacity * sizeof(*targets->A)) : pfcq_alloc(capacity * sizeof(*targets->A)); \
+	pfcq_zero(targets->A + targets->capacity, (capacity - targets->capacity) * sizeof(*targets->A))
+
+	__TARGETS_RESIZE(timer);
+	__TARGETS_RESIZE(rto);
+	__TARGETS_RESIZE(stats);
+	__TARGETS_RESIZE(current);
+	__TARGETS_RESIZE(late);
+	__TARGETS_RESIZE(late_count);
+	__TARGETS_RESIZE(state);
+	__TARGETS_RESIZE(queued);
+	__TARGETS_RESIZE(vacant);
+	__TARGETS_RESIZE(waiting);
+	__TARGETS_RESIZE(order);
+	__TARGETS_RESIZE(address);
+	__TARGETS_RESIZE(port);
+	__TARGETS_RESIZE(dst);
+	__TARGETS_RESIZE(ptr);
+	__TARGETS_RESIZE(host);
+	/* Four histograms per target are too much to carry along unless needed */
+	if (_engine->tls)
+	{
+		__TARGETS_RESIZE(tls);
+		__TARGETS_RESIZE(session);
+	}
+
+#undef __TARGETS_RESIZE
+
+	targets->capacity = capacity;
+	/* Targets past the segment are simply not published, the caller reports it */
+	if (_engine->shm)
+	{
+		int res = pingtcp_shm_grow(_engine->shm, capacity);
+
+		if (unlikely(res != 0))
+			_engine->shm_error = res;
+	}
+
+	/* Heads of the late lists have moved as well */
+	for (size_t i = 0; i < targets->count; i++)
+		if (targets->late[i])
+			targets->late[i]->pprev = &targets->late[i];
+
+	if (deadlines)
+	{
+		for (size_t i = 0; i < targets->count; i++)
+			if (deadlines[i] != WHEEL_NEVER)
+				pingtcp_wheel_add(&_engine->wheel, &targets->timer[i], deadlines[i]);
+		pfcq_free(deadlines);
+	}
+
+	return;
+}
+
+static void __targets_free(pingtcp_targets_t* _targets)
+{
+	for (size_t i = 0; i < _targets->count; i++)
+	{
+		if (_targets->dst[i])
+			pfcq_free(_targets->dst[i]);
+		if (_targets->ptr[i])
+			pfcq_free(_targets->ptr[i]);
+		if (_targets->session && _targets->session[i])
+			pingtcp_tls_session_free(_targets->session[i]);
+	}
+
+	if (_targets->capacity)
+	{
+		pfcq_free(_targets->timer);
+		pfcq_free(_targets->rto);
+		pfcq_free(_targets->stats);
+		pfcq_free(_targets->current);
+		pfcq_free(_targets->late);
+		pfcq_free(_targets->late_count);
+		pfcq_free(_targets->state);
+		pfcq_free(_targets->queued);
+		pfcq_free(_targets->vacant);
+		pfcq_free(_targets->waiting);
+		pfcq_free(_targets->order);
+		pfcq_free(_targets->address);
+		pfcq_free(_targets->port);
+		pfcq_free(_targets->dst);
+		pfcq_free(_targets->ptr);
+		pfcq_free(_targets->host);
+	}
+	if (_targets->tls)
+		pfcq_free(_targets->tls);
+	if (_targets->session)
+		pfcq_free(_targets->session);
+	pfcq_zero(_targets, sizeof(pingtcp_targets_t));
+
+	return;
+}
+
+static void __spin_place(pingtcp_engine_t* _engine, pingtcp_probe_t* _probe, size_t _slot)
+{
+	_engine->spin[_slot] = _probe;
+	_probe->spin_slot = _slot + 1;
+
+	return;
+}
+
+static void __spin_sift(pingtcp_engine_t* _engine, size_t _slot)
+{
+	pingtcp_probe_t* probe = _engine->spin[_slot];
+
+	/* Up while earlier than the parent */
+	while (_slot > 0 && _engine->spin[(_slot - 1) / 2]->expected_ns > probe->expected_ns)
+	{
+		__spin_place(_engine, _engine->spin[(_slot - 1) / 2], _slot);
+		_slot = (_slot - 1) / 2;
+	}
+
+	/* Down while later than the earliest child */
+	for (;;)
+	{
+		size_t child = _slot * 2 + 1;
+
+		if (child >= _engine->spin_count)
+			break;
+		if (child + 1 < _engine->spin_count && _engine->spin[child + 1]->expected_ns < _engine->spin[child]->expected_ns)
+			child++;
+		if (_engine->spin[child]->expected_ns >= probe->expected_ns)
+			break;
+		__spin_place(_engine, _engine->spin[child], _slot);
+		_slot = child;
+	}
+
+	__spin_place(_engine, probe, _slot);
+
+	return;
+}
+
+/* An attempt is expected to complete SRTT after its start, or right away before the first sample */
+static void __spin_add(pingtcp_engine_t* _engine, pingtcp_probe_t* _probe)
+{
+	const pingtcp_rto_t* rto = &_engine->targets.rto[_probe->target];
+
+	_probe->expected_ns = _probe->start_ns;
+	if (rto->valid)
+		_probe->expected_ns += (int64_t)(rto->srtt * 1000000.0);
+
+	if (unlikely(!_engine->spin))
+	{
+		_engine->spin_capacity = ENGINE_SPIN_MIN;
+		_engine->spin = pfcq_alloc(_engine->spin_capacity * sizeof(pingtcp_probe_t*));
+	} else if (_engine->spin_count == _engine->spin_capacity)
+	{
+		_engine->spin_capacity *= 2;
+		_engine->spin = pfcq_realloc(_engine->spin, _engine->spin_capacity * sizeof(pingtcp_probe_t*));
+	}
+	__spin_place(_engine, _probe, _engine->spin_count++);
+	__spin_sift(_engine, _engine->spin_count - 1);
+
+	return;
+}
+
+/* The last entry takes the place of the removed one */
+static void __spin_del(pingtcp_engine_t* _engine, pingtcp_probe_t* _probe)
+{
+	size_t slot = _probe->spin_slot;
+
+	if (!slot)
+		return;
+	_probe->spin_slot = 0;
+	if (--slot == --_engine->spin_count)
+		return;
+	__spin_place(_engine, _engine->spin[_engine->spin_count], slot);
+	__spin_sift(_engine, slot);
+
+	return;
+}
+
+static void __probe_free(pingtcp_engine_t* _engine, pingtcp_probe_t* _probe)
+{
+	pingtcp_wheel_del(&_engine->wheel, &_probe->timer);
+	__spin_del(_engine, _probe);
+	if (_probe->pprev)
+	{
+		*_probe->pprev = _probe->next;
+		if (_probe->next)
+			_probe->next->pprev = _probe->pprev;
+		_engine->targets.late_count[_probe->target]--;
+	}
+	if (_probe->lingering)
+		_engine->lingering--;
+	/* Before the socket it is on goes away */
+	if (_probe->ssl)
+		pingtcp_tls_close(_probe->ssl);
+	if (_probe->ticket)
+		pingtcp_tls_session_free(_probe->ticket);
+	/* Closing the socket removes it from the epoll set as well */
+	if (likely(_probe->fd != -1))
+		if (unlikely(_engine->sys.close(_probe->fd) == -1))
+			panic("close");
+	pingtcp_pool_put(&_engine->probes, _probe);
+
+	return;
+}
+
+/*
+ * Account SYNs of an attempt at packet level. Called again for late attempts,
+ * so only the difference from what has been accounted already is added
+ */
+static void __probe_syns(pingtcp_engine_t* _engine, pingtcp_probe_t* _probe, int _answered)
+{
+	pingtcp_stats_t* stats = &_engine->targets.stats[_probe->target];
+	uint32_t sent = 0;
+	uint32_t lost = 0;
+
+	/* TOR mode talks to the local proxy, so its SYNs tell nothing about the target */
+	if (_engine->blocking || _probe->fd == -1)
+		return;
+
+	sent = __socket_syns(_probe->fd);
+	if (unlikely(sent < _probe->syn_sent))
+		return;
+	lost = _answered ? sent - 1 : sent;
+
+	stats->syn_sent += sent - _probe->syn_sent;
+	stats->syn_lost = stats->syn_lost + lost - _probe->syn_lost;
+	_probe->syn_sent = sent;
+	_probe->syn_lost = lost;
+
+	return;
+}
+
+static void __probe_classify(const pingtcp_probe_t* _probe, int _error, int _timed_out, int64_t _now_ns, pingtcp_result_t* _result)
+{
+	pfcq_zero(_result, sizeof(pingtcp_result_t));
+	_result->target = _probe->target;
+	_result->attempt = _probe->attempt;
+	_result->late = _probe->late;
+	_result->time_ms = (double)(_now_ns - _probe->start_ns) / 1000000.0;
+	_result->error = _error;
+
+	if (likely(_error == 0 && !_timed_out))
+	{
+		_result->failure = PINGTCP_FAILURE_NONE;
+		return;
+	}
+
+	/* An ICMP error wins over both the errno and the deadline, since it tells the actual reason */
+	if (_probe->fd != -1 && __socket_errqueue(_probe->fd, _result))
+		_result->failure = PINGTCP_FAILURE_UNREACHABLE;
+	else if (_timed_out)
+		_result->failure = PINGTCP_FAILURE_TIMEOUT;
+	else
+		_result->failure = __errno_failure(_error);
+
+	return;
+}
+
+/*
+ * A handshake that needed SYN retransmits measures the retransmission timer
+ * rather than the path, so it is left out of both the RTT and the RTO estimate (Karn)
+ */
+static void __probe_rtt(pingtcp_engine_t* _engine, size_t _target, const pingtcp_result_t* _result)
+{
+	if (_result->syn_retrans > 0)
+	{
+		_engine->targets.stats[_target].retransmitted++;
+		return;
+	}
+
+	pingtcp_stats_rtt(&_engine->targets.stats[_target], _result->time_ms);
+	__rto_sample(&_engine->targets.rto[_target], _result->time_ms);
+
+	return;
+}
+
+/*
+ * Starts the TLS handshake once the TCP one has completed. It gets whatever
+ * is left of the hard timeout rather than the adaptive deadline, which is
+ * derived from TCP handshakes only
+ */
+static void __probe_secure(pingtcp_engine_t* _engine, pingtcp_probe_t* _probe, int64_t _now_ns)
+{
+	pingtcp_targets_t* targets = &_engine->targets;
+	struct ssl_session_st* session = targets->session[_probe->target];
+
+	_probe->connected_ns = _now_ns;
+	_probe->offered = session && _probe->attempt % 2 == 0;
+	_probe->ssl = pingtcp_tls_open(_engine->tls, _probe->fd, targets->dst[_probe->target],
+			_probe->offered ? session : NULL, &_probe->ticket);
+	__probe_tls(_engine, _probe, _now_ns);
+
+	return;
+}
+
+/* The newest session is offered next time */
+static void __probe_keep_ticket(pingtcp_engine_t* _engine, pingtcp_probe_t* _probe)
+{
+	pingtcp_targets_t* targets = &_engine->targets;
+
+	if (!_probe->ticket)
+		return;
+
+	if (targets->session[_probe->target])
+		pingtcp_tls_session_free(targets->session[_probe->target]);
+	targets->session[_probe->target] = _probe->ticket;
+	_probe->ticket = NULL;
+
+	return;
+}
+
+/*
+ * Resumption is offered on even attempts, so only the ticket of an odd one
+ * is of any use, unless no attempt follows it. Tickets of TLS 1.2 and older
+ * come with the handshake
+ */
+static int __probe_ticket_wanted(const pingtcp_engine_t* _engine, const pingtcp_probe_t* _probe)
+{
+	return !_probe->ticket && !_engine->stopped && pingtcp_tls_tickets_later(_probe->ssl) &&
+		_probe->attempt % 2 == 1 && (_engine->limit == 0 || _probe->attempt < _engine->limit);
+}
+
+/* As long as the TLS handshake took, which is about when the ticket is due, but not past the hard timeout */
+static int64_t __probe_ticket_deadline_ns(const pingtcp_engine_t* _engine, const pingtcp_probe_t* _probe)
+{
+	int64_t grace_ns = _probe->secured_ns - _probe->connected_ns;
+	int64_t ret = 0;
+
+	if (grace_ns < ENGINE_TICKET_GRACE_NS)
+		grace_ns = ENGINE_TICKET_GRACE_NS;
+	ret = _probe->secured_ns + grace_ns;
+
+	return ret < _probe->start_ns + _engine->timeout_ns ? ret : _probe->start_ns + _engine->timeout_ns;
+}
+
+static void __probe_tls_account(pingtcp_engine_t* _engine, pingtcp_probe_t* _probe, int _timed_out, int64_t _now_ns, pingtcp_result_t* _result)
+{
+	pingtcp_targets_t* targets = &_engine->targets;
+	pingtcp_tls_stats_t* stats = &targets->tls[_probe->target];
+	pingtcp_tls_kind_t kind = PINGTCP_TLS_FULL;
+
+	_result->tls = 1;
+	stats->attempt++;
+	if (_probe->offered)
+		stats->offered++;
+
+	if (likely(_probe->secured_ns))
+	{
+		_result->tls_resumed = pingtcp_tls_resumed(_probe->ssl);
+		kind = _result->tls_resumed ? PINGTCP_TLS_RESUMED : PINGTCP_TLS_FULL;
+		_result->tls_ms = (double)(_probe->secured_ns - _probe->connected_ns) / 1000000.0;
+		_result->total_ms = (double)(_probe->secured_ns - _probe->start_ns) / 1000000.0;
+		__series_add(&stats->tls[kind], _result->tls_ms);
+		__series_add(&stats->total[kind], _result->total_ms);
+	} else
+	{
+		_result->tls_failed = 1;
+		_result->tls_timed_out = _timed_out;
+		_result->tls_error = _probe->tls_error;
+		_result->tls_ms = (double)(_now_ns - _probe->connected_ns) / 1000000.0;
+		_result->total_ms = (double)(_now_ns - _probe->start_ns) / 1000000.0;
+		if (_timed_out)
+			stats->timed_out++;
+		else
+			stats->failed++;
+	}
+
+	__probe_keep_ticket(_engine, _probe);
+
+	return;
+}
+
+/* Kept on the late list of its target until the deadline */
+static void __probe_watch(pingtcp_engine_t* _engine, pingtcp_probe_t* _probe, int64_t _deadline_ns)
+{
+	pingtcp_targets_t* targets = &_engine->targets;
+
+	_probe->next = targets->late[_probe->target];
+	if (_probe->next)
+		_probe->next->pprev = &_probe->next;
+	_probe->pprev = &targets->late[_probe->target];
+	targets->late[_probe->target] = _probe;
+	targets->late_count[_probe->target]++;
+	pingtcp_wheel_add(&_engine->wheel, &_probe->timer, _deadline_ns);
+
+	return;
+}
+
+/* The attempt is over, but its connection stays open to take in the session ticket */
+static void __probe_linger(pingtcp_engine_t* _engine, pingtcp_probe_t* _probe)
+{
+	struct epoll_event event;
+
+	pfcq_zero(&event, sizeof(struct epoll_event));
+	event.events = EPOLLIN;
+	event.data.ptr = _probe;
+	if (unlikely(epoll_ctl(_engine->epoll_fd, EPOLL_CTL_MOD, _probe->fd, &event) == -1))
+	{
+		__probe_free(_engine, _probe);
+		return;
+	}
+
+	_probe->lingering = 1;
+	_engine->lingering++;
+	__probe_watch(_engine, _probe, __probe_ticket_deadline_ns(_engine, _probe));
+
+	return;
+}
+
+static void __probe_finish(pingtcp_engine_t* _engine, pingtcp_probe_t* _probe, int _error, int _timed_out, int64_t _now_ns)
+{
+	pingtcp_targets_t* targets = &_engine->targets;
+	size_t target = _probe->target;
+	pingtcp_stats_t* stats = &targets->stats[target];
+	pingtcp_result_t result;
+	int linger = 0;
+
+	/* Results of a removed target are of no interest to anyone */
+	if (unlikely(targets->state[target] == PINGTCP_TARGET_REMOVED))
+	{
+		targets->current[target] = NULL;
+		__probe_free(_engine, _probe);
+		__target_check_done(_engine, target);
+		if (_engine->interleaved)
+			__engine_interleave(_engine, _now_ns + _engine->interval_ns);
+		return;
+	}
+
+	if (_engine->tls && !_probe->connected_ns && _error == 0 && !_timed_out)
+	{
+		__probe_secure(_engine, _probe, _now_ns);
+		return;
+	}
+
+	/* The TCP part of a TLS attempt is over already, however the TLS one has ended */
+	if (_probe->connected_ns)
+		__probe_classify(_probe, 0, 0, _probe->connected_ns, &result);
+	else
+		__probe_classify(_probe, _error, _timed_out, _now_ns, &result);
+
+	switch (result.failure)
+	{
+		case PINGTCP_FAILURE_NONE:
+		case PINGTCP_FAILURE_REFUSED:
+		case PINGTCP_FAILURE_UNREACHABLE:
+		case PINGTCP_FAILURE_TIMEOUT:
+			__probe_syns(_engine, _probe, result.failure != PINGTCP_FAILURE_TIMEOUT);
+			if (_probe->syn_sent > 0)
+				result.syn_retrans = _probe->syn_sent - 1;
+			break;
+		default:
+			break;
+	}
+
+	switch (result.failure)
+	{
+		case PINGTCP_FAILURE_NONE:
+			__probe_rtt(_engine, target, &result);
+			stats->ok++;
+			break;
+		case PINGTCP_FAILURE_TIMEOUT:
+			pingtcp_stats_failure(stats, result.failure, result.time_ms);
+			__rto_backoff(&targets->rto[target]);
+			stats->lost++;
+			break;
+		default:
+			pingtcp_stats_failure(stats, result.failure, result.time_ms);
+			stats->fail++;
+			break;
+	}
+
+	if (_probe->connected_ns)
+	{
+		linger = _probe->secured_ns && !_engine->blocking && __probe_ticket_wanted(_engine, _probe);
+		__probe_tls_account(_engine, _probe, _timed_out, _now_ns, &result);
+	}
+
+	targets->current[target] = NULL;
+	__spin_del(_engine, _probe);
+
+	if (result.failure == PINGTCP_FAILURE_TIMEOUT && !_engine->stopped &&
+		_now_ns < _probe->start_ns + _engine->timeout_ns && targets->late_count[target] < _engine->late_max)
+	{
+		/* Keep watching the socket until the hard timeout */
+		_probe->late = 1;
+		_probe->expired_ms = result.time_ms;
+		__probe_watch(_engine, _probe, _probe->start_ns + _engine->timeout_ns);
+	} else if (linger)
+		__probe_linger(_engine, _probe);
+	else
+		__probe_free(_engine, _probe);
+
+	__target_publish(_engine, target);
+	__target_schedule(_engine, target, _now_ns + _engine->interval_ns);
+
+	/* Reported last, so that the callback may remove the target */
+	if (_engine->on_result)
+		_engine->on_result(_engine, &result, _engine->on_result_data);
+
+	return;
+}
+
+/*
+ * Advances the TLS handshake of an attempt, which is over as soon as the
+ * handshake is. A TLS 1.3 session ticket only follows the handshake, so
+ * one already there is taken, and a blocking socket waits for it for
+ * as long as the ticket would be lingered for otherwise.
+ * A blocking socket only gives up on its receive timeout
+ */
+static void __probe_tls(pingtcp_engine_t* _engine, pingtcp_probe_t* _probe, int64_t _now_ns)
+{
+	pingtcp_tls_status_t status = PINGTCP_TLS_DONE;
+	struct epoll_event event;
+	struct timeval timeout;
+	int error = 0;
+
+	status = pingtcp_tls_handshake(_probe->ssl, &_probe->tls_error);
+	if (status == PINGTCP_TLS_DONE)
+	{
+		_probe->secured_ns = pingtcp_now_ns();
+		if (__probe_ticket_wanted(_engine, _probe))
+		{
+			if (_engine->blocking)
+			{
+				timeout = __pfcq_us_to_timeval((uint64_t)((__probe_ticket_deadline_ns(_engine, _probe) - _probe->secured_ns) / 1000));
+				if (setsockopt(_probe->fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout)) == 0)
+					status = pingtcp_tls_read(_probe->ssl);
+			} else
+				status = pingtcp_tls_read(_probe->ssl);
+		}
+		__probe_finish(_engine, _probe, 0, 0, _probe->secured_ns);
+		return;
+	} else if (status == PINGTCP_TLS_ERROR)
+	{
+		__probe_finish(_engine, _probe, EPROTO, 0, pingtcp_now_ns());
+		return;
+	}
+
+	if (_engine->blocking)
+	{
+		__probe_finish(_engine, _probe, ETIMEDOUT, 1, _now_ns);
+		return;
+	}
+
+	pfcq_zero(&event, sizeof(struct epoll_event));
+	event.events = status == PINGTCP_TLS_WANT_WRITE ? EPOLLOUT : EPOLLIN;
+	event.data.ptr = _probe;
+	if (unlikely(epoll_ctl(_engine->epoll_fd, EPOLL_CTL_MOD, _probe->fd, &event) == -1))
+	{
+		error = errno;
+		__probe_finish(_engine, _probe, error, 0, pingtcp_now_ns());
+		return;
+	}
+	pingtcp_wheel_add(&_engine->wheel, &_probe->timer, _probe->start_ns + _engine->timeout_ns);
+
+	return;
+}
+
+/* Reads what followed the handshake of a lingering attempt until the ticket is there */
+static void __probe_ticket(pingtcp_engine_t* _engine, pingtcp_probe_t* _probe)
+{
+	pingtcp_tls_status_t status = pingtcp_tls_read(_probe->ssl);
+	size_t target = _probe->target;
+	struct epoll_event event;
+
+	if (!_probe->ticket && (status == PINGTCP_TLS_WANT_READ || status == PINGTCP_TLS_WANT_WRITE))
+	{
+		pfcq_zero(&event, sizeof(struct epoll_event));
+		event.events = status == PINGTCP_TLS_WANT_WRITE ? EPOLLOUT : EPOLLIN;
+		event.data.ptr = _probe;
+		if (likely(epoll_ctl(_engine->epoll_fd, EPOLL_CTL_MOD, _probe->fd, &event) == 0))
+		{
+			pingtcp_wheel_add(&_engine->wheel, &_probe->timer, __probe_ticket_deadline_ns(_engine, _probe));
+			return;
+		}
+	}
+
+	if (likely(_engine->targets.state[target] != PINGTCP_TARGET_REMOVED))
+		__probe_keep_ticket(_engine, _probe);
+	__probe_free(_engine, _probe);
+	__target_check_done(_engine, target);
+
+	return;
+}
+
+static void __probe_late(pingtcp_engine_t* _engine, pingtcp_probe_t* _probe, int64_t _now_ns)
+{
+	pingtcp_targets_t* targets = &_engine->targets;
+	size_t target = _probe->target;
+	pingtcp_stats_t* stats = &targets->stats[target];
+	pingtcp_result_t result;
+
+	if (unlikely(targets->state[target] == PINGTCP_TARGET_REMOVED))
+	{
+		__probe_free(_engine, _probe);
+		__target_check_done(_engine, target);
+		return;
+	}
+
+	__probe_classify(_probe, __socket_error(_probe->fd), 0, _now_ns, &result);
+	__probe_syns(_engine, _probe, result.failure != PINGTCP_FAILURE_TIMEOUT);
+	if (result.failure == PINGTCP_FAILURE_NONE)
+	{
+		if (_probe->syn_sent > 0)
+			result.syn_retrans = _probe->syn_sent - 1;
+		__probe_rtt(_engine, target, &result);
+
+		/* Reclassified, so it is not a timeout anymore */
+		stats->failures[PINGTCP_FAILURE_TIMEOUT].count--;
+		stats->failures[PINGTCP_FAILURE_TIMEOUT].time_sum -= _probe->expired_ms;
+		stats->late++;
+		stats->lost--;
+	}
+
+	__target_publish(_engine, target);
+	__probe_free(_engine, _probe);
+	__target_check_done(_engine, target);
+
+	if (result.failure == PINGTCP_FAILURE_NONE && _engine->on_result)
+		_engine->on_result(_engine, &result, _engine->on_result_data);
+
+	return;
+}
+
+/* Every attempt in the pool holds a socket, late ones included */
+static int __engine_window_full(const pingtcp_engine_t* _engine)
+{
+	return _engine->window > 0 && _engine->probes.used - _engine->lingering >= _engine->window;
+}
+
+/*
+ * A target gets into the ring only from its launch timer,
+ * so it is there at most once and the ring never outgrows the table
+ */
+static void __target_defer(pingtcp_engine_t* _engine, size_t _target)
+{
+	pingtcp_targets_t* targets = &_engine->targets;
+
+	targets->waiting[(targets->waiting_head + targets->waiting_count) % targets->capacity] = _target;
+	targets->waiting_count++;
+	targets->queued[_target] = 1;
+
+	return;
+}
+
+/* Launches waiting targets in turn while the window has room */
+static void __engine_drain(pingtcp_engine_t* _engine)
+{
+	pingtcp_targets_t* targets = &_engine->targets;
+	int64_t now_ns = 0;
+
+	if (targets->waiting_count == 0)
+		return;
+
+	now_ns = pingtcp_now_ns();
+	while (targets->waiting_count > 0 && !__engine_window_full(_engine))
+	{
+		size_t target = targets->waiting[targets->waiting_head];
+
+		targets->waiting_head = (targets->waiting_head + 1) % targets->capacity;
+		targets->waiting_count--;
+		targets->queued[target] = 0;
+		__engine_launch(&targets->timer[target], now_ns, _engine);
+	}
+
+	return;
+}
+
+/*
+ * Arms the launch timer of the next target in interleaved mode. A round is drawn
+ * from the targets active at its start, so targets added meanwhile join the next one,
+ * and removed or finished ones are skipped. With nothing left to visit, the round
+ * stays empty until a target is added
+ */
+static void __engine_interleave(pingtcp_engine_t* _engine, int64_t _when_ns)
+{
+	pingtcp_targets_t* targets = &_engine->targets;
+
+	if (_engine->stopped)
+		return;
+
+	for (;;)
+	{
+		size_t target = 0;
+
+		if (targets->order_position >= targets->order_count)
+		{
+			targets->order_position = 0;
+			targets->order_count = 0;
+			for (size_t i = 0; i < targets->count; i++)
+				if (!__target_exhausted(_engine, i))
+					targets->order[targets->order_count++] = i;
+			if (targets->order_count == 0)
+				return;
+
+			/* Fisher-Yates */
+			for (size_t i = targets->order_count - 1; i > 0; i--)
+			{
+				size_t j = pfcq_fprng_get_u64(&_engine->prng) % (i + 1);
+				size_t swap = targets->order[i];
+
+				targets->order[i] = targets->order[j];
+				targets->order[j] = swap;
+			}
+		}
+
+		target = targets->order[targets->order_position++];
+		if (__target_exhausted(_engine, target))
+			continue;
+
+		pingtcp_wheel_add(&_engine->wheel, &targets->timer[target], _when_ns);
+		break;
+	}
+
+	return;
+}
+
+static void __engine_expire(pingtcp_timer_t* _timer, int64_t _now_ns, void* _data)
+{
+	pingtcp_engine_t* engine = _data;
+	pingtcp_probe_t* probe = pingtcp_container_of(_timer, pingtcp_probe_t, timer);
+	size_t target = probe->target;
+
+	if (probe->lingering)
+	{
+		/* No ticket within the grace period */
+		__probe_free(engine, probe);
+		__target_check_done(engine, target);
+	} else if (probe->late)
+	{
+		/* Hard timeout, so it is lost for good */
+		__probe_syns(engine, probe, 0);
+		__target_publish(engine, target);
+		__probe_free(engine, probe);
+		__target_check_done(engine, target);
+	} else
+		__probe_finish(engine, probe, ETIMEDOUT, 1, _now_ns);
+
+	return;
+}
+
+static void __engine_launch(pingtcp_timer_t* _timer, int64_t _now_ns, void* _data)
+{
+	pingtcp_engine_t* engine = _data;
+	pingtcp_targets_t* targets = &engine->targets;
+	size_t target = _timer - targets->timer;
+	pingtcp_probe_t* probe = NULL;
+	struct timeval timeout;
+	struct epoll_event event;
+	int res = 0;
+	int one = 1;
+
+	if (unlikely(__target_exhausted(engine, target)))
+	{
+		__target_check_done(engine, target);
+		if (engine->interleaved)
+			__engine_interleave(engine, _now_ns);
+		return;
+	}
+
+	if (__engine_window_full(engine))
+	{
+		__target_defer(engine, target);
+		return;
+	}
+
+	probe = pingtcp_pool_get(&engine->probes);
+	pingtcp_timer_init(&probe->timer, __engine_expire);
+	probe->target = target;
+	probe->attempt = ++targets->stats[target].attempt;
+	targets->current[target] = probe;
+
+	probe->fd = engine->sys.socket(engine->proto, engine->blocking ? SOCK_STREAM : SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (unlikely(probe->fd == -1))
+		goto failed;
+
+	if (!engine->blocking)
+	{
+		/* Get ICMP errors immediately and in detail rather than as a bare errno or a timeout */
+		if (engine->proto == PF_INET6)
+			res = setsockopt(probe->fd, SOL_IPV6, IPV6_RECVERR, &one, sizeof(one));
+		else
+			res = setsockopt(probe->fd, SOL_IP, IP_RECVERR, &one, sizeof(one));
+		if (unlikely(res == -1))
+			goto failed;
+
+		if (engine->syn_retries > 0)
+			if (unlikely(setsockopt(probe->fd, IPPROTO_TCP, TCP_SYNCNT, &engine->syn_retries, sizeof(engine->syn_retries)) == -1))
+				goto failed;
+
+		if (engine->busy_poll_us > 0)
+			if (unlikely(setsockopt(probe->fd, SOL_SOCKET, SO_BUSY_POLL, &engine->busy_poll_us, sizeof(engine->busy_poll_us)) == -1))
+				goto failed;
+	}
+
+	if (engine->blocking)
+	{
+		/* libtorsocks needs a blocking connect(), so the deadline is enforced by the kernel */
+		timeout = __pfcq_us_to_timeval((uint64_t)(targets->rto[target].rto * 1000.0));
+		if (unlikely(setsockopt(probe->fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout)) == -1))
+			goto failed;
+		if (unlikely(setsockopt(probe->fd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout)) == -1))
+			goto failed;
+	}
+
+	probe->start_ns = pingtcp_now_ns();
+
+	switch (engine->proto)
+	{
+		case PF_INET:
+			res = engine->sys.connect(probe->fd, (struct sockaddr*)&targets->address[target].address4, sizeof(struct sockaddr_in));
+			break;
+		case PF_INET6:
+			res = engine->sys.connect(probe->fd, (struct sockaddr*)&targets->address[target].address6, sizeof(struct sockaddr_in6));
+			break;
+		default:
+			panic("socket family");
+			break;
+	}
+
+	if (likely(res == -1 && errno == EINPROGRESS && !engine->blocking))
+	{
+		pfcq_zero(&event, sizeof(struct epoll_event));
+		event.events = EPOLLOUT;
+		event.data.ptr = probe;
+		if (unlikely(epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, probe->fd, &event) == -1))
+			goto failed;
+		pingtcp_wheel_add(&engine->wheel, &probe->timer, probe->start_ns + (int64_t)(targets->rto[target].rto * 1000000.0));
+		if (engine->spin_ns > 0)
+			__spin_add(engine, probe);
+		return;
+	}
+
+	/* A blocking connect() reports its own timeout */
+	if (res == -1)
+		res = errno;
+	__probe_finish(engine, probe, res, res == EINPROGRESS || res == EAGAIN || res == ETIMEDOUT, pingtcp_now_ns());
+
+	return;
+
+failed:
+	/*
+	 * Running out of descriptors or buffers, or a socket option the kernel refuses,
+	 * fails the attempt with its errno rather than the whole run
+	 */
+	res = errno;
+	if (!probe->start_ns)
+		probe->start_ns = pingtcp_now_ns();
+	__probe_finish(engine, probe, res, 0, pingtcp_now_ns());
+
+	return;
+}
+
+void pingtcp_engine_init(pingtcp_engine_t* _engine)
+{
+	pfcq_zero(_engine, sizeof(pingtcp_engine_t));
+
+	*(void**)(&_engine->sys.socket) = dlsym(NULL, "socket");
+	*(void**)(&_engine->sys.getaddrinfo) = dlsym(NULL, "getaddrinfo");
+	*(void**)(&_engine->sys.freeaddrinfo) = dlsym(NULL, "freeaddrinfo");
+	*(void**)(&_engine->sys.inet_ntop) = dlsym(NULL, "inet_ntop");
+	*(void**)(&_engine->sys.getnameinfo) = dlsym(NULL, "getnameinfo");
+	*(void**)(&_engine->sys.connect) = dlsym(NULL, "connect");
+	*(void**)(&_engine->sys.close) = dlsym(NULL, "close");
+
+	_engine->proto = PF_INET;
+	_engine->interval_ns = 1000000000LL;
+	_engine->timeout_ns = 1000000000LL;
+	_engine->rto_min_ms = RTO_MIN_DEFAULT_MS;
+	_engine->epoll_fd = -1;
+	_engine->signal_fd = -1;
+	pfcq_fprng_init(&_engine->prng);
+
+	return;
+}
+
+/* Slots of removed targets are reused first */
+static size_t __target_slot(pingtcp_engine_t* _engine)
+{
+	pingtcp_targets_t* targets = &_engine->targets;
+
+	if (targets->vacant_count > 0)
+		return targets->vacant[--targets->vacant_count];
+
+	if (targets->count == targets->capacity)
+		__targets_grow(_engine);
+
+	return targets->count++;
+}
+
+static void __target_init(pingtcp_engine_t* _engine, size_t _target, const char* _dst, int _port)
+{
+	pingtcp_targets_t* targets = &_engine->targets;
+
+	targets->state[_target] = PINGTCP_TARGET_ACTIVE;
+	targets->dst[_target] = pfcq_strdup(_dst);
+	targets->port[_target] = _port;
+	pingtcp_stats_init(&targets->stats[_target]);
+	if (_engine->tls)
+		__tls_stats_init(&targets->tls[_target]);
+	pingtcp_timer_init(&targets->timer[_target], __engine_launch);
+	__rto_init(&targets->rto[_target],
+			_engine->adaptive ? _engine->rto_min_ms : (double)_engine->timeout_ns / 1000000.0,
+			(double)_engine->timeout_ns / 1000000.0);
+
+	return;
+}
+
+static void __target_activate(pingtcp_engine_t* _engine, size_t _target)
+{
+	pingtcp_targets_t* targets = &_engine->targets;
+
+	_engine->active++;
+
+	/* Added to a running engine, so it starts right away */
+	if (_engine->running)
+	{
+		if (_engine->shm && _target < _engine->shm->header->count)
+			pingtcp_shm_describe(_engine->shm, _target, targets->dst[_target], targets->port[_target], &targets->host[_target]);
+		__target_publish(_engine, _target);
+		if (!_engine->interleaved)
+			pingtcp_wheel_add(&_engine->wheel, &targets->timer[_target], pingtcp_now_ns());
+		else if (targets->order_count == 0)
+			__engine_interleave(_engine, pingtcp_now_ns());
+	}
+
+	return;
+}
+
+int pingtcp_engine_add(pingtcp_engine_t* _engine, const char* _dst, int _port, size_t* _target)
+{
+	pingtcp_targets_t* targets = &_engine->targets;
+	size_t index = 0;
+	struct addrinfo* server = NULL;
+	struct addrinfo hints;
+	char ptr[FQDN_MAX_LENGTH];
+	int res = 0;
+
+	/* Resolved once, so that the event loop never blocks on DNS */
+	pfcq_zero(&hints, sizeof(struct addrinfo));
+	hints.ai_flags = AI_ADDRCONFIG | AI_V4MAPPED;
+	hints.ai_family = _engine->proto == PF_INET6 ? AF_INET6 : AF_INET;
+	hints.ai_socktype = 0;
+
+	res = _engine->sys.getaddrinfo(_dst, NULL, &hints, &server);
+	if (unlikely(res))
+		return res;
+
+	index = __target_slot(_engine);
+	__target_init(_engine, index, _dst, _port);
+
+	switch (_engine->proto)
+	{
+		case PF_INET:
+			if (unlikely(!_engine->sys.inet_ntop(AF_INET, &((struct sockaddr_in*)server->ai_addr)->sin_addr, targets->host[index].host4, INET_ADDRSTRLEN)))
+				panic("inet_ntop");
+			targets->address[index].address4.sin_family = AF_INET;
+			memcpy(&targets->address[index].address4.sin_addr, &((struct sockaddr_in*)server->ai_addr)->sin_addr, sizeof(struct in_addr));
+			targets->address[index].address4.sin_port = htons(_port);
+			break;
+		case PF_INET6:
+			if (unlikely(!_engine->sys.inet_ntop(AF_INET6, &((struct sockaddr_in6*)server->ai_addr)->sin6_addr, targets->host[index].host6, INET6_ADDRSTRLEN)))
+				panic("inet_ntop");
+			targets->address[index].address6.sin6_family = AF_INET6;
+			memcpy(&targets->address[index].address6.sin6_addr, &((struct sockaddr_in6*)server->ai_addr)->sin6_addr, sizeof(struct in6_addr));
+			targets->address[index].address6.sin6_port = htons(_port);
+			break;
+		default:
+			panic("socket family");
+			break;
+	}
+	_engine->sys.freeaddrinfo(server);
+
+	/* Most addresses have no PTR record, so the name is only stored when there is one */
+	pfcq_zero(ptr, FQDN_MAX_LENGTH);
+	switch (_engine->proto)
+	{
+		case PF_INET:
+			if (likely(_engine->sys.getnameinfo((const struct sockaddr*)&targets->address[index].address4, sizeof(struct sockaddr_in), ptr, FQDN_MAX_LENGTH, NULL, 0, NI_NAMEREQD) == 0))
+				targets->ptr[index] = pfcq_strdup(ptr);
+			break;
+		case PF_INET6:
+			if (likely(_engine->sys.getnameinfo((const struct sockaddr*)&targets->address[index].address6, sizeof(struct sockaddr_in6), ptr, FQDN_MAX_LENGTH, NULL, 0, NI_NAMEREQD) == 0))
+				targets->ptr[index] = pfcq_strdup(ptr);
+			break;
+		default:
+			panic("socket family");
+			break;
+	}
+
+	__target_activate(_engine, index);
+
+	if (_target)
+		*_target = index;
+
+	return 0;
+}
+
+/*
+ * Same host on another port. The address and names of the source target
+ * are reused, so sweeping many ports costs a single lookup
+ */
+int pingtcp_engine_add_port(pingtcp_engine_t* _engine, size_t _source, int _port, size_t* _target)
+{
+	pingtcp_targets_t* targets = &_engine->targets;
+	size_t index = 0;
+
+	if (unlikely(_source >= targets->count ||
+		targets->state[_source] == PINGTCP_TARGET_REMOVED || targets->state[_source] == PINGTCP_TARGET_VACANT))
+		return -1;
+
+	/* Taken first, since it may move the table */
+	index = __target_slot(_engine);
+	__target_init(_engine, index, targets->dst[_source], _port);
+	memcpy(&targets->address[index], &targets->address[_source], sizeof(pfcq_net_address_t));
+	memcpy(&targets->host[index], &targets->host[_source], sizeof(pfcq_net_host_t));
+	if (targets->ptr[_source])
+		targets->ptr[index] = pfcq_strdup(targets->ptr[_source]);
+
+	switch (_engine->proto)
+	{
+		case PF_INET:
+			targets->address[index].address4.sin_port = htons(_port);
+			break;
+		case PF_INET6:
+			targets->address[index].address6.sin6_port = htons(_port);
+			break;
+		default:
+			panic("socket family");
+			break;
+	}
+
+	__target_activate(_engine, index);
+
+	if (_target)
+		*_target = index;
+
+	return 0;
+}
+
+int pingtcp_engine_remove(pingtcp_engine_t* _engine, size_t _target)
+{
+	pingtcp_targets_t* targets = &_engine->targets;
+	int pending = 0;
+
+	if (unlikely(_target >= targets->count ||
+		targets->state[_target] == PINGTCP_TARGET_REMOVED || targets->state[_target] == PINGTCP_TARGET_VACANT))
+		return -1;
+
+	if (_engine->on_remove)
+		_engine->on_remove(_engine, _target, _engine->on_remove_data);
+
+	pending = pingtcp_timer_pending(&targets->timer[_target]);
+	pingtcp_wheel_del(&_engine->wheel, &targets->timer[_target]);
+	if (targets->state[_target] == PINGTCP_TARGET_ACTIVE)
+		_engine->active--;
+	targets->state[_target] = PINGTCP_TARGET_REMOVED;
+
+	/* Attempts in flight are dropped silently once they finish */
+	__target_check_done(_engine, _target);
+
+	/* It was next in turn, so the one after it takes its place */
+	if (_engine->interleaved && pending)
+		__engine_interleave(_engine, pingtcp_now_ns());
+
+	return 0;
+}
+
+void pingtcp_engine_start(pingtcp_engine_t* _engine, const sigset_t* _stop_mask)
+{
+	int64_t now_ns = 0;
+	struct epoll_event event;
+
+	/*
+	 * Late attempts live no longer than the hard timeout, and expiries are
+	 * at least one interval plus the RTO floor apart, so this bounds the watch list
+	 */
+	if (_engine->adaptive && !_engine->blocking)
+	{
+		_engine->late_max = (size_t)(_engine->timeout_ns / (_engine->interval_ns + (int64_t)(_engine->rto_min_ms * 1000000.0) + 1)) + 2;
+		if (_engine->late_max > ENGINE_LATE_MAX)
+			_engine->late_max = ENGINE_LATE_MAX;
+	}
+
+	/* One in-flight attempt per target (or per window slot) is preallocated, late ones grow the pool on demand */
+	pingtcp_pool_init(&_engine->probes, sizeof(pingtcp_probe_t), POOL_SLAB_OBJECTS,
+			_engine->window > 0 && _engine->window < _engine->targets.count ? _engine->window : _engine->targets.count);
+
+	_engine->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (unlikely(_engine->epoll_fd == -1))
+		panic("epoll_create1");
+
+	if (_stop_mask)
+	{
+		_engine->signal_fd = signalfd(-1, _stop_mask, SFD_CLOEXEC | SFD_NONBLOCK);
+		if (unlikely(_engine->signal_fd == -1))
+			panic("signalfd");
+		pfcq_zero(&event, sizeof(struct epoll_event));
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		if (unlikely(epoll_ctl(_engine->epoll_fd, EPOLL_CTL_ADD, _engine->signal_fd, &event) == -1))
+			panic("epoll_ctl");
+	}
+
+	_engine->events = pfcq_alloc(ENGINE_MAXEVENTS * sizeof(struct epoll_event));
+
+	now_ns = pingtcp_now_ns();
+	pingtcp_wheel_init(&_engine->wheel, now_ns, ENGINE_TICK_NS, _engine);
+
+	for (size_t i = 0; i < _engine->targets.count; i++)
+	{
+		int64_t offset_ns = 0;
+
+		if (_engine->targets.state[i] != PINGTCP_TARGET_ACTIVE)
+			continue;
+
+		if (_engine->shm && i < _engine->shm->header->count)
+		{
+			pingtcp_shm_describe(_engine->shm, i, _engine->targets.dst[i], _engine->targets.port[i], &_engine->targets.host[i]);
+			pingtcp_shm_publish(_engine->shm, i, &_engine->targets.stats[i]);
+		}
+
+		if (_engine->interleaved)
+			continue;
+
+		/* Spread the first attempts over one interval, so that targets do not fire in lockstep */
+		if (_engine->targets.count > 1 && _engine->interval_ns > 0)
+			offset_ns = pfcq_fprng_get_u64(&_engine->prng) % (uint64_t)_engine->interval_ns;
+		pingtcp_wheel_add(&_engine->wheel, &_engine->targets.timer[i], now_ns + offset_ns);
+	}
+
+	_engine->running = 1;
+
+	if (_engine->interleaved)
+		__engine_interleave(_engine, now_ns);
+
+	return;
+}
+
+int pingtcp_engine_fd(const pingtcp_engine_t* _engine)
+{
+	return _engine->epoll_fd;
+}
+
+/*
+ * Time until the nearest busy-wait window opens. Attempts whose window
+ * has closed are dropped from the heap by pingtcp_engine_step(), and one
+ * that closed since only makes the caller step once more right away
+ */
+static int64_t __engine_spin_wait_ns(const pingtcp_engine_t* _engine, int64_t _now_ns)
+{
+	int64_t open_ns = 0;
+
+	if (_engine->spin_count == 0)
+		return WHEEL_NEVER;
+
+	open_ns = _engine->spin[0]->expected_ns - _engine->spin_ns;
+
+	return open_ns <= _now_ns ? 0 : open_ns - _now_ns;
+}
+
+int pingtcp_engine_timeout(const pingtcp_engine_t* _engine)
+{
+	int64_t now_ns = 0;
+	int64_t next_ns = 0;
+	int64_t spin_ns = WHEEL_NEVER;
+	int ret = -1;
+
+	now_ns = pingtcp_now_ns();
+	next_ns = pingtcp_wheel_next_ns(&_engine->wheel);
+	if (next_ns != WHEEL_NEVER)
+	{
+		/* Rounded up to avoid spinning until the slot is due */
+		ret = next_ns <= now_ns ? 0 : (int)((next_ns - now_ns + 999999) / 1000000);
+	}
+
+	/* Rounded down instead, so that the window is never entered late */
+	if (_engine->spin_ns > 0)
+		spin_ns = __engine_spin_wait_ns(_engine, now_ns);
+	if (spin_ns != WHEEL_NEVER && (ret < 0 || spin_ns / 1000000 < ret))
+		ret = (int)(spin_ns / 1000000);
+
+	return ret;
+}
+
+size_t pingtcp_engine_step(pingtcp_engine_t* _engine, int _timeout_ms)
+{
+	int64_t now_ns = 0;
+	int timeout_ms = 0;
+	int events_count = 0;
+	struct signalfd_siginfo signal_info;
+
+	pingtcp_wheel_advance(&_engine->wheel, pingtcp_now_ns());
+	/* Attempts of removed targets are still drained when nothing else is left */
+	if (unlikely(_engine->active == 0 && _engine->probes.used == 0))
+		return 0;
+
+	timeout_ms = pingtcp_engine_timeout(_engine);
+	if (_timeout_ms >= 0 && (timeout_ms < 0 || _timeout_ms < timeout_ms))
+		timeout_ms = _timeout_ms;
+
+	events_count = epoll_wait(_engine->epoll_fd, _engine->events, ENGINE_MAXEVENTS, timeout_ms);
+	if (unlikely(events_count == -1))
+	{
+		if (likely(errno == EINTR))
+			return _engine->active;
+		else
+			panic("epoll_wait");
+	}
+	now_ns = pingtcp_now_ns();
+
+	for (int i = 0; i < events_count; i++)
+	{
+		pingtcp_probe_t* probe = _engine->events[i].data.ptr;
+
+		if (unlikely(!probe))
+		{
+			while (read(_engine->signal_fd, &signal_info, sizeof(struct signalfd_siginfo)) == sizeof(struct signalfd_siginfo))
+				continue;
+			pingtcp_engine_stop(_engine);
+			break;
+		}
+
+		pingtcp_wheel_del(&_engine->wheel, &probe->timer);
+		if (probe->lingering)
+			__probe_ticket(_engine, probe);
+		else if (probe->late)
+			__probe_late(_engine, probe, now_ns);
+		else if (probe->ssl)
+			__probe_tls(_engine, probe, now_ns);
+		else
+			__probe_finish(_engine, probe, __socket_error(probe->fd), 0, now_ns);
+
+		/* Stopped from the result callback, so the rest of the events refer to freed attempts */
+		if (unlikely(_engine->stopped))
+			break;
+	}
+
+	pingtcp_wheel_advance(&_engine->wheel, pingtcp_now_ns());
+	__engine_drain(_engine);
+
+	/* Nothing is busy-waited for past the window */
+	now_ns = pingtcp_now_ns();
+	while (_engine->spin_count > 0 && _engine->spin[0]->expected_ns + _engine->spin_ns < now_ns)
+		__spin_del(_engine, _engine->spin[0]);
+
+	return _engine->active;
+}
+
+void pingtcp_engine_stop(pingtcp_engine_t* _engine)
+{
+	pingtcp_targets_t* targets = &_engine->targets;
+
+	_engine->stopped = 1;
+
+	while (targets->waiting_count > 0)
+	{
+		targets->queued[targets->waiting[targets->waiting_head]] = 0;
+		targets->waiting_head = (targets->waiting_head + 1) % targets->capacity;
+		targets->waiting_count--;
+	}
+
+	/*
+	 * An attempt cut short has no outcome: it stays started,
+	 * but is neither counted as lost nor backs the RTO off
+	 */
+	for (size_t i = 0; i < targets->count; i++)
+	{
+		pingtcp_wheel_del(&_engine->wheel, &targets->timer[i]);
+		if (targets->current[i])
+		{
+			__probe_free(_engine, targets->current[i]);
+			targets->current[i] = NULL;
+		}
+		while (targets->late[i])
+			__probe_free(_engine, targets->late[i]);
+		__target_check_done(_engine, i);
+	}
+
+	return;
+}
+
+void pingtcp_engine_finish(pingtcp_engine_t* _engine)
+{
+	/* Even with no active targets, removed ones may still have attempts holding sockets */
+	pingtcp_engine_stop(_engine);
+	_engine->running = 0;
+
+	pfcq_free(_engine->events);
+	if (_engine->spin)
+		pfcq_free(_engine->spin);
+	_engine->spin = NULL;
+	_engine->spin_capacity = 0;
+	pingtcp_pool_done(&_engine->probes);
+
+	if (_engine->signal_fd != -1)
+		if (unlikely(close(_engine->signal_fd) == -1))
+			panic("close");
+	_engine->signal_fd = -1;
+	if (unlikely(close(_engine->epoll_fd) == -1))
+		panic("close");
+	_engine->epoll_fd = -1;
+
+	return;
+}
+
+void pingtcp_engine_run(pingtcp_engine_t* _engine, const sigset_t* _stop_mask)
+{
+	pingtcp_engine_start(_engine, _stop_mask);
+	while (pingtcp_engine_step(_engine, -1) > 0)
+		continue;
+	pingtcp_engine_finish(_engine);
+
+	return;
+}
+
+void pingtcp_engine_done(pingtcp_engine_t* _engine)
+{
+	__targets_free(&_engine->targets);
+
+	return;
+}
+
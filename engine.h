@@ -0,0 +1,354 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "contrib/pfcq/pfcq.h"
+#include "histogram.h"
+#include "pool.h"
+#include "wheel.h"
+
+#define FQDN_MAX_LENGTH			254
+#define ENGINE_TICK_NS			1000000LL
+#define ENGINE_MAXEVENTS		1024
+#define ENGINE_LATE_MAX			1024
+#define ENGINE_SPIN_MIN			64
+#define ENGINE_TICKET_GRACE_NS	100000000LL
+#define RTO_MIN_DEFAULT_MS		200
+/* MAX_TCP_SYNCNT of the kernel */
+#define SYN_RETRIES_MAX			127
+
+/*
+ * Resolver and socket entry points, replaced
+ * with libtorsocks ones in TOR mode
+ */
+typedef struct pingtcp_sys
+{
+	int (*socket)(int, int, int);
+	int (*getaddrinfo)(const char*, const char*, const struct addrinfo*, struct addrinfo**);
+	void (*freeaddrinfo)(struct addrinfo*);
+	const char* (*inet_ntop)(int, const void*, char*, socklen_t);
+	int (*getnameinfo)(const struct sockaddr*, socklen_t, char*, socklen_t, char*, socklen_t, int);
+	int (*connect)(int, const struct sockaddr*, socklen_t);
+	int (*close)(int);
+} pingtcp_sys_t;
+
+/*
+ * RFC 6298 retransmission timeout estimator, kept per target
+ * to derive the deadline of each handshake attempt
+ */
+typedef struct pingtcp_rto
+{
+	double srtt;
+	double rttvar;
+	double rto;
+	double floor;
+	double ceiling;
+	int valid;
+} pingtcp_rto_t;
+
+typedef enum pingtcp_failure
+{
+	PINGTCP_FAILURE_NONE = -1,
+	PINGTCP_FAILURE_REFUSED = 0,
+	PINGTCP_FAILURE_UNREACHABLE,
+	PINGTCP_FAILURE_TIMEOUT,
+	PINGTCP_FAILURE_LOCAL,
+	PINGTCP_FAILURE_OTHER,
+	PINGTCP_FAILURES
+} pingtcp_failure_t;
+
+/* time_min and time_max stay zero for timeouts, which may be reclassified as late */
+typedef struct pingtcp_failures
+{
+	uint64_t count;
+	double time_min;
+	double time_max;
+	double time_sum;
+} pingtcp_failures_t;
+
+typedef struct pingtcp_stats
+{
+	uint64_t attempt;
+	uint64_t ok;
+	uint64_t fail;
+	uint64_t late;
+	uint64_t lost;
+	double rtt_min;
+	double rtt_max;
+	double rtt_sum;
+	double rtt_sum_sqr;
+	uint64_t rtt_count;
+	uint64_t retransmitted;
+	uint64_t syn_sent;
+	uint64_t syn_lost;
+	pingtcp_failures_t failures[PINGTCP_FAILURES];
+	uint64_t rtt_histogram[HISTOGRAM_BUCKETS];
+} pingtcp_stats_t;
+
+/* Times of one kind of TLS handshakes */
+typedef struct pingtcp_series
+{
+	uint64_t count;
+	double min;
+	double max;
+	double sum;
+	double sum_sqr;
+	uint64_t histogram[HISTOGRAM_BUCKETS];
+} pingtcp_series_t;
+
+typedef enum pingtcp_tls_kind
+{
+	PINGTCP_TLS_FULL = 0,
+	PINGTCP_TLS_RESUMED,
+	PINGTCP_TLS_KINDS
+} pingtcp_tls_kind_t;
+
+/*
+ * TLS handshakes made over completed TCP ones, timed from the end of the TCP one
+ * (tls) and from the SYN (total). Once a session is held, resumption is offered
+ * on every other attempt, and a handshake counts as resumed only if the server
+ * accepts it, so that both kinds are sampled under the same conditions
+ */
+typedef struct pingtcp_tls_stats
+{
+	uint64_t attempt;
+	uint64_t failed;
+	uint64_t timed_out;
+	uint64_t offered;
+	pingtcp_series_t tls[PINGTCP_TLS_KINDS];
+	pingtcp_series_t total[PINGTCP_TLS_KINDS];
+} pingtcp_tls_stats_t;
+
+/*
+ * Outcome of a single attempt. ICMP details are only
+ * filled in when the kernel queued an ICMP error for the socket,
+ * and TLS ones only in TLS mode once the TCP handshake has completed
+ */
+typedef struct pingtcp_result
+{
+	size_t target;
+	uint64_t attempt;
+	pingtcp_failure_t failure;
+	int error;
+	int late;
+	int icmp;
+	uint32_t syn_retrans;
+	uint8_t icmp_type;
+	uint8_t icmp_code;
+	double time_ms;
+	pfcq_net_host_t icmp_offender;
+	int tls;
+	int tls_failed;
+	int tls_timed_out;
+	int tls_resumed;
+	unsigned long tls_error;
+	double tls_ms;
+	double total_ms;
+} pingtcp_result_t;
+
+struct ssl_st;
+struct ssl_session_st;
+
+/*
+ * In-flight handshake attempt, taken from the engine pool. Once it misses
+ * its adaptive deadline, it is still watched until the hard timeout
+ * to tell late handshakes from lost ones. In TLS mode, a completed TCP handshake
+ * is followed by a TLS one on the same attempt, bounded by the hard timeout.
+ * An attempt that is over may linger on the late list to take in a TLS 1.3
+ * session ticket, without counting against the window
+ */
+typedef struct pingtcp_probe
+{
+	pingtcp_timer_t timer;
+	struct pingtcp_probe* next;
+	struct pingtcp_probe** pprev;
+	uint32_t target;
+	int fd;
+	int late;
+	int lingering;
+	uint64_t attempt;
+	int64_t start_ns;
+	/* When it is expected to complete, and its place in the spin heap + 1, if any */
+	int64_t expected_ns;
+	size_t spin_slot;
+	double expired_ms;
+	uint32_t syn_sent;
+	uint32_t syn_lost;
+	int offered;
+	int64_t connected_ns;
+	int64_t secured_ns;
+	unsigned long tls_error;
+	struct ssl_st* ssl;
+	struct ssl_session_st* ticket;
+} pingtcp_probe_t;
+
+typedef enum pingtcp_target_state
+{
+	PINGTCP_TARGET_ACTIVE = 0,
+	PINGTCP_TARGET_DONE,
+	PINGTCP_TARGET_REMOVED,
+	PINGTCP_TARGET_VACANT
+} pingtcp_target_state_t;
+
+/*
+ * Target table kept as a structure of arrays indexed by target number.
+ * Fields touched on every attempt are packed apart from names,
+ * which are only needed when printing
+ */
+typedef struct pingtcp_targets
+{
+	size_t count;
+	size_t capacity;
+	size_t vacant_count;
+	size_t* vacant;
+	/* Ring of targets due while the in-flight window is full */
+	size_t waiting_head;
+	size_t waiting_count;
+	size_t* waiting;
+	/* Shuffled visiting order of the current round in interleaved mode */
+	size_t order_position;
+	size_t order_count;
+	size_t* order;
+	/* Hot */
+	pingtcp_timer_t* timer;
+	pingtcp_rto_t* rto;
+	pingtcp_stats_t* stats;
+	pingtcp_probe_t** current;
+	pingtcp_probe_t** late;
+	uint32_t* late_count;
+	uint8_t* state;
+	uint8_t* queued;
+	pfcq_net_address_t* address;
+	/* Only allocated in TLS mode */
+	pingtcp_tls_stats_t* tls;
+	struct ssl_session_st** session;
+	/* Cold */
+	int* port;
+	char** dst;
+	char** ptr;
+	pfcq_net_host_t* host;
+} pingtcp_targets_t;
+
+struct pingtcp_shm;
+struct pingtcp_tls;
+struct pingtcp_engine;
+
+/*
+ * Called for every finished attempt once the engine state is updated,
+ * so it may remove targets, but must not free the engine
+ */
+typedef void (*pingtcp_result_handler_t)(struct pingtcp_engine* _engine, const pingtcp_result_t* _result, void* _data);
+
+/* Called by pingtcp_engine_remove() while the statistics of the target are still there */
+typedef void (*pingtcp_remove_handler_t)(struct pingtcp_engine* _engine, size_t _target, void* _data);
+
+typedef struct pingtcp_engine
+{
+	pingtcp_sys_t sys;
+	int proto;
+	int adaptive;
+	int blocking;
+	int interleaved;
+	int stopped;
+	int running;
+	int syn_retries;
+	int busy_poll_us;
+	int epoll_fd;
+	int signal_fd;
+	uint64_t limit;
+	int64_t interval_ns;
+	int64_t timeout_ns;
+	int64_t spin_ns;
+	double rto_min_ms;
+	size_t late_max;
+	size_t window;
+	size_t active;
+	size_t lingering;
+	pingtcp_result_handler_t on_result;
+	void* on_result_data;
+	pingtcp_remove_handler_t on_remove;
+	void* on_remove_data;
+	pingtcp_targets_t targets;
+	pingtcp_pool_t probes;
+	/* Min-heap of in-flight attempts by expected completion, only kept with spin_ns */
+	size_t spin_count;
+	size_t spin_capacity;
+	pingtcp_probe_t** spin;
+	struct epoll_event* events;
+	pfcq_fprng_context_t prng;
+	struct pingtcp_shm* shm;
+	/* errno of the last failed segment growth, reset by whoever reports it */
+	int shm_error;
+	struct pingtcp_tls* tls;
+	pingtcp_wheel_t wheel;
+} pingtcp_engine_t;
+
+int64_t pingtcp_now_ns(void) __attribute__((warn_unused_result));
+
+/*
+ * Either pingtcp_engine_run() does it all, or the caller drives the loop:
+ * pingtcp_engine_start(), then pingtcp_engine_step() whenever pingtcp_engine_fd()
+ * is readable or pingtcp_engine_timeout() elapses, then pingtcp_engine_finish().
+ * Targets may be added and removed at any time. With a non-zero window, no more
+ * than that many attempts (late ones included) are in flight at once, and targets
+ * that are due meanwhile are launched in turn as attempts finish. With a non-zero
+ * spin_ns, pingtcp_engine_timeout() returns 0 from spin_ns before until spin_ns after
+ * an attempt is expected to complete, so that the caller busy-waits for it.
+ * In interleaved mode, targets are not probed on timers of their own: a single
+ * attempt is in flight at a time, one interval apart, and every round visits
+ * each active target once in a freshly shuffled order, so that targets compared
+ * against each other see the same network conditions. With tls set before
+ * the first target is added, every completed TCP handshake is followed by a TLS one,
+ * and the attempt is reported once both are over
+ */
+void pingtcp_engine_init(pingtcp_engine_t* _engine) __attribute__((nonnull(1)));
+int pingtcp_engine_add(pingtcp_engine_t* _engine, const char* _dst, int _port, size_t* _target) __attribute__((nonnull(1, 2), warn_unused_result));
+int pingtcp_engine_add_port(pingtcp_engine_t* _engine, size_t _source, int _port, size_t* _target) __attribute__((nonnull(1), warn_unused_result));
+int pingtcp_engine_remove(pingtcp_engine_t* _engine, size_t _target) __attribute__((nonnull(1)));
+void pingtcp_engine_start(pingtcp_engine_t* _engine, const sigset_t* _stop_mask) __attribute__((nonnull(1)));
+int pingtcp_engine_fd(const pingtcp_engine_t* _engine) __attribute__((nonnull(1), warn_unused_result));
+int pingtcp_engine_timeout(const pingtcp_engine_t* _engine) __attribute__((nonnull(1), warn_unused_result));
+size_t pingtcp_engine_step(pingtcp_engine_t* _engine, int _timeout_ms) __attribute__((nonnull(1)));
+void pingtcp_engine_stop(pingtcp_engine_t* _engine) __attribute__((nonnull(1)));
+void pingtcp_engine_finish(pingtcp_engine_t* _engine) __attribute__((nonnull(1)));
+void pingtcp_engine_run(pingtcp_engine_t* _engine, const sigset_t* _stop_mask) __attribute__((nonnull(1)));
+void pingtcp_engine_done(pingtcp_engine_t* _engine) __attribute__((nonnull(1)));
+
+/* Shared with passive measurements, so that both account attempts alike */
+void pingtcp_stats_init(pingtcp_stats_t* _stats) __attribute__((nonnull(1)));
+void pingtcp_stats_rtt(pingtcp_stats_t* _stats, double _rtt) __attribute__((nonnull(1)));
+void pingtcp_stats_failure(pingtcp_stats_t* _stats, pingtcp_failure_t _failure, double _time) __attribute__((nonnull(1)));
+
+const char* pingtcp_target_name(const pingtcp_engine_t* _engine, size_t _target) __attribute__((nonnull(1), warn_unused_result));
+const char* pingtcp_target_host(const pingtcp_engine_t* _engine, size_t _target) __attribute__((nonnull(1), warn_unused_result));
+const char* pingtcp_failure_name(pingtcp_failure_t _failure) __attribute__((warn_unused_result));
+
+#endif /* __ENGINE_H__ */
+
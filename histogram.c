@@ -0,0 +1,115 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "histogram.h"
+
+size_t pingtcp_histogram_bucket(double _ms)
+{
+	uint64_t us = 0;
+	unsigned int exponent = 0;
+	size_t ret = 0;
+
+	if (_ms <= 0)
+		return 0;
+	us = (uint64_t)(_ms * 1000.0);
+	if (us < HISTOGRAM_SUBS)
+		return us;
+
+	exponent = 63 - __builtin_clzll(us);
+	ret = (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUBS + ((us >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUBS - 1));
+
+	return ret < HISTOGRAM_BUCKETS ? ret : HISTOGRAM_BUCKETS - 1;
+}
+
+double pingtcp_histogram_lower(size_t _bucket)
+{
+	unsigned int exponent = 0;
+	uint64_t sub = 0;
+
+	if (_bucket < HISTOGRAM_SUBS)
+		return (double)_bucket / 1000.0;
+
+	exponent = _bucket / HISTOGRAM_SUBS + HISTOGRAM_SUB_BITS - 1;
+	sub = _bucket % HISTOGRAM_SUBS;
+
+	return (double)((HISTOGRAM_SUBS + sub) << (exponent - HISTOGRAM_SUB_BITS)) / 1000.0;
+}
+
+double pingtcp_histogram_upper(size_t _bucket)
+{
+	return pingtcp_histogram_lower(_bucket + 1);
+}
+
+void pingtcp_histogram_add(uint64_t* _histogram, double _ms)
+{
+	_histogram[pingtcp_histogram_bucket(_ms)]++;
+
+	return;
+}
+
+void pingtcp_histogram_merge(uint64_t* _to, const uint64_t* _from)
+{
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+		_to[i] += _from[i];
+
+	return;
+}
+
+double pingtcp_histogram_quantile(const uint64_t* _histogram, double _quantile, double _min, double _max)
+{
+	uint64_t total = 0;
+	double rank = 0;
+	uint64_t seen = 0;
+	double ret = 0;
+
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+		total += _histogram[i];
+	if (total == 0)
+		return 0;
+
+	rank = _quantile * (double)total;
+	if (rank < 0.5)
+		rank = 0.5;
+	if (rank > (double)total - 0.5)
+		rank = (double)total - 0.5;
+
+	/*
+	 * Samples are taken as spread evenly over the bucket the rank falls into,
+	 * and the result is kept within the times actually seen, since a bucket
+	 * is wider than the spread of a steady target
+	 */
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		if (seen + _histogram[i] > rank)
+		{
+			ret = pingtcp_histogram_lower(i) + (pingtcp_histogram_upper(i) - pingtcp_histogram_lower(i)) *
+				(rank - (double)seen) / (double)_histogram[i];
+			break;
+		}
+		seen += _histogram[i];
+	}
+
+	if (ret < _min)
+		ret = _min;
+	if (ret > _max)
+		ret = _max;
+
+	return ret;
+}
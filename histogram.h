@@ -0,0 +1,47 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BITS	4
+#define HISTOGRAM_SUBS		(1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS	384
+
+/*
+ * Log-linear histogram of times in microseconds: every power of two
+ * is split into HISTOGRAM_SUBS buckets, which bounds the relative error
+ * to 1/HISTOGRAM_SUBS and covers up to 2^27 us. Bucket bounds are fixed,
+ * so histograms of different targets and processes may be merged by adding them up
+ */
+size_t pingtcp_histogram_bucket(double _ms) __attribute__((warn_unused_result));
+double pingtcp_histogram_lower(size_t _bucket) __attribute__((warn_unused_result));
+double pingtcp_histogram_upper(size_t _bucket) __attribute__((warn_unused_result));
+void pingtcp_histogram_add(uint64_t* _histogram, double _ms) __attribute__((nonnull(1)));
+void pingtcp_histogram_merge(uint64_t* _to, const uint64_t* _from) __attribute__((nonnull(1, 2)));
+double pingtcp_histogram_quantile(const uint64_t* _histogram, double _quantile, double _min, double _max) __attribute__((nonnull(1), warn_unused_result));
+
+#endif /* __HISTOGRAM_H__ */
+
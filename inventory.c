@@ -0,0 +1,508 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "inventory.h"
+
+#define INVENTORY_NONE		SIZE_MAX
+#define INVENTORY_EVENTS	4096
+
+static uint64_t __hash(const char* _dst, int _port)
+{
+	uint64_t ret = 14695981039346656037ULL;
+
+	for (const char* c = _dst; *c; c++)
+	{
+		ret ^= (uint8_t)*c;
+		ret *= 1099511628211ULL;
+	}
+	ret ^= (uint64_t)_port;
+	ret *= 1099511628211ULL;
+
+	return ret;
+}
+
+static void __entry_link(pingtcp_entry_t** _list, pingtcp_entry_t* _entry)
+{
+	_entry->next = *_list;
+	if (_entry->next)
+		_entry->next->pprev = &_entry->next;
+	_entry->pprev = _list;
+	*_list = _entry;
+
+	return;
+}
+
+static void __entry_unlink(pingtcp_entry_t* _entry)
+{
+	*_entry->pprev = _entry->next;
+	if (_entry->next)
+		_entry->next->pprev = _entry->pprev;
+	_entry->next = NULL;
+	_entry->pprev = NULL;
+
+	return;
+}
+
+static pingtcp_entry_t* __entry_find(const pingtcp_inventory_t* _inventory, const char* _dst, int _port)
+{
+	size_t mask = _inventory->entries_size - 1;
+	uint64_t hash = __hash(_dst, _port);
+	size_t slot = hash & mask;
+
+	while (_inventory->entries[slot])
+	{
+		const pingtcp_entry_t* entry = _inventory->entries[slot];
+
+		if (entry->hash == hash && entry->port == _port && strcmp(entry->dst, _dst) == 0)
+			return _inventory->entries[slot];
+		slot = (slot + 1) & mask;
+	}
+
+	return NULL;
+}
+
+static void __entry_place(pingtcp_inventory_t* _inventory, pingtcp_entry_t* _entry)
+{
+	size_t mask = _inventory->entries_size - 1;
+	size_t slot = _entry->hash & mask;
+
+	while (_inventory->entries[slot])
+		slot = (slot + 1) & mask;
+	_inventory->entries[slot] = _entry;
+
+	return;
+}
+
+static void __entry_add(pingtcp_inventory_t* _inventory, const char* _dst, int _port, size_t _target)
+{
+	pingtcp_entry_t* entry = pfcq_alloc(sizeof(pingtcp_entry_t));
+
+	entry->dst = pfcq_strdup(_dst);
+	entry->port = _port;
+	entry->target = _target;
+	entry->hash = __hash(_dst, _port);
+	entry->generation = _inventory->generation;
+
+	/* Kept at most half full */
+	if ((_inventory->entries_count + 1) * 2 > _inventory->entries_size)
+	{
+		pingtcp_entry_t** entries = _inventory->entries;
+		size_t size = _inventory->entries_size;
+
+		_inventory->entries_size *= 2;
+		_inventory->entries = pfcq_alloc(_inventory->entries_size * sizeof(pingtcp_entry_t*));
+		for (size_t i = 0; i < size; i++)
+			if (entries[i])
+				__entry_place(_inventory, entries[i]);
+		pfcq_free(entries);
+	}
+
+	__entry_place(_inventory, entry);
+	_inventory->entries_count++;
+	__entry_link(&_inventory->live, entry);
+
+	return;
+}
+
+/* Backward shift deletion, as for the flows of the passive matcher */
+static void __entry_delete(pingtcp_inventory_t* _inventory, pingtcp_entry_t* _entry)
+{
+	size_t mask = _inventory->entries_size - 1;
+	size_t hole = _entry->hash & mask;
+	size_t slot = 0;
+
+	while (_inventory->entries[hole] != _entry)
+		hole = (hole + 1) & mask;
+	slot = hole;
+
+	for (;;)
+	{
+		size_t home = 0;
+
+		slot = (slot + 1) & mask;
+		if (!_inventory->entries[slot])
+			break;
+		home = _inventory->entries[slot]->hash & mask;
+		if ((slot > hole && (home <= hole || home > slot)) || (slot < hole && home <= hole && home > slot))
+		{
+			_inventory->entries[hole] = _inventory->entries[slot];
+			hole = slot;
+		}
+	}
+
+	_inventory->entries[hole] = NULL;
+	_inventory->entries_count--;
+	__entry_unlink(_entry);
+	pfcq_free(_entry->dst);
+	pfcq_free(_entry);
+
+	return;
+}
+
+static void __additions_free(pingtcp_inventory_t* _inventory)
+{
+	for (size_t i = 0; i < _inventory->additions_count; i++)
+	{
+		pfcq_free(_inventory->additions[i].dst);
+		pfcq_free(_inventory->additions[i].ports);
+	}
+	if (_inventory->additions)
+		pfcq_free(_inventory->additions);
+	_inventory->additions = NULL;
+	_inventory->additions_count = 0;
+	_inventory->additions_position = 0;
+
+	return;
+}
+
+/*
+ * Expands a port list like 22,80,443,8000-8100, dropping duplicates.
+ * Returns the number of ports, or 0 if the list is malformed
+ */
+size_t pingtcp_ports_parse(const char* _spec, int** _ports)
+{
+	uint64_t seen[(PORT_MAX + 1) / 64];
+	const char* current = _spec;
+	char* end = NULL;
+	int* ports = NULL;
+	size_t ret = 0;
+
+	pfcq_zero(seen, sizeof(seen));
+	*_ports = NULL;
+
+	for (;;)
+	{
+		unsigned long first = 0;
+		unsigned long last = 0;
+
+		if (!isdigit((unsigned char)*current))
+			goto malformed;
+		first = strtoul(current, &end, 10);
+		last = first;
+		if (*end == '-')
+		{
+			current = end + 1;
+			if (!isdigit((unsigned char)*current))
+				goto malformed;
+			last = strtoul(current, &end, 10);
+		}
+		if (first < 1 || last > PORT_MAX || first > last)
+			goto malformed;
+
+		ports = ports ? pfcq_realloc(ports, (ret + last - first + 1) * sizeof(int)) : pfcq_alloc((last - first + 1) * sizeof(int));
+		for (unsigned long port = first; port <= last; port++)
+		{
+			if (seen[port / 64] & (1ULL << (port % 64)))
+				continue;
+			seen[port / 64] |= 1ULL << (port % 64);
+			ports[ret++] = port;
+		}
+
+		if (*end == '\0')
+			break;
+		if (*end != ',')
+			goto malformed;
+		current = end + 1;
+	}
+
+	*_ports = ports;
+
+	return ret;
+
+malformed:
+	if (ports)
+		pfcq_free(ports);
+
+	return 0;
+}
+
+int pingtcp_inventory_init(pingtcp_inventory_t* _inventory, pingtcp_engine_t* _engine, const char* _path)
+{
+	char* path = NULL;
+	int ret = 0;
+
+	pfcq_zero(_inventory, sizeof(pingtcp_inventory_t));
+	_inventory->engine = _engine;
+	_inventory->fd = -1;
+	_inventory->path = pfcq_strdup(_path);
+	_inventory->entries_size = INVENTORY_ENTRIES_MIN;
+	_inventory->entries = pfcq_alloc(_inventory->entries_size * sizeof(pingtcp_entry_t*));
+
+	/* Both modify their argument */
+	path = pfcq_strdup(_path);
+	_inventory->name = pfcq_strdup(basename(path));
+	pfcq_free(path);
+
+	_inventory->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (unlikely(_inventory->fd == -1))
+	{
+		ret = errno;
+		pingtcp_inventory_done(_inventory);
+		return ret;
+	}
+
+	path = pfcq_strdup(_path);
+	_inventory->watch = inotify_add_watch(_inventory->fd, dirname(path), IN_CLOSE_WRITE | IN_MOVED_TO);
+	pfcq_free(path);
+	if (unlikely(_inventory->watch == -1))
+	{
+		ret = errno;
+		pingtcp_inventory_done(_inventory);
+		return ret;
+	}
+
+	return ret;
+}
+
+int pingtcp_inventory_reload(pingtcp_inventory_t* _inventory)
+{
+	FILE* file = NULL;
+	char* line = NULL;
+	size_t line_size = 0;
+	size_t capacity = 0;
+	pingtcp_entry_t* seen = NULL;
+
+	file = fopen(_inventory->path, "r");
+	if (unlikely(!file))
+		return errno;
+
+	/* Changes queued by the previous reload are dropped, and its removals are live again */
+	__additions_free(_inventory);
+	while (_inventory->stale)
+	{
+		pingtcp_entry_t* entry = _inventory->stale;
+
+		__entry_unlink(entry);
+		__entry_link(&_inventory->live, entry);
+	}
+	_inventory->pending = 0;
+	_inventory->added = 0;
+	_inventory->removed = 0;
+	_inventory->kept = 0;
+	_inventory->unresolved = 0;
+	_inventory->malformed = 0;
+	_inventory->generation++;
+
+	while (getline(&line, &line_size, file) != -1)
+	{
+		char* save = NULL;
+		char* dst = NULL;
+		char* spec = NULL;
+		char* comment = strchr(line, '#');
+		int* ports = NULL;
+		size_t ports_count = 0;
+		size_t fresh = 0;
+		size_t source = INVENTORY_NONE;
+
+		if (comment)
+			*comment = '\0';
+		dst = strtok_r(line, " \t\r\n", &save);
+		if (!dst)
+			continue;
+		spec = strtok_r(NULL, " \t\r\n", &save);
+		if (!spec || strtok_r(NULL, " \t\r\n", &save) || strlen(dst) >= FQDN_MAX_LENGTH)
+		{
+			_inventory->malformed++;
+			continue;
+		}
+		ports_count = pingtcp_ports_parse(spec, &ports);
+		if (ports_count == 0)
+		{
+			_inventory->malformed++;
+			continue;
+		}
+
+		/* Known ports are taken off the live list, new ones are moved to the front of the array */
+		for (size_t i = 0; i < ports_count; i++)
+		{
+			pingtcp_entry_t* entry = __entry_find(_inventory, dst, ports[i]);
+
+			if (!entry)
+			{
+				ports[fresh++] = ports[i];
+				continue;
+			}
+			source = entry->target;
+			if (entry->generation == _inventory->generation)
+				continue;
+			entry->generation = _inventory->generation;
+			__entry_unlink(entry);
+			__entry_link(&seen, entry);
+			_inventory->kept++;
+		}
+
+		if (fresh == 0)
+		{
+			pfcq_free(ports);
+			continue;
+		}
+
+		if (_inventory->additions_count == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 64;
+			_inventory->additions = _inventory->additions ?
+				pfcq_realloc(_inventory->additions, capacity * sizeof(pingtcp_addition_t)) :
+				pfcq_alloc(capacity * sizeof(pingtcp_addition_t));
+		}
+		_inventory->additions[_inventory->additions_count].dst = pfcq_strdup(dst);
+		_inventory->additions[_inventory->additions_count].source = source;
+		_inventory->additions[_inventory->additions_count].ports_count = fresh;
+		_inventory->additions[_inventory->additions_count].position = 0;
+		_inventory->additions[_inventory->additions_count].ports = ports;
+		_inventory->additions_count++;
+		_inventory->pending += fresh;
+	}
+
+	if (line)
+		free(line);
+	if (unlikely(fclose(file) == EOF))
+		panic("fclose");
+
+	/* Whatever is left on the live list has not been seen */
+	_inventory->stale = _inventory->live;
+	if (_inventory->stale)
+		_inventory->stale->pprev = &_inventory->stale;
+	_inventory->live = seen;
+	if (_inventory->live)
+		_inventory->live->pprev = &_inventory->live;
+	for (pingtcp_entry_t* entry = _inventory->stale; entry; entry = entry->next)
+		_inventory->pending++;
+
+	return 0;
+}
+
+size_t pingtcp_inventory_apply(pingtcp_inventory_t* _inventory, size_t _budget)
+{
+	/* Removals go first, so that their slots may be reused by additions */
+	while (_budget > 0 && _inventory->stale)
+	{
+		pingtcp_entry_t* entry = _inventory->stale;
+
+		if (unlikely(pingtcp_engine_remove(_inventory->engine, entry->target) == -1))
+			panic("pingtcp_engine_remove");
+		__entry_delete(_inventory, entry);
+		_inventory->removed++;
+		_inventory->pending--;
+		_budget--;
+	}
+
+	while (_budget > 0 && _inventory->additions_position < _inventory->additions_count)
+	{
+		pingtcp_addition_t* addition = &_inventory->additions[_inventory->additions_position];
+		int port = 0;
+		size_t target = 0;
+
+		if (addition->position == addition->ports_count)
+		{
+			_inventory->additions_position++;
+			continue;
+		}
+
+		port = addition->ports[addition->position++];
+		_inventory->pending--;
+		_budget--;
+
+		/* Listed twice */
+		if (__entry_find(_inventory, addition->dst, port))
+			continue;
+
+		if (addition->source == INVENTORY_NONE)
+		{
+			/* The host does not resolve, so none of its ports are added */
+			if (pingtcp_engine_add(_inventory->engine, addition->dst, port, &target) != 0)
+			{
+				_inventory->unresolved += addition->ports_count - addition->position + 1;
+				_inventory->pending -= addition->ports_count - addition->position;
+				addition->position = addition->ports_count;
+				continue;
+			}
+			addition->source = target;
+		} else if (unlikely(pingtcp_engine_add_port(_inventory->engine, addition->source, port, &target) == -1))
+			panic("pingtcp_engine_add_port");
+
+		__entry_add(_inventory, addition->dst, port, target);
+		_inventory->added++;
+	}
+
+	if (_inventory->pending == 0)
+		__additions_free(_inventory);
+
+	return _inventory->pending;
+}
+
+size_t pingtcp_inventory_pending(const pingtcp_inventory_t* _inventory)
+{
+	return _inventory->pending;
+}
+
+int pingtcp_inventory_fd(const pingtcp_inventory_t* _inventory)
+{
+	return _inventory->fd;
+}
+
+int pingtcp_inventory_changed(pingtcp_inventory_t* _inventory)
+{
+	char events[INVENTORY_EVENTS] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t length = 0;
+	int ret = 0;
+
+	while ((length = read(_inventory->fd, events, INVENTORY_EVENTS)) > 0)
+	{
+		for (char* current = events; current < events + length; current += sizeof(struct inotify_event) + ((struct inotify_event*)current)->len)
+		{
+			const struct inotify_event* event = (const struct inotify_event*)current;
+
+			if (event->len > 0 && strcmp(event->name, _inventory->name) == 0)
+				ret = 1;
+		}
+	}
+	if (unlikely(length == -1 && errno != EAGAIN && errno != EINTR))
+		panic("read");
+
+	return ret;
+}
+
+void pingtcp_inventory_done(pingtcp_inventory_t* _inventory)
+{
+	__additions_free(_inventory);
+	while (_inventory->live)
+		__entry_delete(_inventory, _inventory->live);
+	while (_inventory->stale)
+		__entry_delete(_inventory, _inventory->stale);
+	pfcq_free(_inventory->entries);
+	pfcq_free(_inventory->path);
+	pfcq_free(_inventory->name);
+	if (_inventory->fd != -1)
+		if (unlikely(close(_inventory->fd) == -1))
+			panic("close");
+	pfcq_zero(_inventory, sizeof(pingtcp_inventory_t));
+
+	return;
+}
@@ -0,0 +1,112 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifndef __INVENTORY_H__
+#define __INVENTORY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "engine.h"
+
+#define PORT_MAX					65535
+#define INVENTORY_ENTRIES_MIN		1024
+#define INVENTORY_BATCH				256
+
+/* Target taken from the file, found by its host and port */
+typedef struct pingtcp_entry
+{
+	struct pingtcp_entry* next;
+	struct pingtcp_entry** pprev;
+	uint64_t hash;
+	uint64_t generation;
+	size_t target;
+	int port;
+	char* dst;
+} pingtcp_entry_t;
+
+/* New ports of one line, added next to a known port of the same host if there is one */
+typedef struct pingtcp_addition
+{
+	char* dst;
+	size_t source;
+	size_t ports_count;
+	size_t position;
+	int* ports;
+} pingtcp_addition_t;
+
+/*
+ * Keeps the engine targets in line with a file of "<host> <ports>" lines,
+ * ports given as for the command line and '#' starting a comment.
+ * A reload looks every line up in a hash table of what is probed already:
+ * targets found there are left alone, keeping their statistics and attempts
+ * in flight, while the others are queued as additions, and whatever has not
+ * been seen is queued for removal. Queued changes are then applied in small
+ * batches between steps of the engine, so that probing never stalls.
+ * A reload while changes are still queued starts over from the live set.
+ * The directory of the file is watched, so that both editing it in place
+ * and replacing it by rename are noticed
+ */
+typedef struct pingtcp_inventory
+{
+	pingtcp_engine_t* engine;
+	char* path;
+	char* name;
+	int fd;
+	int watch;
+	uint64_t generation;
+	size_t entries_count;
+	size_t entries_size;
+	pingtcp_entry_t** entries;
+	/* Entries seen by the last reload, and ones it did not see */
+	pingtcp_entry_t* live;
+	pingtcp_entry_t* stale;
+	size_t additions_count;
+	size_t additions_position;
+	pingtcp_addition_t* additions;
+	size_t pending;
+	/* Outcome of the last reload */
+	size_t added;
+	size_t removed;
+	size_t kept;
+	size_t unresolved;
+	size_t malformed;
+} pingtcp_inventory_t;
+
+size_t pingtcp_ports_parse(const char* _spec, int** _ports) __attribute__((nonnull(1, 2), warn_unused_result));
+
+/*
+ * pingtcp_inventory_reload() returns 0, or the errno value of what failed,
+ * in which case the targets are left as they are. pingtcp_inventory_apply()
+ * makes up to _budget of the queued changes and returns how many are left.
+ * pingtcp_inventory_fd() becomes readable when the directory changes, and
+ * pingtcp_inventory_changed() then tells whether the file is among the changes
+ */
+int pingtcp_inventory_init(pingtcp_inventory_t* _inventory, pingtcp_engine_t* _engine, const char* _path) __attribute__((nonnull(1, 2, 3), warn_unused_result));
+int pingtcp_inventory_reload(pingtcp_inventory_t* _inventory) __attribute__((nonnull(1), warn_unused_result));
+size_t pingtcp_inventory_apply(pingtcp_inventory_t* _inventory, size_t _budget) __attribute__((nonnull(1)));
+size_t pingtcp_inventory_pending(const pingtcp_inventory_t* _inventory) __attribute__((nonnull(1), warn_unused_result));
+int pingtcp_inventory_fd(const pingtcp_inventory_t* _inventory) __attribute__((nonnull(1), warn_unused_result));
+int pingtcp_inventory_changed(pingtcp_inventory_t* _inventory) __attribute__((nonnull(1), warn_unused_result));
+void pingtcp_inventory_done(pingtcp_inventory_t* _inventory) __attribute__((nonnull(1)));
+
+#endif /* __INVENTORY_H__ */
@@ -0,0 +1,550 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <arpa/inet.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "passive.h"
+
+#define TCP_FLAG_FIN		0x01
+#define TCP_FLAG_SYN		0x02
+#define TCP_FLAG_RST		0x04
+#define TCP_FLAG_ACK		0x10
+#define TCP_HEADER_MIN		14
+#define ICMP_UNREACHABLE	3
+#define ICMP_TIME_EXCEEDED	11
+#define ICMP6_UNREACHABLE	1
+#define ICMP6_TIME_EXCEEDED	3
+#define IP6_HEADERS_MAX		8
+
+static inline uint16_t __get16(const uint8_t* _data)
+{
+	return (uint16_t)(_data[0] << 8 | _data[1]);
+}
+
+static inline uint32_t __get32(const uint8_t* _data)
+{
+	return (uint32_t)_data[0] << 24 | (uint32_t)_data[1] << 16 | (uint32_t)_data[2] << 8 | _data[3];
+}
+
+static uint64_t __hash(const void* _key, size_t _size)
+{
+	const uint8_t* key = _key;
+	uint64_t ret = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < _size; i++)
+	{
+		ret ^= key[i];
+		ret *= 1099511628211ULL;
+	}
+
+	return ret;
+}
+
+static void __destination_insert(pingtcp_passive_t* _passive, size_t _destination)
+{
+	const pingtcp_destination_t* destination = &_passive->destinations[_destination];
+	size_t mask = _passive->index_size - 1;
+	size_t slot = __hash(destination, offsetof(pingtcp_destination_t, host)) & mask;
+
+	/* Slots hold destination index + 1, so that zero means empty */
+	while (_passive->index[slot])
+		slot = (slot + 1) & mask;
+	_passive->index[slot] = _destination + 1;
+
+	return;
+}
+
+static uint32_t __destination_get(pingtcp_passive_t* _passive, uint16_t _family, const uint8_t* _address, uint16_t _port)
+{
+	pingtcp_destination_t key;
+	pingtcp_destination_t* destination = NULL;
+	size_t mask = _passive->index_size - 1;
+	size_t slot = 0;
+
+	pfcq_zero(&key, sizeof(pingtcp_destination_t));
+	key.family = _family;
+	key.port = _port;
+	memcpy(key.address, _address, _family == AF_INET6 ? 16 : 4);
+
+	slot = __hash(&key, offsetof(pingtcp_destination_t, host)) & mask;
+	while (_passive->index[slot])
+	{
+		if (memcmp(&_passive->destinations[_passive->index[slot] - 1], &key, offsetof(pingtcp_destination_t, host)) == 0)
+			return _passive->index[slot] - 1;
+		slot = (slot + 1) & mask;
+	}
+
+	if (_passive->count == _passive->capacity)
+	{
+		_passive->capacity *= 2;
+		_passive->destinations = pfcq_realloc(_passive->destinations, _passive->capacity * sizeof(pingtcp_destination_t));
+		_passive->stats = pfcq_realloc(_passive->stats, _passive->capacity * sizeof(pingtcp_stats_t));
+	}
+	destination = &_passive->destinations[_passive->count];
+	memcpy(destination, &key, sizeof(pingtcp_destination_t));
+	if (unlikely(!inet_ntop(_family, destination->address, destination->host, INET6_ADDRSTRLEN)))
+		panic("inet_ntop");
+	pingtcp_stats_init(&_passive->stats[_passive->count]);
+	_passive->count++;
+
+	/* Kept at most half full */
+	if (_passive->count * 2 > _passive->index_size)
+	{
+		pfcq_free(_passive->index);
+		_passive->index_size *= 2;
+		_passive->index = pfcq_alloc(_passive->index_size * sizeof(uint32_t));
+		for (size_t i = 0; i < _passive->count; i++)
+			__destination_insert(_passive, i);
+	} else
+		__destination_insert(_passive, _passive->count - 1);
+
+	return _passive->count - 1;
+}
+
+static size_t __flow_slot(const pingtcp_passive_t* _passive, const pingtcp_flow_key_t* _key)
+{
+	return __hash(_key, sizeof(pingtcp_flow_key_t)) & (_passive->flows_size - 1);
+}
+
+static pingtcp_flow_t* __flow_find(pingtcp_passive_t* _passive, const pingtcp_flow_key_t* _key)
+{
+	size_t mask = _passive->flows_size - 1;
+	size_t slot = 0;
+
+	if (_passive->flows_count == 0)
+		return NULL;
+
+	slot = __flow_slot(_passive, _key);
+	while (_passive->flows[slot].state != PINGTCP_FLOW_EMPTY)
+	{
+		if (memcmp(&_passive->flows[slot].key, _key, sizeof(pingtcp_flow_key_t)) == 0)
+			return &_passive->flows[slot];
+		slot = (slot + 1) & mask;
+	}
+
+	return NULL;
+}
+
+static pingtcp_flow_t* __flow_place(pingtcp_passive_t* _passive, const pingtcp_flow_key_t* _key)
+{
+	size_t mask = _passive->flows_size - 1;
+	size_t slot = __flow_slot(_passive, _key);
+
+	while (_passive->flows[slot].state != PINGTCP_FLOW_EMPTY)
+		slot = (slot + 1) & mask;
+	memcpy(&_passive->flows[slot].key, _key, sizeof(pingtcp_flow_key_t));
+
+	return &_passive->flows[slot];
+}
+
+static pingtcp_flow_t* __flow_add(pingtcp_passive_t* _passive, const pingtcp_flow_key_t* _key)
+{
+	pingtcp_flow_t* ret = NULL;
+
+	/* Kept at most half full */
+	if ((_passive->flows_count + 1) * 2 > _passive->flows_size)
+	{
+		pingtcp_flow_t* flows = _passive->flows;
+		size_t size = _passive->flows_size;
+
+		_passive->flows_size *= 2;
+		_passive->flows = pfcq_alloc(_passive->flows_size * sizeof(pingtcp_flow_t));
+		for (size_t i = 0; i < size; i++)
+			if (flows[i].state != PINGTCP_FLOW_EMPTY)
+				memcpy(__flow_place(_passive, &flows[i].key), &flows[i], sizeof(pingtcp_flow_t));
+		pfcq_free(flows);
+	}
+
+	ret = __flow_place(_passive, _key);
+	_passive->flows_count++;
+
+	return ret;
+}
+
+/*
+ * Backward shift deletion: entries after the hole that would not be found
+ * past it anymore are moved into it, so the table never needs tombstones
+ */
+static void __flow_delete(pingtcp_passive_t* _passive, pingtcp_flow_t* _flow)
+{
+	size_t mask = _passive->flows_size - 1;
+	size_t hole = _flow - _passive->flows;
+	size_t slot = hole;
+
+	for (;;)
+	{
+		size_t home = 0;
+
+		slot = (slot + 1) & mask;
+		if (_passive->flows[slot].state == PINGTCP_FLOW_EMPTY)
+			break;
+		home = __flow_slot(_passive, &_passive->flows[slot].key);
+		/* Stays unless its home lies cyclically within (hole, slot] */
+		if ((slot > hole && (home <= hole || home > slot)) || (slot < hole && home <= hole && home > slot))
+		{
+			memcpy(&_passive->flows[hole], &_passive->flows[slot], sizeof(pingtcp_flow_t));
+			hole = slot;
+		}
+	}
+
+	pfcq_zero(&_passive->flows[hole], sizeof(pingtcp_flow_t));
+	_passive->flows_count--;
+
+	return;
+}
+
+/* Accounted just like an attempt of the engine */
+static void __flow_finish(pingtcp_passive_t* _passive, pingtcp_flow_t* _flow, pingtcp_failure_t _failure, int64_t _ts_ns)
+{
+	pingtcp_stats_t* stats = &_passive->stats[_flow->destination];
+	double time_ms = 0;
+
+	/* Completed too late counts as lost, as it does for probes */
+	if (_failure != PINGTCP_FAILURE_TIMEOUT && _ts_ns - _flow->syn_ns > _passive->timeout_ns)
+		_failure = PINGTCP_FAILURE_TIMEOUT;
+	if (_failure == PINGTCP_FAILURE_TIMEOUT)
+		_ts_ns = _flow->syn_ns + _passive->timeout_ns;
+	/* Packets from several interfaces may come slightly out of order */
+	if (likely(_ts_ns > _flow->syn_ns))
+		time_ms = (double)(_ts_ns - _flow->syn_ns) / 1000000.0;
+
+	stats->syn_sent += _flow->syns;
+	stats->syn_lost += _failure == PINGTCP_FAILURE_TIMEOUT ? _flow->syns : _flow->syns - 1;
+
+	switch (_failure)
+	{
+		case PINGTCP_FAILURE_NONE:
+			stats->ok++;
+			/* Karn, as for probes */
+			if (_flow->syns > 1)
+				stats->retransmitted++;
+			else
+				pingtcp_stats_rtt(stats, time_ms);
+			break;
+		case PINGTCP_FAILURE_TIMEOUT:
+			pingtcp_stats_failure(stats, _failure, time_ms);
+			stats->lost++;
+			break;
+		default:
+			pingtcp_stats_failure(stats, _failure, time_ms);
+			stats->fail++;
+			break;
+	}
+
+	__flow_delete(_passive, _flow);
+
+	return;
+}
+
+static void __flow_syn(pingtcp_passive_t* _passive, const pingtcp_flow_key_t* _key, uint32_t _isn, int64_t _ts_ns)
+{
+	pingtcp_flow_t* flow = __flow_find(_passive, _key);
+
+	if (flow)
+	{
+		if (flow->isn == _isn)
+		{
+			flow->syns++;
+			return;
+		}
+		/* Same ports reused for a new connection, so the previous attempt has failed */
+		__flow_finish(_passive, flow, PINGTCP_FAILURE_TIMEOUT, _ts_ns);
+	}
+
+	flow = __flow_add(_passive, _key);
+	flow->state = PINGTCP_FLOW_SYN;
+	flow->syn_ns = _ts_ns;
+	flow->isn = _isn;
+	flow->syns = 1;
+	flow->destination = __destination_get(_passive, _key->family, _key->server, _key->server_port);
+	_passive->stats[flow->destination].attempt++;
+
+	return;
+}
+
+static void __key_fill(pingtcp_flow_key_t* _key, uint16_t _family, const uint8_t* _client, const uint8_t* _server, const uint8_t* _ports)
+{
+	size_t size = _family == AF_INET6 ? 16 : 4;
+
+	pfcq_zero(_key, sizeof(pingtcp_flow_key_t));
+	_key->family = _family;
+	memcpy(_key->client, _client, size);
+	memcpy(_key->server, _server, size);
+	_key->client_port = __get16(_ports);
+	_key->server_port = __get16(_ports + 2);
+
+	return;
+}
+
+static void __passive_tcp(pingtcp_passive_t* _passive, uint16_t _family, const uint8_t* _src, const uint8_t* _dst,
+		const uint8_t* _tcp, size_t _length, int _inbound, int64_t _ts_ns)
+{
+	pingtcp_flow_key_t key;
+	pingtcp_flow_t* flow = NULL;
+	uint8_t flags = 0;
+	uint8_t reversed[4];
+
+	if (unlikely(_length < TCP_HEADER_MIN))
+		return;
+	flags = _tcp[13];
+
+	/* Most packets belong to established connections, and there is nothing to match them against */
+	if (!(flags & TCP_FLAG_SYN) && _passive->flows_count == 0)
+		return;
+
+	if ((flags & (TCP_FLAG_SYN | TCP_FLAG_ACK | TCP_FLAG_RST)) == TCP_FLAG_SYN)
+	{
+		/* A local server answers it at once, which is no round trip at all */
+		if (_inbound && _passive->synack_completes)
+			return;
+		__key_fill(&key, _family, _src, _dst, _tcp);
+		__flow_syn(_passive, &key, __get32(_tcp + 4), _ts_ns);
+		return;
+	}
+
+	/* Answers travel from the server, so the key is built the other way round */
+	memcpy(reversed, _tcp + 2, 2);
+	memcpy(reversed + 2, _tcp, 2);
+
+	if ((flags & (TCP_FLAG_SYN | TCP_FLAG_ACK | TCP_FLAG_RST)) == (TCP_FLAG_SYN | TCP_FLAG_ACK))
+	{
+		__key_fill(&key, _family, _dst, _src, reversed);
+		flow = __flow_find(_passive, &key);
+		if (!flow)
+			return;
+		flow->state = PINGTCP_FLOW_ANSWERED;
+		if (_passive->synack_completes)
+			__flow_finish(_passive, flow, PINGTCP_FAILURE_NONE, _ts_ns);
+		return;
+	}
+
+	if (flags & TCP_FLAG_RST)
+	{
+		__key_fill(&key, _family, _dst, _src, reversed);
+		flow = __flow_find(_passive, &key);
+		if (flow)
+		{
+			__flow_finish(_passive, flow, PINGTCP_FAILURE_REFUSED, _ts_ns);
+			return;
+		}
+		/* Given up by the client, which is neither a success nor a failure of the server */
+		__key_fill(&key, _family, _src, _dst, _tcp);
+		flow = __flow_find(_passive, &key);
+		if (flow)
+		{
+			_passive->stats[flow->destination].attempt--;
+			__flow_delete(_passive, flow);
+		}
+		return;
+	}
+
+	if (flags & (TCP_FLAG_ACK | TCP_FLAG_FIN))
+	{
+		__key_fill(&key, _family, _src, _dst, _tcp);
+		flow = __flow_find(_passive, &key);
+		if (flow)
+			__flow_finish(_passive, flow, PINGTCP_FAILURE_NONE, _ts_ns);
+	}
+
+	return;
+}
+
+/*
+ * An ICMP error quotes the header of the SYN that caused it,
+ * which names the flow from the client side
+ */
+static void __passive_icmp(pingtcp_passive_t* _passive, uint16_t _family, const uint8_t* _quoted, size_t _length, int64_t _ts_ns)
+{
+	pingtcp_flow_key_t key;
+	pingtcp_flow_t* flow = NULL;
+	size_t header = 0;
+
+	if (_passive->flows_count == 0)
+		return;
+
+	if (_family == AF_INET)
+	{
+		if (_length < 20 || _quoted[0] >> 4 != 4 || _quoted[9] != IPPROTO_TCP)
+			return;
+		header = (_quoted[0] & 0x0f) * 4;
+		if (_length < header + 4)
+			return;
+		__key_fill(&key, AF_INET, _quoted + 12, _quoted + 16, _quoted + header);
+	} else
+	{
+		if (_length < 44 || _quoted[0] >> 4 != 6 || _quoted[6] != IPPROTO_TCP)
+			return;
+		__key_fill(&key, AF_INET6, _quoted + 8, _quoted + 24, _quoted + 40);
+	}
+
+	flow = __flow_find(_passive, &key);
+	if (flow)
+		__flow_finish(_passive, flow, PINGTCP_FAILURE_UNREACHABLE, _ts_ns);
+
+	return;
+}
+
+void pingtcp_passive_init(pingtcp_passive_t* _passive, int64_t _timeout_ns)
+{
+	pfcq_zero(_passive, sizeof(pingtcp_passive_t));
+	_passive->timeout_ns = _timeout_ns;
+	_passive->first_ns = -1;
+	_passive->flows_size = PASSIVE_FLOWS_MIN;
+	_passive->flows = pfcq_alloc(_passive->flows_size * sizeof(pingtcp_flow_t));
+	_passive->capacity = PASSIVE_DESTINATIONS_MIN;
+	_passive->destinations = pfcq_alloc(_passive->capacity * sizeof(pingtcp_destination_t));
+	_passive->stats = pfcq_alloc(_passive->capacity * sizeof(pingtcp_stats_t));
+	_passive->index_size = PASSIVE_DESTINATIONS_MIN * 2;
+	_passive->index = pfcq_alloc(_passive->index_size * sizeof(uint32_t));
+
+	return;
+}
+
+/* Takes an IPv4 or IPv6 packet, link layer header stripped, and whether it is known to come from elsewhere */
+void pingtcp_passive_ip(pingtcp_passive_t* _passive, const uint8_t* _packet, size_t _length, int _inbound, int64_t _ts_ns)
+{
+	size_t header = 0;
+	uint8_t next = 0;
+
+	if (unlikely(_passive->first_ns == -1))
+		_passive->first_ns = _passive->swept_ns = _ts_ns;
+	if (likely(_ts_ns > _passive->last_ns))
+		_passive->last_ns = _ts_ns;
+	_passive->packets++;
+
+	/* Swept once per timeout period rather than on every packet */
+	if (_ts_ns - _passive->swept_ns >= _passive->timeout_ns)
+		pingtcp_passive_expire(_passive, _ts_ns);
+
+	if (unlikely(_length < 1))
+		return;
+
+	switch (_packet[0] >> 4)
+	{
+		case 4:
+			if (unlikely(_length < 20))
+				return;
+			header = (_packet[0] & 0x0f) * 4;
+			/* Link layer padding is not a part of the packet */
+			if (__get16(_packet + 2) < _length)
+				_length = __get16(_packet + 2);
+			/* Only the first fragment has the TCP header */
+			if (unlikely(header < 20 || _length < header || (__get16(_packet + 6) & 0x1fff) != 0))
+				return;
+			if (_packet[9] == IPPROTO_TCP)
+				__passive_tcp(_passive, AF_INET, _packet + 12, _packet + 16, _packet + header, _length - header, _inbound, _ts_ns);
+			else if (_packet[9] == IPPROTO_ICMP && _length >= header + 8 &&
+				(_packet[header] == ICMP_UNREACHABLE || _packet[header] == ICMP_TIME_EXCEEDED))
+				__passive_icmp(_passive, AF_INET, _packet + header + 8, _length - header - 8, _ts_ns);
+			break;
+		case 6:
+			if (unlikely(_length < 40))
+				return;
+			if ((size_t)__get16(_packet + 4) + 40 < _length)
+				_length = __get16(_packet + 4) + 40;
+			header = 40;
+			next = _packet[6];
+			/* Extension headers are walked, but not too far */
+			for (int i = 0; i < IP6_HEADERS_MAX && _length >= header + 8; i++)
+			{
+				if (next == IPPROTO_HOPOPTS || next == IPPROTO_ROUTING || next == IPPROTO_DSTOPTS)
+				{
+					next = _packet[header];
+					header += (_packet[header + 1] + 1) * 8;
+				} else if (next == IPPROTO_FRAGMENT)
+				{
+					if ((__get16(_packet + header + 2) & 0xfff8) != 0)
+						return;
+					next = _packet[header];
+					header += 8;
+				} else
+					break;
+			}
+			if (_length < header)
+				return;
+			if (next == IPPROTO_TCP)
+				__passive_tcp(_passive, AF_INET6, _packet + 8, _packet + 24, _packet + header, _length - header, _inbound, _ts_ns);
+			else if (next == IPPROTO_ICMPV6 && _length >= header + 8 &&
+				(_packet[header] == ICMP6_UNREACHABLE || _packet[header] == ICMP6_TIME_EXCEEDED))
+				__passive_icmp(_passive, AF_INET6, _packet + header + 8, _length - header - 8, _ts_ns);
+			break;
+		default:
+			break;
+	}
+
+	return;
+}
+
+/*
+ * Deleting shifts later entries back into the current slot,
+ * so the slot is looked at again instead of moving on
+ */
+void pingtcp_passive_expire(pingtcp_passive_t* _passive, int64_t _now_ns)
+{
+	_passive->swept_ns = _now_ns;
+	if (_passive->flows_count == 0)
+		return;
+
+	for (size_t i = 0; i < _passive->flows_size;)
+	{
+		pingtcp_flow_t* flow = &_passive->flows[i];
+
+		if (flow->state != PINGTCP_FLOW_EMPTY && _now_ns - flow->syn_ns >= _passive->timeout_ns)
+			__flow_finish(_passive, flow, PINGTCP_FAILURE_TIMEOUT, _now_ns);
+		else
+			i++;
+	}
+
+	return;
+}
+
+/*
+ * Handshakes still within their timeout when the packets end have no outcome yet,
+ * so they are not counted at all rather than taken for lost
+ */
+void pingtcp_passive_finish(pingtcp_passive_t* _passive)
+{
+	pingtcp_passive_expire(_passive, _passive->last_ns);
+
+	for (size_t i = 0; i < _passive->flows_size; i++)
+	{
+		if (_passive->flows[i].state == PINGTCP_FLOW_EMPTY)
+			continue;
+		_passive->stats[_passive->flows[i].destination].attempt--;
+		_passive->undecided++;
+		pfcq_zero(&_passive->flows[i], sizeof(pingtcp_flow_t));
+	}
+	_passive->flows_count = 0;
+
+	return;
+}
+
+void pingtcp_passive_done(pingtcp_passive_t* _passive)
+{
+	pfcq_free(_passive->flows);
+	pfcq_free(_passive->destinations);
+	pfcq_free(_passive->stats);
+	pfcq_free(_passive->index);
+	pfcq_zero(_passive, sizeof(pingtcp_passive_t));
+
+	return;
+}
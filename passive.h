@@ -0,0 +1,112 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifndef __PASSIVE_H__
+#define __PASSIVE_H__
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "engine.h"
+
+#define PASSIVE_FLOWS_MIN			1024
+#define PASSIVE_DESTINATIONS_MIN	64
+
+/* Both ends of a handshake, oriented from the side that sent the SYN */
+typedef struct pingtcp_flow_key
+{
+	uint8_t client[16];
+	uint8_t server[16];
+	uint16_t client_port;
+	uint16_t server_port;
+	uint16_t family;
+	uint16_t reserved;
+} pingtcp_flow_key_t;
+
+typedef enum pingtcp_flow_state
+{
+	PINGTCP_FLOW_EMPTY = 0,
+	PINGTCP_FLOW_SYN,
+	PINGTCP_FLOW_ANSWERED
+} pingtcp_flow_state_t;
+
+/*
+ * Handshake in progress. Retransmitted SYNs carry the same ISN,
+ * so a SYN with another one on the same ports starts a new attempt
+ */
+typedef struct pingtcp_flow
+{
+	pingtcp_flow_key_t key;
+	int64_t syn_ns;
+	uint32_t isn;
+	uint32_t syns;
+	uint32_t destination;
+	uint8_t state;
+} pingtcp_flow_t;
+
+typedef struct pingtcp_destination
+{
+	uint16_t family;
+	uint16_t port;
+	uint8_t address[16];
+	char host[INET6_ADDRSTRLEN];
+} pingtcp_destination_t;
+
+/*
+ * Matches handshakes seen on the wire and accounts them per destination
+ * (server address and port) the same way the engine does for its own attempts.
+ * A handshake takes from the first SYN until the client ACKs the SYN-ACK,
+ * which is about the same whichever end the packets are seen at; when ACKs
+ * are not seen, synack_completes makes it end at the SYN-ACK instead.
+ * That only times anything for SYNs this host sent: for inbound ones the
+ * SYN-ACK goes out right here, so such handshakes are not counted at all.
+ * Handshakes that are neither completed nor refused within timeout_ns
+ * are lost. Flows live in an open addressing table kept at most half full
+ */
+typedef struct pingtcp_passive
+{
+	int64_t timeout_ns;
+	int synack_completes;
+	int64_t first_ns;
+	int64_t last_ns;
+	int64_t swept_ns;
+	uint64_t packets;
+	uint64_t undecided;
+	size_t flows_count;
+	size_t flows_size;
+	pingtcp_flow_t* flows;
+	size_t count;
+	size_t capacity;
+	size_t index_size;
+	uint32_t* index;
+	pingtcp_destination_t* destinations;
+	pingtcp_stats_t* stats;
+} pingtcp_passive_t;
+
+void pingtcp_passive_init(pingtcp_passive_t* _passive, int64_t _timeout_ns) __attribute__((nonnull(1)));
+void pingtcp_passive_ip(pingtcp_passive_t* _passive, const uint8_t* _packet, size_t _length, int _inbound, int64_t _ts_ns) __attribute__((nonnull(1, 2)));
+void pingtcp_passive_expire(pingtcp_passive_t* _passive, int64_t _now_ns) __attribute__((nonnull(1)));
+void pingtcp_passive_finish(pingtcp_passive_t* _passive) __attribute__((nonnull(1)));
+void pingtcp_passive_done(pingtcp_passive_t* _passive) __attribute__((nonnull(1)));
+
+#endif /* __PASSIVE_H__ */
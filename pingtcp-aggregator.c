@@ -0,0 +1,674 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <float.h>
+#include <libgen.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "contrib/pfcq/pfcq.h"
+#include "histogram.h"
+#include "wire.h"
+
+#define AGGREGATOR_MAXEVENTS	64
+#define AGGREGATOR_BACKLOG		128
+#define AGGREGATOR_READ_CHUNK	65536
+#define AGGREGATOR_IDS_MAX		(1 << 24)
+#define REPORT_DEFAULT_MS		10000
+
+/*
+ * Statistics of one target as seen from one vantage point, along with the
+ * latest totals of the current instance of the target, which reports are
+ * told apart from. Cells are never freed, so that both the target and
+ * the vantage point may refer to them
+ */
+typedef struct aggregator_cell
+{
+	size_t target;
+	size_t vantage;
+	uint64_t instance;
+	int64_t counters[PINGTCP_WIRE_COUNTERS];
+	uint64_t histogram[HISTOGRAM_BUCKETS];
+	int64_t seen_counters[PINGTCP_WIRE_COUNTERS];
+	uint64_t seen_histogram[HISTOGRAM_BUCKETS];
+} aggregator_cell_t;
+
+typedef struct aggregator_target
+{
+	char* key;
+	int64_t counters[PINGTCP_WIRE_COUNTERS];
+	uint64_t histogram[HISTOGRAM_BUCKETS];
+	size_t cells_count;
+	aggregator_cell_t** cells;
+} aggregator_target_t;
+
+/*
+ * Vantage points outlive connections, so an agent that reconnects
+ * keeps adding to its own statistics
+ */
+typedef struct aggregator_vantage
+{
+	char* name;
+} aggregator_vantage_t;
+
+/*
+ * Target ids are only meaningful within one connection,
+ * since the agent announces them again after reconnecting
+ */
+typedef struct aggregator_client
+{
+	int fd;
+	ssize_t vantage;
+	size_t ids;
+	aggregator_cell_t** by_id;
+	uint64_t frames;
+	uint64_t acked;
+	pingtcp_buffer_t in;
+	pingtcp_buffer_t out;
+} aggregator_client_t;
+
+typedef struct aggregator
+{
+	size_t targets_count;
+	size_t targets_capacity;
+	aggregator_target_t* targets;
+	size_t index_size;
+	size_t* index;
+	size_t vantages_count;
+	aggregator_vantage_t* vantages;
+	int epoll_fd;
+	int listen_fd;
+	int signal_fd;
+} aggregator_t;
+
+static void __usage(char* _argv0)
+{
+	inform("Usage: %s <port> [-b address] [-r interval]\n", basename(_argv0));
+	exit(EX_USAGE);
+}
+
+static uint64_t __hash(const char* _key)
+{
+	uint64_t ret = 14695981039346656037ULL;
+
+	while (*_key)
+	{
+		ret ^= (uint8_t)*_key++;
+		ret *= 1099511628211ULL;
+	}
+
+	return ret;
+}
+
+static void __index_insert(aggregator_t* _aggregator, size_t _target)
+{
+	size_t mask = _aggregator->index_size - 1;
+	size_t slot = __hash(_aggregator->targets[_target].key) & mask;
+
+	/* Slots hold target index + 1, so that zero means empty */
+	while (_aggregator->index[slot])
+		slot = (slot + 1) & mask;
+	_aggregator->index[slot] = _target + 1;
+
+	return;
+}
+
+static size_t __target_get(aggregator_t* _aggregator, const char* _key)
+{
+	size_t mask = 0;
+	size_t slot = 0;
+	aggregator_target_t* target = NULL;
+
+	if (_aggregator->index_size)
+	{
+		mask = _aggregator->index_size - 1;
+		slot = __hash(_key) & mask;
+		while (_aggregator->index[slot])
+		{
+			if (strcmp(_aggregator->targets[_aggregator->index[slot] - 1].key, _key) == 0)
+				return _aggregator->index[slot] - 1;
+			slot = (slot + 1) & mask;
+		}
+	}
+
+	if (_aggregator->targets_count == _aggregator->targets_capacity)
+	{
+		_aggregator->targets_capacity = _aggregator->targets_capacity ? _aggregator->targets_capacity * 2 : 64;
+		_aggregator->targets = _aggregator->targets ?
+			pfcq_realloc(_aggregator->targets, _aggregator->targets_capacity * sizeof(aggregator_target_t)) :
+			pfcq_alloc(_aggregator->targets_capacity * sizeof(aggregator_target_t));
+	}
+	target = &_aggregator->targets[_aggregator->targets_count];
+	pfcq_zero(target, sizeof(aggregator_target_t));
+	target->key = pfcq_strdup(_key);
+	_aggregator->targets_count++;
+
+	/* Kept at most half full */
+	if (_aggregator->targets_count * 2 > _aggregator->index_size)
+	{
+		if (_aggregator->index)
+			pfcq_free(_aggregator->index);
+		_aggregator->index_size = _aggregator->index_size ? _aggregator->index_size * 2 : 128;
+		_aggregator->index = pfcq_alloc(_aggregator->index_size * sizeof(size_t));
+		for (size_t i = 0; i < _aggregator->targets_count; i++)
+			__index_insert(_aggregator, i);
+	} else
+		__index_insert(_aggregator, _aggregator->targets_count - 1);
+
+	return _aggregator->targets_count - 1;
+}
+
+static size_t __vantage_get(aggregator_t* _aggregator, const char* _name)
+{
+	for (size_t i = 0; i < _aggregator->vantages_count; i++)
+		if (strcmp(_aggregator->vantages[i].name, _name) == 0)
+			return i;
+
+	_aggregator->vantages = _aggregator->vantages ?
+		pfcq_realloc(_aggregator->vantages, (_aggregator->vantages_count + 1) * sizeof(aggregator_vantage_t)) :
+		pfcq_alloc(sizeof(aggregator_vantage_t));
+	pfcq_zero(&_aggregator->vantages[_aggregator->vantages_count], sizeof(aggregator_vantage_t));
+	_aggregator->vantages[_aggregator->vantages_count].name = pfcq_strdup(_name);
+
+	return _aggregator->vantages_count++;
+}
+
+static int __frame_hello(aggregator_t* _aggregator, aggregator_client_t* _client, pingtcp_reader_t* _frame)
+{
+	uint64_t version = pingtcp_reader_get_varint(_frame);
+	uint64_t buckets = pingtcp_reader_get_varint(_frame);
+	char* name = pingtcp_reader_get_string(_frame);
+
+	if (unlikely(_frame->error || version != WIRE_VERSION || buckets != HISTOGRAM_BUCKETS))
+	{
+		if (name)
+			pfcq_free(name);
+		return -1;
+	}
+
+	_client->vantage = __vantage_get(_aggregator, name);
+	inform("Agent %s connected\n", name);
+	pfcq_free(name);
+
+	return 0;
+}
+
+static int __frame_target(aggregator_t* _aggregator, aggregator_client_t* _client, pingtcp_reader_t* _frame)
+{
+	aggregator_target_t* target = NULL;
+	aggregator_cell_t* cell = NULL;
+	uint64_t id = pingtcp_reader_get_varint(_frame);
+	uint64_t port = pingtcp_reader_get_varint(_frame);
+	char* dst = pingtcp_reader_get_string(_frame);
+	uint64_t instance = pingtcp_reader_get_varint(_frame);
+	char* key = NULL;
+	size_t index = 0;
+
+	if (unlikely(_frame->error || id >= AGGREGATOR_IDS_MAX))
+	{
+		if (dst)
+			pfcq_free(dst);
+		return -1;
+	}
+	key = pfcq_mstring("%s:%lu", dst, port);
+	pfcq_free(dst);
+	/* Looked up first, since it may move the targets array */
+	index = __target_get(_aggregator, key);
+	target = &_aggregator->targets[index];
+	pfcq_free(key);
+
+	if (id >= _client->ids)
+	{
+		size_t ids = _client->ids ? _client->ids : 64;
+
+		while (ids <= id)
+			ids *= 2;
+		_client->by_id = _client->by_id ?
+			pfcq_realloc(_client->by_id, ids * sizeof(aggregator_cell_t*)) :
+			pfcq_alloc(ids * sizeof(aggregator_cell_t*));
+		pfcq_zero(_client->by_id + _client->ids, (ids - _client->ids) * sizeof(aggregator_cell_t*));
+		_client->ids = ids;
+	}
+
+	for (size_t i = 0; i < target->cells_count; i++)
+	{
+		if (target->cells[i]->vantage == (size_t)_client->vantage)
+		{
+			cell = target->cells[i];
+			break;
+		}
+	}
+
+	if (!cell)
+	{
+		cell = pfcq_alloc(sizeof(aggregator_cell_t));
+		cell->target = index;
+		cell->vantage = _client->vantage;
+		target->cells = target->cells ?
+			pfcq_realloc(target->cells, (target->cells_count + 1) * sizeof(aggregator_cell_t*)) :
+			pfcq_alloc(sizeof(aggregator_cell_t*));
+		target->cells[target->cells_count++] = cell;
+	}
+
+	/* Added again, or by a restarted agent, so its totals start from scratch */
+	if (cell->instance != instance)
+	{
+		cell->instance = instance;
+		pfcq_zero(cell->seen_counters, sizeof(cell->seen_counters));
+		pfcq_zero(cell->seen_histogram, sizeof(cell->seen_histogram));
+	}
+	_client->by_id[id] = cell;
+
+	return 0;
+}
+
+static int __frame_report(aggregator_t* _aggregator, aggregator_client_t* _client, pingtcp_reader_t* _frame)
+{
+	uint64_t id = 0;
+
+	while (_frame->offset < _frame->size)
+	{
+		aggregator_cell_t* cell = NULL;
+		aggregator_target_t* target = NULL;
+		uint64_t buckets = 0;
+		uint64_t bucket = 0;
+
+		id += pingtcp_reader_get_varint(_frame);
+		if (unlikely(_frame->error || id >= _client->ids || !_client->by_id[id]))
+			return -1;
+		cell = _client->by_id[id];
+		target = &_aggregator->targets[cell->target];
+
+		/* Totals already seen add nothing, so a report repeated after a reconnect is harmless */
+		for (int i = 0; i < PINGTCP_WIRE_COUNTERS; i++)
+		{
+			int64_t total = pingtcp_reader_get_varint(_frame);
+			int64_t delta = total - cell->seen_counters[i];
+
+			cell->seen_counters[i] = total;
+			cell->counters[i] += delta;
+			target->counters[i] += delta;
+		}
+
+		buckets = pingtcp_reader_get_varint(_frame);
+		for (uint64_t i = 0; i < buckets; i++)
+		{
+			uint64_t count = 0;
+
+			bucket += pingtcp_reader_get_varint(_frame);
+			count = pingtcp_reader_get_varint(_frame);
+			if (unlikely(_frame->error || bucket >= HISTOGRAM_BUCKETS))
+				return -1;
+			cell->histogram[bucket] += count - cell->seen_histogram[bucket];
+			target->histogram[bucket] += count - cell->seen_histogram[bucket];
+			cell->seen_histogram[bucket] = count;
+		}
+
+		if (unlikely(_frame->error))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int __client_frames(aggregator_t* _aggregator, aggregator_client_t* _client)
+{
+	pingtcp_reader_t stream;
+	pingtcp_reader_t frame;
+	int res = 0;
+
+	pingtcp_reader_init(&stream, _client->in.data, _client->in.used);
+	while ((res = pingtcp_reader_frame(&stream, &frame)) == 1)
+	{
+		uint8_t type = pingtcp_reader_get_u8(&frame);
+
+		/* Nothing but HELLO makes sense before HELLO */
+		if (_client->vantage == -1 && type != PINGTCP_WIRE_HELLO)
+			return -1;
+
+		switch (type)
+		{
+			case PINGTCP_WIRE_HELLO:
+				res = __frame_hello(_aggregator, _client, &frame);
+				break;
+			case PINGTCP_WIRE_TARGET:
+				res = __frame_target(_aggregator, _client, &frame);
+				break;
+			case PINGTCP_WIRE_REPORT:
+				res = __frame_report(_aggregator, _client, &frame);
+				break;
+			default:
+				res = -1;
+				break;
+		}
+		if (unlikely(res == -1))
+			return -1;
+		_client->frames++;
+	}
+	pingtcp_buffer_consume(&_client->in, stream.offset);
+
+	return res;
+}
+
+static void __client_close(aggregator_t* _aggregator, aggregator_client_t* _client)
+{
+	if (_client->vantage != -1)
+		inform("Agent %s disconnected\n", _aggregator->vantages[_client->vantage].name);
+	/* Closing the socket removes it from the epoll set as well */
+	if (unlikely(close(_client->fd) == -1))
+		panic("close");
+	pingtcp_buffer_done(&_client->in);
+	pingtcp_buffer_done(&_client->out);
+	if (_client->by_id)
+		pfcq_free(_client->by_id);
+	pfcq_free(_client);
+
+	return;
+}
+
+/*
+ * Frames taken in are acknowledged after every read, so that the agent may
+ * let go of what it has to keep until then. A newer count waits for the
+ * previous one to be written out, and one that does not get written now is
+ * tried again on the next read, since an ACK stands for every frame before it
+ */
+static void __client_ack(aggregator_client_t* _client)
+{
+	ssize_t res = 0;
+
+	if (_client->out.used == 0 && _client->frames > _client->acked)
+	{
+		size_t frame = pingtcp_buffer_frame_begin(&_client->out, PINGTCP_WIRE_ACK);
+
+		pingtcp_buffer_put_varint(&_client->out, _client->frames);
+		if (likely(pingtcp_buffer_frame_end(&_client->out, frame) == 0))
+			_client->acked = _client->frames;
+	}
+	if (_client->out.used == 0)
+		return;
+
+	res = send(_client->fd, _client->out.data, _client->out.used, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (res > 0)
+		pingtcp_buffer_consume(&_client->out, res);
+
+	return;
+}
+
+static void __client_read(aggregator_t* _aggregator, aggregator_client_t* _client)
+{
+	ssize_t res = 0;
+
+	for (;;)
+	{
+		if (_client->in.size - _client->in.used < AGGREGATOR_READ_CHUNK)
+		{
+			_client->in.size = _client->in.size ? _client->in.size * 2 : AGGREGATOR_READ_CHUNK * 2;
+			_client->in.data = _client->in.data ? pfcq_realloc(_client->in.data, _client->in.size) : pfcq_alloc(_client->in.size);
+		}
+
+		res = recv(_client->fd, _client->in.data + _client->in.used, _client->in.size - _client->in.used, MSG_DONTWAIT);
+		if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			break;
+		if (res <= 0)
+		{
+			__client_close(_aggregator, _client);
+			return;
+		}
+		_client->in.used += res;
+
+		if (unlikely(__client_frames(_aggregator, _client) == -1))
+		{
+			warning("Malformed stream from agent");
+			__client_close(_aggregator, _client);
+			return;
+		}
+	}
+
+	__client_ack(_client);
+
+	return;
+}
+
+static void __client_accept(aggregator_t* _aggregator)
+{
+	int fd = -1;
+	aggregator_client_t* client = NULL;
+	struct epoll_event event;
+
+	while ((fd = accept4(_aggregator->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+	{
+		client = pfcq_alloc(sizeof(aggregator_client_t));
+		client->fd = fd;
+		client->vantage = -1;
+		pingtcp_buffer_init(&client->in);
+		pingtcp_buffer_init(&client->out);
+
+		pfcq_zero(&event, sizeof(struct epoll_event));
+		event.events = EPOLLIN;
+		event.data.ptr = client;
+		if (unlikely(epoll_ctl(_aggregator->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1))
+			panic("epoll_ctl");
+	}
+
+	return;
+}
+
+static void __print_line(const char* _name, const int64_t* _counters, const uint64_t* _histogram)
+{
+	int64_t attempt = _counters[PINGTCP_WIRE_ATTEMPT];
+	int64_t completed = _counters[PINGTCP_WIRE_OK] + _counters[PINGTCP_WIRE_LATE];
+	int64_t rtt_count = _counters[PINGTCP_WIRE_RTT_COUNT];
+	double loss = 0;
+	double rtt_avg = 0;
+
+	loss = attempt > 0 ? (double)(_counters[PINGTCP_WIRE_FAIL] + _counters[PINGTCP_WIRE_LOST]) / (double)attempt * 100.0 : 0;
+	rtt_avg = rtt_count > 0 ? (double)_counters[PINGTCP_WIRE_RTT_SUM_US] / 1000.0 / (double)rtt_count : 0;
+
+	printf("%s: %ld handshake(s) started, %ld succeeded, %1.3lf%% loss, rtt avg = %1.3lf, p50/p90/p99 = %1.3lf/%1.3lf/%1.3lf ms\n",
+			_name, attempt, completed, loss, rtt_avg,
+			pingtcp_histogram_quantile(_histogram, 0.5, 0, DBL_MAX),
+			pingtcp_histogram_quantile(_histogram, 0.9, 0, DBL_MAX),
+			pingtcp_histogram_quantile(_histogram, 0.99, 0, DBL_MAX));
+
+	return;
+}
+
+static void __print_aggregate(const aggregator_t* _aggregator)
+{
+	printf("\n--- pingtcp aggregate of %lu target(s) from %lu vantage point(s) ---\n",
+			_aggregator->targets_count, _aggregator->vantages_count);
+
+	for (size_t i = 0; i < _aggregator->targets_count; i++)
+	{
+		const aggregator_target_t* target = &_aggregator->targets[i];
+
+		__print_line(target->key, target->counters, target->histogram);
+		for (size_t j = 0; j < target->cells_count; j++)
+		{
+			char* name = pfcq_mstring("\t%s", _aggregator->vantages[target->cells[j]->vantage].name);
+
+			__print_line(name, target->cells[j]->counters, target->cells[j]->histogram);
+			pfcq_free(name);
+		}
+	}
+	fflush(stdout);
+
+	return;
+}
+
+static void __listen(aggregator_t* _aggregator, const char* _address, const char* _port)
+{
+	struct addrinfo* server = NULL;
+	struct addrinfo hints;
+	struct epoll_event event;
+	int one = 1;
+	int res = 0;
+
+	pfcq_zero(&hints, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	res = getaddrinfo(_address, _port, &hints, &server);
+	if (unlikely(res))
+		stop(gai_strerror(res));
+
+	_aggregator->listen_fd = socket(server->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (unlikely(_aggregator->listen_fd == -1))
+		panic("socket");
+	if (unlikely(setsockopt(_aggregator->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1))
+		panic("setsockopt");
+	if (unlikely(bind(_aggregator->listen_fd, server->ai_addr, server->ai_addrlen) == -1))
+		panic("bind");
+	if (unlikely(listen(_aggregator->listen_fd, AGGREGATOR_BACKLOG) == -1))
+		panic("listen");
+	freeaddrinfo(server);
+
+	pfcq_zero(&event, sizeof(struct epoll_event));
+	event.events = EPOLLIN;
+	event.data.ptr = _aggregator;
+	if (unlikely(epoll_ctl(_aggregator->epoll_fd, EPOLL_CTL_ADD, _aggregator->listen_fd, &event) == -1))
+		panic("epoll_ctl");
+
+	return;
+}
+
+int main(int argc, char** argv)
+{
+	int arg_index = 2;
+	int stopped = 0;
+	char* address = NULL;
+	uint64_t report_ms = REPORT_DEFAULT_MS;
+	int64_t next_ns = 0;
+	aggregator_t aggregator;
+	sigset_t stop_mask;
+	struct epoll_event event;
+	struct epoll_event events[AGGREGATOR_MAXEVENTS];
+	struct signalfd_siginfo signal_info;
+
+	if (argc < 2 || !pfcq_isnumber(argv[1]))
+		__usage(argv[0]);
+
+	while (arg_index < argc)
+	{
+		if (strcmp(argv[arg_index], "--bind") == 0 ||
+			strcmp(argv[arg_index], "-b") == 0)
+		{
+			if (arg_index < argc - 1)
+			{
+				address = argv[arg_index + 1];
+				arg_index += 2;
+				continue;
+			} else
+				__usage(argv[0]);
+		}
+
+		if (strcmp(argv[arg_index], "--report") == 0 ||
+			strcmp(argv[arg_index], "-r") == 0)
+		{
+			if (arg_index < argc - 1 && pfcq_isnumber(argv[arg_index + 1]))
+			{
+				report_ms = strtoul(argv[arg_index + 1], NULL, 10);
+				if (unlikely(report_ms == 0))
+					stop("Wrong report interval specified");
+				arg_index += 2;
+				continue;
+			} else
+				__usage(argv[0]);
+		}
+
+		__usage(argv[0]);
+	}
+
+	pfcq_zero(&aggregator, sizeof(aggregator_t));
+
+	if (unlikely(sigemptyset(&stop_mask) != 0))
+		panic("sigemptyset");
+	if (unlikely(sigaddset(&stop_mask, SIGTERM) != 0))
+		panic("sigaddset");
+	if (unlikely(sigaddset(&stop_mask, SIGINT) != 0))
+		panic("sigaddset");
+	if (unlikely(pthread_sigmask(SIG_BLOCK, &stop_mask, NULL) != 0))
+		panic("pthread_sigmask");
+
+	aggregator.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (unlikely(aggregator.epoll_fd == -1))
+		panic("epoll_create1");
+
+	aggregator.signal_fd = signalfd(-1, &stop_mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (unlikely(aggregator.signal_fd == -1))
+		panic("signalfd");
+	pfcq_zero(&event, sizeof(struct epoll_event));
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (unlikely(epoll_ctl(aggregator.epoll_fd, EPOLL_CTL_ADD, aggregator.signal_fd, &event) == -1))
+		panic("epoll_ctl");
+
+	__listen(&aggregator, address, argv[1]);
+
+	next_ns = pingtcp_now_ns() + (int64_t)report_ms * 1000000LL;
+	while (!stopped)
+	{
+		int64_t now_ns = pingtcp_now_ns();
+		int events_count = 0;
+
+		if (now_ns >= next_ns)
+		{
+			__print_aggregate(&aggregator);
+			next_ns = now_ns + (int64_t)report_ms * 1000000LL;
+		}
+
+		events_count = epoll_wait(aggregator.epoll_fd, events, AGGREGATOR_MAXEVENTS, (int)((next_ns - now_ns + 999999) / 1000000));
+		if (unlikely(events_count == -1))
+		{
+			if (likely(errno == EINTR))
+				continue;
+			else
+				panic("epoll_wait");
+		}
+
+		for (int i = 0; i < events_count; i++)
+		{
+			if (!events[i].data.ptr)
+			{
+				while (read(aggregator.signal_fd, &signal_info, sizeof(struct signalfd_siginfo)) == sizeof(struct signalfd_siginfo))
+					continue;
+				stopped = 1;
+			} else if (events[i].data.ptr == &aggregator)
+				__client_accept(&aggregator);
+			else
+				__client_read(&aggregator, events[i].data.ptr);
+		}
+	}
+
+	__print_aggregate(&aggregator);
+
+	exit(EX_OK);
+}
+
@@ -0,0 +1,121 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <libgen.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "contrib/pfcq/pfcq.h"
+#include "shm.h"
+
+static void __usage(char* _argv0)
+{
+	inform("Usage: %s <name> [-w interval]\n", basename(_argv0));
+	exit(EX_USAGE);
+}
+
+static void __print_record(const pingtcp_shm_record_t* _record)
+{
+	const pingtcp_stats_t* stats = &_record->stats;
+	double loss = 0;
+	double rtt_min = 0;
+	double rtt_avg = 0;
+	double rtt_max = 0;
+	double rtt_mdev = 0;
+
+	loss = stats->attempt > 0 ? (double)(stats->fail + stats->lost) / (double)stats->attempt * 100.0 : 0;
+	if (stats->rtt_count > 0)
+	{
+		rtt_min = stats->rtt_min;
+		rtt_max = stats->rtt_max;
+		rtt_avg = stats->rtt_sum / stats->rtt_count;
+		rtt_mdev = sqrt(stats->rtt_sum_sqr / stats->rtt_count - pow(rtt_avg, 2.0));
+	}
+
+	printf("%s:%d (%s): attempt=%lu ok=%lu fail=%lu late=%lu lost=%lu loss=%1.3lf%% "
+			"rtt min/avg/max/mdev = %1.3lf/%1.3lf/%1.3lf/%1.3lf p50/p90/p99 = %1.3lf/%1.3lf/%1.3lf ms\n",
+			_record->dst, _record->port, _record->host.host6,
+			stats->attempt, stats->ok, stats->fail, stats->late, stats->lost, loss,
+			rtt_min, rtt_avg, rtt_max, rtt_mdev,
+			pingtcp_histogram_quantile(stats->rtt_histogram, 0.5, rtt_min, rtt_max),
+			pingtcp_histogram_quantile(stats->rtt_histogram, 0.9, rtt_min, rtt_max),
+			pingtcp_histogram_quantile(stats->rtt_histogram, 0.99, rtt_min, rtt_max));
+
+	return;
+}
+
+int main(int argc, char** argv)
+{
+	int arg_index = 2;
+	uint64_t interval_ms = 0;
+	size_t count = 0;
+	pingtcp_shm_t shm;
+	pingtcp_shm_record_t record;
+
+	if (argc < 2 || argv[1][0] == '-')
+		__usage(argv[0]);
+
+	while (arg_index < argc)
+	{
+		if (strcmp(argv[arg_index], "--watch") == 0 ||
+			strcmp(argv[arg_index], "-w") == 0)
+		{
+			if (arg_index < argc - 1 && pfcq_isnumber(argv[arg_index + 1]))
+			{
+				interval_ms = strtoul(argv[arg_index + 1], NULL, 10);
+				arg_index += 2;
+				continue;
+			} else
+				__usage(argv[0]);
+		}
+
+		__usage(argv[0]);
+	}
+
+	if (pingtcp_shm_open(&shm, argv[1]) == -1)
+		stop("Unable to open statistics segment, or its layout version differs");
+
+	for (;;)
+	{
+		/* Plain memory reads, so the probing process is never disturbed */
+		count = pingtcp_shm_count(&shm);
+		for (size_t i = 0; i < count; i++)
+		{
+			pingtcp_shm_read(&shm, i, &record);
+			if (record.dst[0] != '\0')
+				__print_record(&record);
+		}
+
+		if (interval_ms == 0 || !__atomic_load_n(&shm.header->running, __ATOMIC_ACQUIRE))
+			break;
+		if (unlikely(usleep(interval_ms * 1000) == -1))
+			break;
+		printf("\n");
+	}
+
+	pingtcp_shm_close(&shm);
+
+	exit(EX_OK);
+}
+
@@ -29,17 +29,29 @@
 #include <math.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sysexits.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "contrib/pfcq/pfcq.h"
+#include "agent.h"
+#include "capture.h"
+#include "compare.h"
+#include "engine.h"
+#include "inventory.h"
+#include "precision.h"
+#include "shm.h"
+#include "sniffer.h"
+#include "tls.h"
 
 #define APP_VERSION		"0.0.4"
 #define APP_YEAR		"2015–2016"
@@ -47,11 +59,30 @@
 #define APP_PROGRAMMER	"Oleksandr Natalenko"
 #define APP_EMAIL		"o.natalenko@lanet.ua"
 
-#define FQDN_MAX_LENGTH	254
+#define REPORT_DEFAULT_MS	1000
+#define FLUSH_TIMEOUT_MS	1000
+#define WINDOW_DEFAULT		256
+#define PASSIVE_POLL_MS		100
+
+/* Handshake times collected per target for the comparison, ahead of the usual output */
+typedef struct pingtcp_comparison
+{
+	pingtcp_result_handler_t print;
+	pingtcp_samples_t* samples;
+} pingtcp_comparison_t;
+
+/* One <host> <ports> argument pair, its targets taking consecutive slots */
+typedef struct pingtcp_group
+{
+	char* dst;
+	size_t ports_count;
+	int* ports;
+	size_t first;
+} pingtcp_group_t;
 
 static void __usage(char* _argv0)
 {
-	inform("Usage: %s <host> <port> [-c attempts] [-i interval] [-t timeout] [--tor | -6]\n", basename(_argv0));
+	inform("Usage: %s <host> <ports> [<host> <ports> ...] [-c attempts] [-i interval] [-t timeout] [-w window] [-q] [--compare] [-a [--rto-min ms]] [--syn-retries n] [--cpu n] [--rt priority] [--busy-poll us] [--shm name] [--agent host:port [--agent-name name] [--report ms]] [--tls [--tls-name name]] [--tor | -6]\n       %s --targets <file> [options as above, but --compare]\n       %s --read <file> [-t timeout]\n       %s --passive <interface | any> [-t timeout]\n", basename(_argv0), basename(_argv0), basename(_argv0), basename(_argv0));
 	exit(EX_USAGE);
 }
 
@@ -63,72 +94,538 @@ static void __version(void)
 	exit(EX_USAGE);
 }
 
+/* Goes through the log writer, so that a slow terminal or pipe never holds up the loop */
+static void __print_result(pingtcp_engine_t* _engine, const pingtcp_result_t* _result, void* _data)
+{
+	const char* name = pingtcp_target_name(_engine, _result->target);
+	const char* host = pingtcp_target_host(_engine, _result->target);
+	int port = _engine->targets.port[_result->target];
+
+	char retrans[32];
+
+	/* The TCP handshake has completed, so the line is about the TLS one */
+	if (_result->tls)
+	{
+		retrans[0] = '\0';
+		if (_result->syn_retrans > 0)
+			snprintf(retrans, sizeof(retrans), " retrans=%u", _result->syn_retrans);
+		if (likely(!_result->tls_failed))
+			pfcq_log(STDOUT_FILENO, "Handshaked with %s:%d (%s): attempt=%lu time=%1.3lf ms tls=%1.3lf ms (%s) total=%1.3lf ms%s\n",
+					name, port, host, _result->attempt, _result->time_ms, _result->tls_ms,
+					_result->tls_resumed ? "resumed" : "full", _result->total_ms, retrans);
+		else
+			pfcq_log(STDOUT_FILENO, "Unable to secure with %s:%d (%s): attempt=%lu time=%1.3lf ms reason=%s tls=%1.3lf ms%s\n",
+					name, port, host, _result->attempt, _result->time_ms,
+					_result->tls_timed_out ? "timeout" : pingtcp_tls_reason(_result->tls_error), _result->tls_ms, retrans);
+		return;
+	}
+
+	if (likely(_result->failure == PINGTCP_FAILURE_NONE && _result->syn_retrans == 0))
+		pfcq_log(STDOUT_FILENO, "%s with %s:%d (%s): attempt=%lu time=%1.3lf ms\n",
+				_result->late ? "Late handshake" : "Handshaked", name, port, host, _result->attempt, _result->time_ms);
+	else if (_result->failure == PINGTCP_FAILURE_NONE)
+		pfcq_log(STDOUT_FILENO, "%s with %s:%d (%s): attempt=%lu time=%1.3lf ms retrans=%u\n",
+				_result->late ? "Late handshake" : "Handshaked", name, port, host, _result->attempt, _result->time_ms, _result->syn_retrans);
+	else if (_result->icmp)
+		pfcq_log(STDOUT_FILENO, "Unable to handshake with %s:%d (%s): attempt=%lu reason=%s (ICMP type %u code %u from %s) time=%1.3lf ms\n",
+				name, port, host, _result->attempt, pingtcp_failure_name(_result->failure),
+				_result->icmp_type, _result->icmp_code, _result->icmp_offender.host6, _result->time_ms);
+	else if (_result->failure == PINGTCP_FAILURE_TIMEOUT)
+		pfcq_log(STDOUT_FILENO, "Unable to handshake with %s:%d (%s): attempt=%lu reason=timeout time=%1.3lf ms retrans=%u\n",
+				name, port, host, _result->attempt, _result->time_ms, _result->syn_retrans);
+	else
+		pfcq_log(STDOUT_FILENO, "Unable to handshake with %s:%d (%s): attempt=%lu reason=%s (%s) time=%1.3lf ms\n",
+				name, port, host, _result->attempt, pingtcp_failure_name(_result->failure), strerror(_result->error), _result->time_ms);
+
+	return;
+}
+
+/* Retransmitted handshakes are left out, as they are from rtt */
+static void __record_result(pingtcp_engine_t* _engine, const pingtcp_result_t* _result, void* _data)
+{
+	pingtcp_comparison_t* comparison = _data;
+
+	if (_result->failure == PINGTCP_FAILURE_NONE && _result->syn_retrans == 0)
+		pingtcp_samples_add(&comparison->samples[_result->target], _result->time_ms);
+	if (comparison->print)
+		comparison->print(_engine, _result, NULL);
+
+	return;
+}
+
+/* The RTO estimate is only shown in adaptive mode, so it may be NULL */
+static void __print_stats(const char* _dst, int _port, const pingtcp_stats_t* _stats, const pingtcp_rto_t* _rto, double _wall_time_ms)
+{
+	uint64_t completed = _stats->ok + _stats->late;
+	double loss = 0;
+	double rtt_min = _stats->rtt_min;
+	double rtt_avg = 0;
+	double rtt_max = _stats->rtt_max;
+	double rtt_mdev = 0;
+
+	printf("\n--- %s:%d pingtcp statistics ---\n", _dst, _port);
+	loss = _stats->attempt > 0 ? (double)(_stats->fail + _stats->lost) / (double)_stats->attempt * 100.0 : 0;
+	if (_stats->rtt_count > 0)
+	{
+		rtt_avg = _stats->rtt_sum / _stats->rtt_count;
+		rtt_mdev = sqrt(_stats->rtt_sum_sqr / _stats->rtt_count - pow(rtt_avg, 2.0));
+	} else
+	{
+		rtt_min = 0;
+		rtt_max = 0;
+	}
+	printf("%lu handshake(s) started, %lu succeeded, %1.3lf%% loss, time %1.3lf ms\n", _stats->attempt, completed, loss, _wall_time_ms);
+	printf("rtt min/avg/max/mdev = %1.3lf/%1.3lf/%1.3lf/%1.3lf\n", rtt_min, rtt_avg, rtt_max, rtt_mdev);
+	if (_stats->rtt_count > 0)
+		printf("rtt p50/p90/p99 = %1.3lf/%1.3lf/%1.3lf\n",
+				pingtcp_histogram_quantile(_stats->rtt_histogram, 0.5, rtt_min, rtt_max),
+				pingtcp_histogram_quantile(_stats->rtt_histogram, 0.9, rtt_min, rtt_max),
+				pingtcp_histogram_quantile(_stats->rtt_histogram, 0.99, rtt_min, rtt_max));
+	if (_rto)
+		printf("late/lost = %lu/%lu, srtt/rttvar/rto = %1.3lf/%1.3lf/%1.3lf ms\n",
+				_stats->late, _stats->lost, _rto->srtt, _rto->rttvar, _rto->rto);
+	if (_stats->syn_sent > 0)
+		printf("%lu SYN(s) sent, %lu lost, %1.3lf%% SYN loss, %lu handshake(s) retransmitted and left out of rtt\n",
+				_stats->syn_sent, _stats->syn_lost, (double)_stats->syn_lost / (double)_stats->syn_sent * 100.0, _stats->retransmitted);
+	for (int i = 0; i < PINGTCP_FAILURES; i++)
+	{
+		const pingtcp_failures_t* failures = &_stats->failures[i];
+
+		if (failures->count == 0)
+			continue;
+		if (i == PINGTCP_FAILURE_TIMEOUT)
+			printf("%s = %lu, time to fail avg = %1.3lf ms\n",
+					pingtcp_failure_name(i), failures->count, failures->time_sum / failures->count);
+		else
+			printf("%s = %lu, time to fail min/avg/max = %1.3lf/%1.3lf/%1.3lf ms\n",
+					pingtcp_failure_name(i), failures->count,
+					failures->time_min, failures->time_sum / failures->count, failures->time_max);
+	}
+
+	return;
+}
+
+static void __print_series(const char* _name, const pingtcp_series_t* _series)
+{
+	double avg = 0;
+
+	if (_series->count == 0)
+		return;
+
+	avg = _series->sum / _series->count;
+	printf("%s min/avg/max/mdev = %1.3lf/%1.3lf/%1.3lf/%1.3lf, p50/p90/p99 = %1.3lf/%1.3lf/%1.3lf\n",
+			_name, _series->min, avg, _series->max, sqrt(_series->sum_sqr / _series->count - pow(avg, 2.0)),
+			pingtcp_histogram_quantile(_series->histogram, 0.5, _series->min, _series->max),
+			pingtcp_histogram_quantile(_series->histogram, 0.9, _series->min, _series->max),
+			pingtcp_histogram_quantile(_series->histogram, 0.99, _series->min, _series->max));
+
+	return;
+}
+
+/* Follows the TCP statistics of the same target */
+static void __print_tls_stats(const pingtcp_tls_stats_t* _stats)
+{
+	if (_stats->attempt == 0)
+		return;
+
+	printf("%lu TLS handshake(s), %lu failed, %lu timed out, %lu resumption(s) offered, %lu accepted\n",
+			_stats->attempt, _stats->failed, _stats->timed_out, _stats->offered, _stats->tls[PINGTCP_TLS_RESUMED].count);
+	__print_series("full tls", &_stats->tls[PINGTCP_TLS_FULL]);
+	__print_series("full total", &_stats->total[PINGTCP_TLS_FULL]);
+	__print_series("resumed tls", &_stats->tls[PINGTCP_TLS_RESUMED]);
+	__print_series("resumed total", &_stats->total[PINGTCP_TLS_RESUMED]);
+
+	return;
+}
+
+/* Sweeps get one row per port instead of a block per target */
+static void __print_ports(const pingtcp_engine_t* _engine, size_t _first, size_t _count, double _wall_time_ms)
+{
+	size_t open = 0;
+
+	printf("\n--- %s (%s) pingtcp statistics for %lu port(s) ---\n",
+			_engine->targets.dst[_first], pingtcp_target_host(_engine, _first), _count);
+	printf("%5s %9s %9s %8s %9s %9s %9s %9s %9s", "port", "started", "succeeded", "loss%", "min", "avg", "max", "p50", "p99");
+	for (int i = 0; i < PINGTCP_FAILURES; i++)
+		printf(" %11s", pingtcp_failure_name(i));
+	printf("\n");
+
+	for (size_t i = _first; i < _first + _count; i++)
+	{
+		const pingtcp_stats_t* stats = &_engine->targets.stats[i];
+		uint64_t completed = stats->ok + stats->late;
+		double loss = stats->attempt > 0 ? (double)(stats->fail + stats->lost) / (double)stats->attempt * 100.0 : 0;
+		double rtt_min = 0;
+		double rtt_avg = 0;
+		double rtt_max = 0;
+
+		if (stats->rtt_count > 0)
+		{
+			rtt_min = stats->rtt_min;
+			rtt_avg = stats->rtt_sum / stats->rtt_count;
+			rtt_max = stats->rtt_max;
+		}
+		if (completed > 0)
+			open++;
+
+		printf("%5d %9lu %9lu %8.3lf %9.3lf %9.3lf %9.3lf %9.3lf %9.3lf",
+				_engine->targets.port[i], stats->attempt, completed, loss, rtt_min, rtt_avg, rtt_max,
+				pingtcp_histogram_quantile(stats->rtt_histogram, 0.5, rtt_min, rtt_max),
+				pingtcp_histogram_quantile(stats->rtt_histogram, 0.99, rtt_min, rtt_max));
+		for (int j = 0; j < PINGTCP_FAILURES; j++)
+			printf(" %11lu", stats->failures[j].count);
+		printf("\n");
+	}
+
+	printf("%lu of %lu port(s) open, time %1.3lf ms\n", open, _count, _wall_time_ms);
+
+	return;
+}
+
+/* Every other target is set against the first one */
+static void __print_comparison(pingtcp_engine_t* _engine, const pingtcp_samples_t* _samples)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99 };
+	pingtcp_delta_t deltas[sizeof(quantiles) / sizeof(quantiles[0])];
+	pingtcp_rank_test_t test;
+
+	printf("\n--- %s:%d as A, %lu sample(s), pingtcp comparison ---\n",
+			_engine->targets.dst[0], _engine->targets.port[0], _samples[0].count);
+
+	for (size_t i = 1; i < _engine->targets.count; i++)
+	{
+		printf("%s:%d as B, %lu sample(s)\n", _engine->targets.dst[i], _engine->targets.port[i], _samples[i].count);
+		if (_samples[0].count < 2 || _samples[i].count < 2)
+		{
+			printf("%s\n", "not enough samples to compare");
+			continue;
+		}
+
+		pingtcp_compare_deltas(&_samples[0], &_samples[i], quantiles, sizeof(quantiles) / sizeof(quantiles[0]),
+				COMPARE_RESAMPLES, &_engine->prng, deltas);
+		for (size_t j = 0; j < sizeof(quantiles) / sizeof(quantiles[0]); j++)
+			printf("p%g B-A = %1.3lf-%1.3lf = %+1.3lf ms, %g%% CI [%+1.3lf, %+1.3lf]\n",
+					deltas[j].quantile * 100.0, deltas[j].b, deltas[j].a, deltas[j].delta,
+					COMPARE_CONFIDENCE * 100.0, deltas[j].lower, deltas[j].upper);
+
+		pingtcp_compare_rank_test(&_samples[0], &_samples[i], &test);
+		printf("Mann-Whitney U = %1.1lf, z = %1.3lf, p = %1.4lf, P(B > A) = %1.3lf, %s at %g%%\n",
+				test.u, test.z, test.p, test.superiority,
+				test.p < COMPARE_ALPHA ? "significant" : "not significant", COMPARE_ALPHA * 100.0);
+	}
+
+	return;
+}
+
+/*
+ * Handshakes found in a capture get the same statistics as probes,
+ * one block per server address and port, timed over the capture span
+ */
+static void __read_capture(const char* _path, int64_t _timeout_ns)
+{
+	pingtcp_passive_t passive;
+	double span_ms = 0;
+	int res = 0;
+
+	pingtcp_passive_init(&passive, _timeout_ns);
+	res = pingtcp_capture_read(_path, &passive);
+	if (unlikely(res))
+		stop(pfcq_mstring("Unable to read %s: %s", _path, res == EINVAL ? "not a pcap or pcapng file" : strerror(res)));
+	pingtcp_passive_finish(&passive);
+
+	if (passive.packets > 0)
+		span_ms = (double)(passive.last_ns - passive.first_ns) / 1000000.0;
+	printf("READ %s: %lu IP packet(s), %lu destination(s), %lu handshake(s) cut off by the end of the capture\n",
+			_path, passive.packets, passive.count, passive.undecided);
+	for (size_t i = 0; i < passive.count; i++)
+		__print_stats(passive.destinations[i].host, passive.destinations[i].port, &passive.stats[i], NULL, span_ms);
+
+	pingtcp_passive_done(&passive);
+
+	return;
+}
+
+/*
+ * Watches handshakes of whatever runs on this host until stopped. Only SYNs,
+ * SYN-ACKs and RSTs get through the filter, so handshakes end at the SYN-ACK,
+ * which is when connect() returns to a local client. Handshakes with local
+ * servers are left out, since their SYN-ACK leaves without a round trip
+ */
+static void __run_passive(const char* _interface, int64_t _timeout_ns, const sigset_t* _stop_mask)
+{
+	pingtcp_sniffer_t sniffer;
+	pingtcp_passive_t passive;
+	struct pollfd fds[2];
+	struct timespec wall_time_start;
+	struct timespec wall_time_end;
+	struct timespec now;
+	int64_t now_ns = 0;
+	double wall_time_ms = 0;
+	int res = 0;
+
+	res = pingtcp_sniffer_open(&sniffer, strcmp(_interface, "any") == 0 ? NULL : _interface);
+	if (unlikely(res))
+		stop(pfcq_mstring("Unable to capture on %s: %s", _interface, strerror(res)));
+	pingtcp_passive_init(&passive, _timeout_ns);
+	passive.synack_completes = 1;
+
+	pfcq_zero(fds, sizeof(fds));
+	fds[0].fd = sniffer.fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = signalfd(-1, _stop_mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (unlikely(fds[1].fd == -1))
+		panic("signalfd");
+	fds[1].events = POLLIN;
+
+	printf("PASSIVE %s\n", _interface);
+	fflush(stdout);
+
+	if (unlikely(clock_gettime(CLOCK_MONOTONIC, &wall_time_start) == -1))
+		panic("clock_gettime");
+
+	for (;;)
+	{
+		if (unlikely(poll(fds, 2, PASSIVE_POLL_MS) == -1 && errno != EINTR))
+			panic("poll");
+		if (fds[1].revents & POLLIN)
+			break;
+		pingtcp_sniffer_read(&sniffer, &passive);
+
+		/* Packets carry the real time, so handshakes also time out on it while it is quiet */
+		if (unlikely(clock_gettime(CLOCK_REALTIME, &now) == -1))
+			panic("clock_gettime");
+		now_ns = (int64_t)__pfcq_timespec_to_ns(now);
+		if (now_ns - passive.swept_ns >= _timeout_ns)
+			pingtcp_passive_expire(&passive, now_ns);
+	}
+
+	pingtcp_sniffer_read(&sniffer, &passive);
+	pingtcp_sniffer_stats(&sniffer);
+	if (unlikely(clock_gettime(CLOCK_REALTIME, &now) == -1))
+		panic("clock_gettime");
+	pingtcp_passive_expire(&passive, (int64_t)__pfcq_timespec_to_ns(now));
+	pingtcp_passive_finish(&passive);
+
+	if (unlikely(clock_gettime(CLOCK_MONOTONIC, &wall_time_end) == -1))
+		panic("clock_gettime");
+	wall_time_ms = (double)__pfcq_timespec_diff_ns(wall_time_start, wall_time_end) / 1000000.0;
+
+	printf("PASSIVE %s: %lu packet(s), %lu dropped by the kernel, %lu destination(s), %lu handshake(s) in progress left out\n",
+			_interface, sniffer.packets, sniffer.drops, passive.count, passive.undecided);
+	for (size_t i = 0; i < passive.count; i++)
+		__print_stats(passive.destinations[i].host, passive.destinations[i].port, &passive.stats[i], NULL, wall_time_ms);
+
+	if (unlikely(close(fds[1].fd) == -1))
+		panic("close");
+	pingtcp_sniffer_close(&sniffer);
+	pingtcp_passive_done(&passive);
+
+	return;
+}
+
+/*
+ * Same as pingtcp_engine_run(), but with the loop stepped here
+ * to stream totals to the aggregator every report period, and
+ * woken up every AGENT_PUMP_MS while a report is being written out
+ */
+static void __run_agent(pingtcp_engine_t* _engine, pingtcp_agent_t* _agent, int64_t _report_ns, const sigset_t* _stop_mask)
+{
+	int64_t now_ns = 0;
+	int64_t next_ns = 0;
+	int timeout_ms = 0;
+
+	pingtcp_engine_start(_engine, _stop_mask);
+	next_ns = pingtcp_now_ns() + _report_ns;
+
+	for (;;)
+	{
+		now_ns = pingtcp_now_ns();
+		if (now_ns >= next_ns)
+		{
+			pingtcp_agent_report(_agent);
+			next_ns += _report_ns;
+			if (next_ns <= now_ns)
+				next_ns = now_ns + _report_ns;
+		}
+		timeout_ms = (int)((next_ns - now_ns + 999999) / 1000000);
+		if (pingtcp_agent_pending(_agent))
+		{
+			pingtcp_agent_pump(_agent);
+			if (timeout_ms > AGENT_PUMP_MS)
+				timeout_ms = AGENT_PUMP_MS;
+		}
+		if (pingtcp_engine_step(_engine, timeout_ms) == 0)
+			break;
+	}
+
+	pingtcp_agent_report(_agent);
+	pingtcp_agent_flush(_agent, FLUSH_TIMEOUT_MS);
+	pingtcp_engine_finish(_engine);
+
+	return;
+}
+
+/*
+ * Targets come from a file, reloaded on SIGHUP or whenever it is written,
+ * and the changes are made a batch per iteration, so that probing goes on meanwhile.
+ * Stop signals are taken here as well instead of by the engine, since it
+ * is not waited on while it has no targets
+ */
+static void __run_inventory(pingtcp_engine_t* _engine, pingtcp_inventory_t* _inventory, pingtcp_agent_t* _agent, int64_t _report_ns, const sigset_t* _signal_mask)
+{
+	int64_t now_ns = 0;
+	int64_t next_ns = WHEEL_NEVER;
+	int signal_fd = -1;
+	int timeout_ms = 0;
+	int reload = 0;
+	int reloading = 0;
+	struct pollfd fds[3];
+	struct signalfd_siginfo signal_info;
+
+	signal_fd = signalfd(-1, _signal_mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (unlikely(signal_fd == -1))
+		panic("signalfd");
+
+	pingtcp_engine_start(_engine, NULL);
+	if (_agent)
+		next_ns = pingtcp_now_ns() + _report_ns;
+
+	pfcq_zero(fds, sizeof(fds));
+	fds[0].fd = pingtcp_engine_fd(_engine);
+	fds[0].events = POLLIN;
+	fds[1].fd = signal_fd;
+	fds[1].events = POLLIN;
+	fds[2].fd = pingtcp_inventory_fd(_inventory);
+	fds[2].events = POLLIN;
+
+	for (;;)
+	{
+		now_ns = pingtcp_now_ns();
+		if (_agent && now_ns >= next_ns)
+		{
+			pingtcp_agent_report(_agent);
+			next_ns += _report_ns;
+			if (next_ns <= now_ns)
+				next_ns = now_ns + _report_ns;
+		}
+
+		timeout_ms = pingtcp_engine_timeout(_engine);
+		if (pingtcp_inventory_pending(_inventory) > 0)
+			timeout_ms = 0;
+		else if (next_ns != WHEEL_NEVER && (timeout_ms < 0 || (next_ns - now_ns + 999999) / 1000000 < timeout_ms))
+			timeout_ms = (int)((next_ns - now_ns + 999999) / 1000000);
+		if (_agent && pingtcp_agent_pending(_agent))
+		{
+			pingtcp_agent_pump(_agent);
+			if (timeout_ms < 0 || timeout_ms > AGENT_PUMP_MS)
+				timeout_ms = AGENT_PUMP_MS;
+		}
+
+		if (unlikely(poll(fds, 3, timeout_ms) == -1))
+		{
+			if (likely(errno == EINTR))
+				continue;
+			else
+				panic("poll");
+		}
+
+		if (fds[1].revents & POLLIN)
+		{
+			while (read(signal_fd, &signal_info, sizeof(struct signalfd_siginfo)) == sizeof(struct signalfd_siginfo))
+			{
+				if (signal_info.ssi_signo == SIGHUP)
+					reload = 1;
+				else
+					pingtcp_engine_stop(_engine);
+			}
+			if (_engine->stopped)
+				break;
+		}
+
+		if ((fds[2].revents & POLLIN) && pingtcp_inventory_changed(_inventory))
+			reload = 1;
+
+		if (reload)
+		{
+			int res = pingtcp_inventory_reload(_inventory);
+
+			reload = 0;
+			if (likely(res == 0))
+				reloading = 1;
+			else
+				pfcq_log(STDOUT_FILENO, "Unable to reload targets from %s: %s\n", _inventory->path, strerror(res));
+		}
+
+		if (reloading && pingtcp_inventory_apply(_inventory, INVENTORY_BATCH) == 0)
+		{
+			pfcq_log(STDOUT_FILENO, "Reloaded targets from %s: %lu added, %lu removed, %lu kept, %lu unresolved, %lu malformed line(s)\n",
+					_inventory->path, _inventory->added, _inventory->removed, _inventory->kept, _inventory->unresolved, _inventory->malformed);
+			reloading = 0;
+		}
+
+		if (unlikely(_engine->shm_error != 0))
+		{
+			pfcq_log(STDOUT_FILENO, "Unable to grow statistics segment: %s, new targets are not published\n", strerror(_engine->shm_error));
+			_engine->shm_error = 0;
+		}
+
+		pingtcp_engine_step(_engine, 0);
+
+		/* With an attempt limit, it is over once every target has used it up */
+		if (_engine->stopped || (_engine->limit != 0 && _engine->active == 0 && _engine->probes.used == 0 && !reloading))
+			break;
+	}
+
+	if (_agent)
+	{
+		pingtcp_agent_report(_agent);
+		pingtcp_agent_flush(_agent, FLUSH_TIMEOUT_MS);
+	}
+	pingtcp_engine_finish(_engine);
+	if (unlikely(close(signal_fd) == -1))
+		panic("close");
+
+	return;
+}
+
 int main(int argc, char** argv)
 {
-	int (*socket)(int, int, int);
-	int (*getaddrinfo)(const char*, const char*, const struct addrinfo*, struct addrinfo**);
-	void (*freeaddrinfo)(struct addrinfo*);
-	const char* (*inet_ntop)(int, const void*, char*, socklen_t);
-	int (*getnameinfo)(const struct sockaddr*, socklen_t, char*, socklen_t, char*, socklen_t, int);
-	int (*connect)(int, const struct sockaddr*, socklen_t);
-	int (*close)(int);
-
-	*(void**)(&socket) = dlsym(NULL, "socket");
-	*(void**)(&getaddrinfo) = dlsym(NULL, "getaddrinfo");
-	*(void**)(&freeaddrinfo) = dlsym(NULL, "freeaddrinfo");
-	*(void**)(&inet_ntop) = dlsym(NULL, "inet_ntop");
-	*(void**)(&getnameinfo) = dlsym(NULL, "getnameinfo");
-	*(void**)(&connect) = dlsym(NULL, "connect");
-	*(void**)(&close) = dlsym(NULL, "close");
-
-	int socket_fd = -1;
-	int port = -1;
-	int res;
 	int arg_index = 1;
-	int proto = PF_INET;
-	uint64_t attempt = 0;
-	uint64_t ok = 0;
-	uint64_t fail = 0;
-	uint64_t limit = 0;
-	unsigned short int current_ptr = 0;
-	time_t time_to_ping = 0;
+	int cpu = -1;
+	int rt_priority = 0;
+	int busy_poll_us = 0;
+	int compare = 0;
 	time_t wall_time = 0;
-	double time_to_ping_ms = 0;
 	double wall_time_ms = 0;
-	double loss = 0;
-	double rtt_min = DBL_MAX;
-	double rtt_avg = 0;
-	double rtt_max = DBL_MIN;
-	double rtt_sum = 0;
-	double rtt_sum_sqr = 0;
-	double rtt_mdev = 0;
+	size_t groups_count = 0;
 	char* dst = NULL;
-	char ptr[FQDN_MAX_LENGTH];
-	pfcq_net_address_t address;
-	pfcq_net_host_t host;
-	struct addrinfo* server = NULL;
-	struct addrinfo hints;
-	struct timespec time_to_sleep;
-	struct timespec ping_time_start;
-	struct timespec ping_time_end;
+	char* shm_name = NULL;
+	char* agent_address = NULL;
+	char* agent_name = NULL;
+	char* read_path = NULL;
+	char* passive_interface = NULL;
+	char* targets_path = NULL;
+	char* tls_name = NULL;
+	int tls_mode = 0;
+	uint64_t report_ms = REPORT_DEFAULT_MS;
+	char hostname[AGENT_NAME_MAX];
+	pingtcp_jitter_t jitter;
+	pingtcp_comparison_t comparison;
+	pingtcp_group_t* groups = NULL;
+	pingtcp_engine_t* engine = NULL;
+	pingtcp_shm_t shm;
+	pingtcp_agent_t agent;
+	pingtcp_inventory_t inventory;
+	pingtcp_tls_t tls;
 	struct timespec wall_time_start;
 	struct timespec wall_time_end;
-	struct timeval timeout;
 	sigset_t pingtcp_newmask;
 	sigset_t pingtcp_oldmask;
+	sigset_t pingtcp_reloadmask;
 	void* torsocks_hd = NULL;
 
-	pfcq_zero(&address, sizeof(pfcq_net_address_t));
-	pfcq_zero(&host, sizeof(pfcq_net_host_t));
-	pfcq_zero(&time_to_sleep, sizeof(struct timespec));
-	pfcq_zero(&ping_time_start, sizeof(struct timespec));
-	pfcq_zero(&ping_time_end, sizeof(struct timespec));
 	pfcq_zero(&pingtcp_newmask, sizeof(sigset_t));
 	pfcq_zero(&pingtcp_oldmask, sizeof(sigset_t));
-	timeout.tv_sec = 1;
-	timeout.tv_usec = 0;
-	time_to_sleep.tv_sec = 1;
-	time_to_sleep.tv_nsec = 0;
 
 	if (unlikely(sigemptyset(&pingtcp_newmask) != 0))
 		panic("sigemptyset");
@@ -142,6 +639,11 @@ int main(int argc, char** argv)
 	if (argc < 2)
 		__usage(argv[0]);
 
+	engine = pfcq_alloc(sizeof(pingtcp_engine_t));
+	pingtcp_engine_init(engine);
+	engine->on_result = __print_result;
+	engine->window = WINDOW_DEFAULT;
+
 	while (arg_index < argc)
 	{
 		if (strcmp(argv[arg_index], "--help") == 0 ||
@@ -157,7 +659,7 @@ int main(int argc, char** argv)
 		{
 			if (arg_index < argc - 1 && pfcq_isnumber(argv[arg_index + 1]))
 			{
-				limit = strtoul(argv[arg_index + 1], NULL, 10);
+				engine->limit = strtoul(argv[arg_index + 1], NULL, 10);
 				arg_index += 2;
 				continue;
 			} else
@@ -169,7 +671,7 @@ int main(int argc, char** argv)
 		{
 			if (arg_index < argc - 1 && pfcq_isnumber(argv[arg_index + 1]))
 			{
-				time_to_sleep = __pfcq_ns_to_timespec(strtoul(argv[arg_index + 1], NULL, 10) * 1000000UL);
+				engine->interval_ns = strtoul(argv[arg_index + 1], NULL, 10) * 1000000LL;
 				arg_index += 2;
 				continue;
 			} else
@@ -181,7 +683,151 @@ int main(int argc, char** argv)
 		{
 			if (arg_index < argc - 1 && pfcq_isnumber(argv[arg_index + 1]))
 			{
-				timeout = __pfcq_us_to_timeval(strtoul(argv[arg_index + 1], NULL, 10) * 1000UL);
+				engine->timeout_ns = strtoul(argv[arg_index + 1], NULL, 10) * 1000000LL;
+				arg_index += 2;
+				continue;
+			} else
+				__usage(argv[0]);
+		}
+
+		if (strcmp(argv[arg_index], "--window") == 0 ||
+			strcmp(argv[arg_index], "-w") == 0)
+		{
+			if (arg_index < argc - 1 && pfcq_isnumber(argv[arg_index + 1]))
+			{
+				engine->window = strtoul(argv[arg_index + 1], NULL, 10);
+				arg_index += 2;
+				continue;
+			} else
+				__usage(argv[0]);
+		}
+
+		if (strcmp(argv[arg_index], "--quiet") == 0 ||
+			strcmp(argv[arg_index], "-q") == 0)
+		{
+			engine->on_result = NULL;
+			arg_index++;
+			continue;
+		}
+
+		if (strcmp(argv[arg_index], "--compare") == 0)
+		{
+			compare = 1;
+			arg_index++;
+			continue;
+		}
+
+		if (strcmp(argv[arg_index], "--adaptive") == 0 ||
+			strcmp(argv[arg_index], "-a") == 0)
+		{
+			engine->adaptive = 1;
+			arg_index++;
+			continue;
+		}
+
+		if (strcmp(argv[arg_index], "--rto-min") == 0)
+		{
+			if (arg_index < argc - 1 && pfcq_isnumber(argv[arg_index + 1]))
+			{
+				engine->rto_min_ms = strtoul(argv[arg_index + 1], NULL, 10);
+				arg_index += 2;
+				continue;
+			} else
+				__usage(argv[0]);
+		}
+
+		if (strcmp(argv[arg_index], "--syn-retries") == 0)
+		{
+			if (arg_index < argc - 1 && pfcq_isnumber(argv[arg_index + 1]))
+			{
+				engine->syn_retries = strtoul(argv[arg_index + 1], NULL, 10);
+				if (unlikely(engine->syn_retries < 1 || engine->syn_retries > SYN_RETRIES_MAX))
+					stop("Wrong SYN retries count specified");
+				arg_index += 2;
+				continue;
+			} else
+				__usage(argv[0]);
+		}
+
+		if (strcmp(argv[arg_index], "--cpu") == 0)
+		{
+			if (arg_index < argc - 1 && pfcq_isnumber(argv[arg_index + 1]))
+			{
+				cpu = strtoul(argv[arg_index + 1], NULL, 10);
+				if (unlikely(cpu >= CPU_SETSIZE))
+					stop("Wrong CPU specified");
+				arg_index += 2;
+				continue;
+			} else
+				__usage(argv[0]);
+		}
+
+		if (strcmp(argv[arg_index], "--rt") == 0)
+		{
+			if (arg_index < argc - 1 && pfcq_isnumber(argv[arg_index + 1]))
+			{
+				rt_priority = strtoul(argv[arg_index + 1], NULL, 10);
+				if (unlikely(rt_priority < sched_get_priority_min(SCHED_FIFO) || rt_priority > sched_get_priority_max(SCHED_FIFO)))
+					stop("Wrong real-time priority specified");
+				arg_index += 2;
+				continue;
+			} else
+				__usage(argv[0]);
+		}
+
+		if (strcmp(argv[arg_index], "--busy-poll") == 0)
+		{
+			if (arg_index < argc - 1 && pfcq_isnumber(argv[arg_index + 1]))
+			{
+				busy_poll_us = strtoul(argv[arg_index + 1], NULL, 10);
+				if (unlikely(busy_poll_us <= 0))
+					stop("Wrong busy poll time specified");
+				arg_index += 2;
+				continue;
+			} else
+				__usage(argv[0]);
+		}
+
+		if (strcmp(argv[arg_index], "--shm") == 0)
+		{
+			if (arg_index < argc - 1)
+			{
+				shm_name = argv[arg_index + 1];
+				arg_index += 2;
+				continue;
+			} else
+				__usage(argv[0]);
+		}
+
+		if (strcmp(argv[arg_index], "--agent") == 0)
+		{
+			if (arg_index < argc - 1)
+			{
+				agent_address = argv[arg_index + 1];
+				arg_index += 2;
+				continue;
+			} else
+				__usage(argv[0]);
+		}
+
+		if (strcmp(argv[arg_index], "--agent-name") == 0)
+		{
+			if (arg_index < argc - 1)
+			{
+				agent_name = argv[arg_index + 1];
+				arg_index += 2;
+				continue;
+			} else
+				__usage(argv[0]);
+		}
+
+		if (strcmp(argv[arg_index], "--report") == 0)
+		{
+			if (arg_index < argc - 1 && pfcq_isnumber(argv[arg_index + 1]))
+			{
+				report_ms = strtoul(argv[arg_index + 1], NULL, 10);
+				if (unlikely(report_ms == 0))
+					stop("Wrong report interval specified");
 				arg_index += 2;
 				continue;
 			} else
@@ -208,13 +854,14 @@ int main(int argc, char** argv)
 				goto torloaded;
 			stop("Unable to load libtorsocks");
 torloaded:
-			*(void**)(&socket) = dlsym(torsocks_hd, "socket");
-			*(void**)(&getaddrinfo) = dlsym(torsocks_hd, "getaddrinfo");
-			*(void**)(&freeaddrinfo) = dlsym(torsocks_hd, "freeaddrinfo");
-			*(void**)(&inet_ntop) = dlsym(torsocks_hd, "inet_ntop");
-			*(void**)(&getnameinfo) = dlsym(torsocks_hd, "getnameinfo");
-			*(void**)(&connect) = dlsym(torsocks_hd, "connect");
-			*(void**)(&close) = dlsym(torsocks_hd, "close");
+			*(void**)(&engine->sys.socket) = dlsym(torsocks_hd, "socket");
+			*(void**)(&engine->sys.getaddrinfo) = dlsym(torsocks_hd, "getaddrinfo");
+			*(void**)(&engine->sys.freeaddrinfo) = dlsym(torsocks_hd, "freeaddrinfo");
+			*(void**)(&engine->sys.inet_ntop) = dlsym(torsocks_hd, "inet_ntop");
+			*(void**)(&engine->sys.getnameinfo) = dlsym(torsocks_hd, "getnameinfo");
+			*(void**)(&engine->sys.connect) = dlsym(torsocks_hd, "connect");
+			*(void**)(&engine->sys.close) = dlsym(torsocks_hd, "close");
+			engine->blocking = 1;
 
 			arg_index++;
 			continue;
@@ -223,199 +870,316 @@ torloaded:
 		if (strcmp(argv[arg_index], "--ipv6") == 0 ||
 			strcmp(argv[arg_index], "-6") == 0)
 		{
-			proto = PF_INET6;
+			engine->proto = PF_INET6;
 			arg_index++;
 			continue;
 		}
 
-		if (!dst)
+		if (strcmp(argv[arg_index], "--tls") == 0)
 		{
-			dst = pfcq_strdup(argv[arg_index]);
+			tls_mode = 1;
 			arg_index++;
 			continue;
 		}
 
-		if (port == -1)
+		if (strcmp(argv[arg_index], "--tls-name") == 0)
 		{
-			if (pfcq_isnumber(argv[arg_index]))
+			if (arg_index < argc - 1)
 			{
-				port = strtoul(argv[arg_index], NULL, 10);
-				arg_index++;
+				tls_name = argv[arg_index + 1];
+				arg_index += 2;
 				continue;
-			}
+			} else
+				__usage(argv[0]);
+		}
+
+		if (strcmp(argv[arg_index], "--targets") == 0)
+		{
+			if (arg_index < argc - 1)
+			{
+				targets_path = argv[arg_index + 1];
+				arg_index += 2;
+				continue;
+			} else
+				__usage(argv[0]);
+		}
+
+		if (strcmp(argv[arg_index], "--read") == 0)
+		{
+			if (arg_index < argc - 1)
+			{
+				read_path = argv[arg_index + 1];
+				arg_index += 2;
+				continue;
+			} else
+				__usage(argv[0]);
+		}
+
+		if (strcmp(argv[arg_index], "--passive") == 0)
+		{
+			if (arg_index < argc - 1)
+			{
+				passive_interface = argv[arg_index + 1];
+				arg_index += 2;
+				continue;
+			} else
+				__usage(argv[0]);
+		}
+
+		/* Targets are given as <host> <ports> pairs */
+		if (!dst)
+		{
+			dst = argv[arg_index];
+			arg_index++;
+			continue;
+		}
+
+		if (isdigit((unsigned char)argv[arg_index][0]))
+		{
+			groups = groups ? pfcq_realloc(groups, (groups_count + 1) * sizeof(pingtcp_group_t)) : pfcq_alloc(sizeof(pingtcp_group_t));
+			pfcq_zero(&groups[groups_count], sizeof(pingtcp_group_t));
+			groups[groups_count].dst = dst;
+			groups[groups_count].ports_count = pingtcp_ports_parse(argv[arg_index], &groups[groups_count].ports);
+			if (unlikely(groups[groups_count].ports_count == 0))
+				stop("Wrong port specified");
+			groups_count++;
+			dst = NULL;
+			arg_index++;
+			continue;
 		}
 
 		arg_index++;
 	}
 
-	if (port == -1)
-		stop("Wrong port specified");
+	if (unlikely(engine->timeout_ns == 0))
+		stop("Wrong timeout specified");
 
-	hints.ai_flags = AI_ADDRCONFIG | AI_V4MAPPED;
-	hints.ai_family = proto == PF_INET6 ? AF_INET6 : AF_INET;
-	hints.ai_socktype = 0;
+	/* Offline, so nothing is probed */
+	if (read_path)
+	{
+		if (unlikely(groups_count > 0))
+			__usage(argv[0]);
+		__read_capture(read_path, engine->timeout_ns);
+		pingtcp_engine_done(engine);
+		pfcq_free(engine);
+		exit(EX_OK);
+	}
 
-	if (unlikely(clock_gettime(CLOCK_MONOTONIC, &wall_time_start) == -1))
-		panic("clock_gettime");
+	if (passive_interface)
+	{
+		if (unlikely(groups_count > 0))
+			__usage(argv[0]);
+		__run_passive(passive_interface, engine->timeout_ns, &pingtcp_newmask);
+		pingtcp_engine_done(engine);
+		pfcq_free(engine);
+		exit(EX_OK);
+	}
 
-	for (;;)
+	/* Must be there before targets are, so that their TLS statistics are allocated */
+	if (tls_mode)
 	{
-		attempt++;
-		current_ptr = 0;
+		int res = 0;
 
-		socket_fd = socket(proto, SOCK_STREAM, 0);
-		if (unlikely(socket_fd == -1))
-			panic("socket");
+		res = pingtcp_tls_init(&tls, tls_name);
+		if (unlikely(res))
+			stop(pfcq_mstring("Unable to set TLS up: %s", strerror(res)));
+		engine->tls = &tls;
+		/* A server that resets the connection mid-handshake must not kill the process */
+		if (unlikely(signal(SIGPIPE, SIG_IGN) == SIG_ERR))
+			panic("signal");
+	}
 
-		res = getaddrinfo(dst, NULL, &hints, &server);
+	if (targets_path)
+	{
+		int res = 0;
+
+		if (unlikely(groups_count > 0 || compare))
+			__usage(argv[0]);
+
+		/* Reloaded on SIGHUP as well, so it must not terminate */
+		pingtcp_reloadmask = pingtcp_newmask;
+		if (unlikely(sigaddset(&pingtcp_reloadmask, SIGHUP) != 0))
+			panic("sigaddset");
+		if (unlikely(pthread_sigmask(SIG_BLOCK, &pingtcp_reloadmask, NULL) != 0))
+			panic("pthread_sigmask");
+
+		res = pingtcp_inventory_init(&inventory, engine, targets_path);
 		if (unlikely(res))
-			stop(gai_strerror(res));
-		switch (proto)
-		{
-			case PF_INET:
-				if (unlikely(!inet_ntop(AF_INET, &((struct sockaddr_in*)server->ai_addr)->sin_addr, host.host4, INET_ADDRSTRLEN)))
-					panic("inet_ntop");
-				break;
-			case PF_INET6:
-				if (unlikely(!inet_ntop(AF_INET6, &((struct sockaddr_in6*)server->ai_addr)->sin6_addr, host.host6, INET6_ADDRSTRLEN)))
-					panic("inet_ntop");
-				break;
-			default:
-				panic("socket family");
-				break;
-		}
+			stop(pfcq_mstring("Unable to watch %s: %s", targets_path, strerror(res)));
+		res = pingtcp_inventory_reload(&inventory);
+		if (unlikely(res))
+			stop(pfcq_mstring("Unable to read %s: %s", targets_path, strerror(res)));
+		pingtcp_inventory_apply(&inventory, SIZE_MAX);
+		printf("PINGTCP %s: %lu target(s), %lu unresolved, %lu malformed line(s)\n",
+				targets_path, inventory.added, inventory.unresolved, inventory.malformed);
+	} else if (groups_count == 0)
+		stop("Wrong port specified");
 
-		if (unlikely(attempt == 1))
-			printf("PINGTCP %s (%s:%d)\n", dst, proto == PF_INET6 ? host.host6 : host.host4, port);
-		switch (proto)
-		{
-			case PF_INET:
-				address.address4.sin_family = AF_INET;
-				memcpy(&address.address4.sin_addr, &((struct sockaddr_in*)server->ai_addr)->sin_addr, sizeof(struct in_addr));
-				address.address4.sin_port = htons(port);
-				break;
-			case PF_INET6:
-				address.address6.sin6_family = AF_INET6;
-				memcpy(&address.address6.sin6_addr, &((struct sockaddr_in6*)server->ai_addr)->sin6_addr, sizeof(struct in6_addr));
-				address.address6.sin6_port = htons(port);
-				break;
-			default:
-				panic("socket family");
-				break;
-		}
+	for (size_t i = 0; i < groups_count; i++)
+	{
+		pingtcp_group_t* group = &groups[i];
+		int res = pingtcp_engine_add(engine, group->dst, group->ports[0], &group->first);
 
-		freeaddrinfo(server);
+		if (unlikely(res))
+			stop(gai_strerror(res));
+		/* The host is resolved once, other ports share its address */
+		for (size_t j = 1; j < group->ports_count; j++)
+			if (unlikely(pingtcp_engine_add_port(engine, group->first, group->ports[j], NULL) == -1))
+				panic("pingtcp_engine_add_port");
 
-		pfcq_zero(ptr, FQDN_MAX_LENGTH);
-		switch (proto)
-		{
-			case PF_INET:
-				if (likely(getnameinfo((const struct sockaddr*)&address.address4, sizeof(struct sockaddr_in), ptr, FQDN_MAX_LENGTH, NULL, 0, NI_NAMEREQD) == 0))
-					current_ptr = 1;
-				break;
-			case PF_INET6:
-				if (likely(getnameinfo((const struct sockaddr*)&address.address6, sizeof(struct sockaddr_in6), ptr, FQDN_MAX_LENGTH, NULL, 0, NI_NAMEREQD) == 0))
-					current_ptr = 1;
-				break;
-			default:
-				panic("socket family");
-				break;
-		}
+		if (group->ports_count == 1)
+			printf("PINGTCP %s (%s:%d)\n", group->dst, pingtcp_target_host(engine, group->first), group->ports[0]);
+		else
+			printf("PINGTCP %s (%s), %lu ports\n", group->dst, pingtcp_target_host(engine, group->first), group->ports_count);
+	}
 
-		if (unlikely(clock_gettime(CLOCK_MONOTONIC, &ping_time_start) == -1))
-			panic("clock_gettime");
+	/* Probed one at a time in shuffled rounds, so that all targets share the same conditions */
+	if (compare)
+	{
+		if (unlikely(engine->targets.count < 2))
+			stop("Comparison needs at least two targets");
+		engine->interleaved = 1;
+		comparison.print = engine->on_result;
+		comparison.samples = pfcq_alloc(engine->targets.count * sizeof(pingtcp_samples_t));
+		engine->on_result = __record_result;
+		engine->on_result_data = &comparison;
+	}
+
+	if (shm_name)
+	{
+		pingtcp_shm_create(&shm, shm_name, engine->targets.capacity);
+		engine->shm = &shm;
+	}
 
-		if (unlikely(setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout)) == -1))
-			panic("setsockopt");
-		if (unlikely(setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout)) == -1))
-			panic("setsockopt");
+	if (agent_address)
+	{
+		int res = 0;
 
-		switch (proto)
+		/* Vantage points are told apart by host name unless named explicitly */
+		if (!agent_name)
 		{
-			case PF_INET:
-				res = connect(socket_fd, (struct sockaddr*)&address.address4, sizeof (struct sockaddr_in));
-				break;
-			case PF_INET6:
-				res = connect(socket_fd, (struct sockaddr*)&address.address6, sizeof(struct sockaddr_in6));
-				break;
-			default:
-				panic("socket family");
-				break;
+			pfcq_zero(hostname, AGENT_NAME_MAX);
+			if (unlikely(gethostname(hostname, AGENT_NAME_MAX - 1) == -1))
+				panic("gethostname");
+			agent_name = hostname;
 		}
+		res = pingtcp_agent_init(&agent, engine, agent_address, agent_name);
+		if (unlikely(res))
+			stop(gai_strerror(res));
+	}
 
-		if (unlikely(close(socket_fd) == -1))
-			panic("close");
-
-		if (unlikely(clock_gettime(CLOCK_MONOTONIC, &ping_time_end) == -1))
-			panic("clock_gettime");
+	/* Started first, so that the writer neither shares the pinned CPU nor the real-time priority */
+	fflush(stdout);
+	pfcq_log_init();
 
-		if (unlikely(res == 0))
-		{
-			time_to_ping = __pfcq_timespec_diff_ns(ping_time_start, ping_time_end);
-			time_to_ping_ms = (double)time_to_ping / 1000000.0;
+	if (cpu != -1)
+	{
+		int res = pingtcp_precision_pin(cpu);
 
-			printf("Handshaked with %s:%d (%s): attempt=%lu time=%1.3lf ms\n",
-					current_ptr ? ptr : dst, port, proto == PF_INET6 ? host.host6 : host.host4, attempt, time_to_ping_ms);
-			if (time_to_ping_ms > rtt_max)
-				rtt_max = time_to_ping_ms;
-			if (time_to_ping_ms < rtt_min)
-				rtt_min = time_to_ping_ms;
-			rtt_sum += time_to_ping_ms;
-			rtt_sum_sqr += pow(time_to_ping_ms, 2.0);
+		if (unlikely(res))
+			stop(pfcq_mstring("Unable to pin to CPU %d: %s", cpu, strerror(res)));
+	}
 
-			ok++;
-		} else
-		{
-			printf("Unable to handshake with %s:%d (%s): attempt=%lu\n",
-					current_ptr ? ptr : dst, port, proto == PF_INET6 ? host.host6 : host.host4, attempt);
+	if (rt_priority > 0)
+	{
+		int res = pingtcp_precision_realtime(rt_priority);
 
-			fail++;
-		}
+		if (unlikely(res))
+			stop(pfcq_mstring("Unable to lock memory and switch to SCHED_FIFO: %s", strerror(res)));
+	}
 
-		if (limit != 0 && attempt + 1 > limit)
-			break;
+	if (busy_poll_us > 0)
+	{
+		engine->spin_ns = (int64_t)busy_poll_us * 1000LL;
+		/* Busy-waiting in the loop does not need any privileges, SO_BUSY_POLL might */
+		if (likely(pingtcp_precision_busy_poll(busy_poll_us) == 0))
+			engine->busy_poll_us = busy_poll_us;
+		else
+			inform("%s\n", "SO_BUSY_POLL is not permitted, busy-waiting in the loop only");
+	}
 
-		res = sigtimedwait(&pingtcp_newmask, NULL, &time_to_sleep);
-		if (likely(res == -1))
-		{
-			if (likely(errno == EAGAIN || errno == EINTR))
-				continue;
-			else
-				panic("sigtimedwait");
-		} else
-			break;
+	/* Shows whether sub-millisecond handshake times are resolvable at all, with the log writer running */
+	if (cpu != -1 || rt_priority > 0 || busy_poll_us > 0)
+	{
+		pingtcp_precision_jitter(&jitter, PRECISION_JITTER_SAMPLES);
+		printf("Wakeup jitter over %lu sleeps: min/avg/p99/max = %1.3lf/%1.3lf/%1.3lf/%1.3lf us, busy poll avg/max = %1.3lf/%1.3lf us\n",
+				jitter.samples, jitter.sleep_min_us, jitter.sleep_avg_us, jitter.sleep_p99_us, jitter.sleep_max_us,
+				jitter.poll_avg_us, jitter.poll_max_us);
 	}
 
+	fflush(stdout);
+
+	if (unlikely(clock_gettime(CLOCK_MONOTONIC, &wall_time_start) == -1))
+		panic("clock_gettime");
+
+	if (targets_path)
+		__run_inventory(engine, &inventory, agent_address ? &agent : NULL, (int64_t)report_ms * 1000000LL, &pingtcp_reloadmask);
+	else if (agent_address)
+		__run_agent(engine, &agent, (int64_t)report_ms * 1000000LL, &pingtcp_newmask);
+	else
+		pingtcp_engine_run(engine, &pingtcp_newmask);
+
 	if (unlikely(clock_gettime(CLOCK_MONOTONIC, &wall_time_end) == -1))
 		panic("clock_gettime");
 
-	if (unlikely(pthread_sigmask(SIG_UNBLOCK, &pingtcp_newmask, NULL) != 0))
+	/* Attempt lines are written out before the summary */
+	pfcq_log_done();
+
+	if (unlikely(pthread_sigmask(SIG_UNBLOCK, targets_path ? &pingtcp_reloadmask : &pingtcp_newmask, NULL) != 0))
 		panic("pthread_sigmask");
 
-	printf("\n--- %s:%d pingtcp statistics ---\n", dst, port);
-	loss = (double)fail / (double)attempt * 100.0;
 	wall_time = __pfcq_timespec_diff_ns(wall_time_start, wall_time_end);
 	wall_time_ms = (double)wall_time / 1000000.0;
-	if (ok > 0)
+	for (size_t i = 0; i < groups_count; i++)
 	{
-		rtt_avg = rtt_sum / ok;
-		rtt_sum /= ok;
-		rtt_sum_sqr /= ok;
-		rtt_mdev = sqrt(rtt_sum_sqr - pow(rtt_sum, 2.0));
-	} else
+		if (groups[i].ports_count == 1)
+		{
+			__print_stats(engine->targets.dst[groups[i].first], engine->targets.port[groups[i].first],
+					&engine->targets.stats[groups[i].first], engine->adaptive ? &engine->targets.rto[groups[i].first] : NULL, wall_time_ms);
+			if (engine->tls)
+				__print_tls_stats(&engine->targets.tls[groups[i].first]);
+		} else
+			__print_ports(engine, groups[i].first, groups[i].ports_count, wall_time_ms);
+		pfcq_free(groups[i].ports);
+	}
+	if (groups)
+		pfcq_free(groups);
+
+	/* Targets removed meanwhile are gone along with their statistics */
+	if (targets_path)
 	{
-		rtt_min = 0;
-		rtt_max = 0;
+		for (size_t i = 0; i < engine->targets.count; i++)
+		{
+			if (engine->targets.state[i] != PINGTCP_TARGET_ACTIVE && engine->targets.state[i] != PINGTCP_TARGET_DONE)
+				continue;
+			__print_stats(engine->targets.dst[i], engine->targets.port[i],
+					&engine->targets.stats[i], engine->adaptive ? &engine->targets.rto[i] : NULL, wall_time_ms);
+			if (engine->tls)
+				__print_tls_stats(&engine->targets.tls[i]);
+		}
+		pingtcp_inventory_done(&inventory);
 	}
-	printf("%lu handshake(s) started, %lu succeeded, %1.3lf%% loss, time %1.3lf ms\n", attempt, ok, loss, wall_time_ms);
-	printf("rtt min/avg/max/mdev = %1.3lf/%1.3lf/%1.3lf/%1.3lf\n", rtt_min, rtt_avg, rtt_max, rtt_mdev);
+
+	if (compare)
+	{
+		__print_comparison(engine, comparison.samples);
+		for (size_t i = 0; i < engine->targets.count; i++)
+			pingtcp_samples_free(&comparison.samples[i]);
+		pfcq_free(comparison.samples);
+	}
+
+	if (agent_address)
+		pingtcp_agent_done(&agent);
+	if (engine->shm)
+		pingtcp_shm_close(engine->shm);
+	pingtcp_engine_done(engine);
+	pfcq_free(engine);
+	if (tls_mode)
+		pingtcp_tls_done(&tls);
 
 	if (torsocks_hd)
 		if (unlikely(dlclose(torsocks_hd) != 0))
 			panic("dlclose");
 
-	pfcq_free(dst);
-
 	exit(EX_OK);
 }
-
@@ -0,0 +1,98 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "pool.h"
+
+#include "contrib/pfcq/pfcq.h"
+
+#define POOL_ALIGN		16
+
+static void __pool_grow(pingtcp_pool_t* _pool)
+{
+	char* slab = NULL;
+
+	slab = pfcq_alloc(_pool->object_size * _pool->slab_objects);
+	_pool->slabs = _pool->slabs ?
+		pfcq_realloc(_pool->slabs, (_pool->slabs_count + 1) * sizeof(void*)) :
+		pfcq_alloc(sizeof(void*));
+	_pool->slabs[_pool->slabs_count++] = slab;
+	_pool->capacity += _pool->slab_objects;
+
+	/* Threaded backwards, so that objects are handed out in address order */
+	for (size_t i = _pool->slab_objects; i > 0; i--)
+	{
+		void** object = (void**)(slab + (i - 1) * _pool->object_size);
+		*object = _pool->free;
+		_pool->free = object;
+	}
+
+	return;
+}
+
+void pingtcp_pool_init(pingtcp_pool_t* _pool, size_t _object_size, size_t _slab_objects, size_t _reserve)
+{
+	pfcq_zero(_pool, sizeof(pingtcp_pool_t));
+	if (_object_size < sizeof(void*))
+		_object_size = sizeof(void*);
+	_pool->object_size = (_object_size + POOL_ALIGN - 1) & ~((size_t)POOL_ALIGN - 1);
+	_pool->slab_objects = _slab_objects > 0 ? _slab_objects : POOL_SLAB_OBJECTS;
+
+	while (_pool->capacity < _reserve)
+		__pool_grow(_pool);
+
+	return;
+}
+
+void* pingtcp_pool_get(pingtcp_pool_t* _pool)
+{
+	void** ret = NULL;
+
+	if (unlikely(!_pool->free))
+		__pool_grow(_pool);
+
+	ret = _pool->free;
+	_pool->free = *ret;
+	_pool->used++;
+	pfcq_zero(ret, _pool->object_size);
+
+	return ret;
+}
+
+void pingtcp_pool_put(pingtcp_pool_t* _pool, void* _object)
+{
+	*(void**)_object = _pool->free;
+	_pool->free = _object;
+	_pool->used--;
+
+	return;
+}
+
+void pingtcp_pool_done(pingtcp_pool_t* _pool)
+{
+	for (size_t i = 0; i < _pool->slabs_count; i++)
+		pfcq_free(_pool->slabs[i]);
+	if (_pool->slabs)
+		pfcq_free(_pool->slabs);
+	pfcq_zero(_pool, sizeof(pingtcp_pool_t));
+
+	return;
+}
+
@@ -0,0 +1,53 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define POOL_SLAB_OBJECTS	4096
+
+/*
+ * Fixed-size object pool. Objects are carved from slabs which are
+ * never moved or returned, so pointers to them (and timers embedded
+ * into them) stay valid, and a warmed-up pool never allocates again
+ */
+typedef struct pingtcp_pool
+{
+	size_t object_size;
+	size_t slab_objects;
+	size_t slabs_count;
+	size_t used;
+	size_t capacity;
+	void** slabs;
+	void* free;
+} pingtcp_pool_t;
+
+void pingtcp_pool_init(pingtcp_pool_t* _pool, size_t _object_size, size_t _slab_objects, size_t _reserve) __attribute__((nonnull(1)));
+void* pingtcp_pool_get(pingtcp_pool_t* _pool) __attribute__((nonnull(1), warn_unused_result));
+void pingtcp_pool_put(pingtcp_pool_t* _pool, void* _object) __attribute__((nonnull(1, 2)));
+void pingtcp_pool_done(pingtcp_pool_t* _pool) __attribute__((nonnull(1)));
+
+#endif /* __POOL_H__ */
+
@@ -0,0 +1,155 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "precision.h"
+
+static int __compare_double(const void* _a, const void* _b)
+{
+	double a = *(const double*)_a;
+	double b = *(const double*)_b;
+
+	return (a > b) - (a < b);
+}
+
+int pingtcp_precision_pin(int _cpu)
+{
+	cpu_set_t cpus;
+	cpu_set_t rest;
+
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &rest) == -1)
+		return errno;
+	CPU_CLR(_cpu, &rest);
+
+	CPU_ZERO(&cpus);
+	CPU_SET(_cpu, &cpus);
+	if (sched_setaffinity(0, sizeof(cpu_set_t), &cpus) == -1)
+		return errno;
+
+	/* The log writer is kept off the probing CPU, unless there is no other one */
+	if (CPU_COUNT(&rest) > 0)
+		return pfcq_log_affinity(&rest);
+
+	return 0;
+}
+
+/*
+ * Locked memory comes first, so that a real-time loop
+ * never stalls on a page fault
+ */
+int pingtcp_precision_realtime(int _priority)
+{
+	struct sched_param param;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+		return errno;
+
+	pfcq_zero(&param, sizeof(struct sched_param));
+	param.sched_priority = _priority;
+	if (sched_setscheduler(0, SCHED_FIFO, &param) == -1)
+		return errno;
+
+	return 0;
+}
+
+/* Raising SO_BUSY_POLL above net.core.busy_read needs CAP_NET_ADMIN, so it is tried first */
+int pingtcp_precision_busy_poll(int _us)
+{
+	int fd = -1;
+	int ret = 0;
+
+	fd = socket(PF_INET, SOCK_STREAM, 0);
+	if (unlikely(fd == -1))
+		return errno;
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &_us, sizeof(_us)) == -1)
+		ret = errno;
+	if (unlikely(close(fd) == -1))
+		panic("close");
+
+	return ret;
+}
+
+/*
+ * Measured with the very same calls the engine loop makes,
+ * after pinning and scheduling have been applied
+ */
+void pingtcp_precision_jitter(pingtcp_jitter_t* _jitter, size_t _samples)
+{
+	int epoll_fd = -1;
+	double* sleeps = NULL;
+	struct epoll_event event;
+
+	pfcq_zero(_jitter, sizeof(pingtcp_jitter_t));
+	if (_samples == 0)
+		return;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (unlikely(epoll_fd == -1))
+		panic("epoll_create1");
+	sleeps = pfcq_alloc(_samples * sizeof(double));
+
+	for (size_t i = 0; i < _samples; i++)
+	{
+		int64_t start_ns = pingtcp_now_ns();
+
+		if (unlikely(epoll_wait(epoll_fd, &event, 1, PRECISION_JITTER_SLEEP_MS) == -1 && errno != EINTR))
+			panic("epoll_wait");
+		sleeps[i] = (double)(pingtcp_now_ns() - start_ns - PRECISION_JITTER_SLEEP_MS * 1000000LL) / 1000.0;
+		if (sleeps[i] < 0)
+			sleeps[i] = 0;
+		_jitter->sleep_avg_us += sleeps[i];
+	}
+
+	for (size_t i = 0; i < _samples; i++)
+	{
+		int64_t start_ns = pingtcp_now_ns();
+		double poll_us = 0;
+
+		if (unlikely(epoll_wait(epoll_fd, &event, 1, 0) == -1 && errno != EINTR))
+			panic("epoll_wait");
+		poll_us = (double)(pingtcp_now_ns() - start_ns) / 1000.0;
+		_jitter->poll_avg_us += poll_us;
+		if (poll_us > _jitter->poll_max_us)
+			_jitter->poll_max_us = poll_us;
+	}
+
+	qsort(sleeps, _samples, sizeof(double), __compare_double);
+	_jitter->samples = _samples;
+	_jitter->sleep_min_us = sleeps[0];
+	_jitter->sleep_avg_us /= _samples;
+	_jitter->sleep_p99_us = sleeps[(size_t)((_samples - 1) * 0.99)];
+	_jitter->sleep_max_us = sleeps[_samples - 1];
+	_jitter->poll_avg_us /= _samples;
+
+	pfcq_free(sleeps);
+	if (unlikely(close(epoll_fd) == -1))
+		panic("close");
+
+	return;
+}
+
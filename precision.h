@@ -0,0 +1,53 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifndef __PRECISION_H__
+#define __PRECISION_H__
+
+#include <stddef.h>
+
+#define PRECISION_JITTER_SAMPLES	200
+#define PRECISION_JITTER_SLEEP_MS	1
+
+/*
+ * How late the loop wakes up from a sleep in epoll_wait(), and how long
+ * one non-blocking poll takes when busy-waiting instead
+ */
+typedef struct pingtcp_jitter
+{
+	size_t samples;
+	double sleep_min_us;
+	double sleep_avg_us;
+	double sleep_p99_us;
+	double sleep_max_us;
+	double poll_avg_us;
+	double poll_max_us;
+} pingtcp_jitter_t;
+
+/* Each returns 0 or the errno value of what failed */
+int pingtcp_precision_pin(int _cpu) __attribute__((warn_unused_result));
+int pingtcp_precision_realtime(int _priority) __attribute__((warn_unused_result));
+int pingtcp_precision_busy_poll(int _us) __attribute__((warn_unused_result));
+void pingtcp_precision_jitter(pingtcp_jitter_t* _jitter, size_t _samples) __attribute__((nonnull(1)));
+
+#endif /* __PRECISION_H__ */
+
@@ -0,0 +1,246 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+static char* __shm_name(const char* _name)
+{
+	char* ret = NULL;
+	size_t length = strlen(_name);
+
+	/* shm_open() wants exactly one leading slash */
+	if (_name[0] == '/')
+		return pfcq_strdup(_name);
+
+	ret = pfcq_alloc(length + 2);
+	ret[0] = '/';
+	memcpy(ret + 1, _name, length);
+
+	return ret;
+}
+
+/* The old mapping stays valid on failure */
+static int __shm_remap(pingtcp_shm_t* _shm, size_t _size)
+{
+	void* segment = mremap(_shm->header, _shm->size, _size, MREMAP_MAYMOVE);
+
+	if (unlikely(segment == MAP_FAILED))
+		return errno;
+	_shm->header = segment;
+	_shm->records = (pingtcp_shm_record_t*)((char*)segment + sizeof(pingtcp_shm_header_t));
+	_shm->size = _size;
+
+	return 0;
+}
+
+void pingtcp_shm_create(pingtcp_shm_t* _shm, const char* _name, size_t _count)
+{
+	void* segment = NULL;
+
+	pfcq_zero(_shm, sizeof(pingtcp_shm_t));
+	_shm->name = __shm_name(_name);
+	_shm->writer = 1;
+	_shm->size = sizeof(pingtcp_shm_header_t) + _count * sizeof(pingtcp_shm_record_t);
+
+	/* Kept open, since the segment is grown later */
+	_shm->fd = shm_open(_shm->name, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (unlikely(_shm->fd == -1))
+		panic("shm_open");
+	if (unlikely(ftruncate(_shm->fd, _shm->size) == -1))
+		panic("ftruncate");
+	segment = mmap(NULL, _shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, _shm->fd, 0);
+	if (unlikely(segment == MAP_FAILED))
+		panic("mmap");
+
+	_shm->header = segment;
+	_shm->records = (pingtcp_shm_record_t*)((char*)segment + sizeof(pingtcp_shm_header_t));
+
+	_shm->header->header_size = sizeof(pingtcp_shm_header_t);
+	_shm->header->record_size = sizeof(pingtcp_shm_record_t);
+	_shm->header->histogram_buckets = HISTOGRAM_BUCKETS;
+	_shm->header->count = _count;
+	_shm->header->pid = getpid();
+	_shm->header->running = 1;
+	_shm->header->version = SHM_VERSION;
+	/* Set last, so that a reader never sees a valid magic with a half-written header */
+	__atomic_store_n(&_shm->header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+	return;
+}
+
+/*
+ * New records are zeroed, so they read as unused until described.
+ * On failure the segment keeps its old count, and readers never see past it.
+ */
+int pingtcp_shm_grow(pingtcp_shm_t* _shm, size_t _count)
+{
+	int res = 0;
+	size_t size = sizeof(pingtcp_shm_header_t) + _count * sizeof(pingtcp_shm_record_t);
+
+	if (size <= _shm->size)
+		return 0;
+
+	if (unlikely(ftruncate(_shm->fd, size) == -1))
+		return errno;
+	res = __shm_remap(_shm, size);
+	if (unlikely(res != 0))
+		return res;
+	__atomic_store_n(&_shm->header->count, _count, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* Under the seqlock as well, since a slot gets described again once reused */
+void pingtcp_shm_describe(pingtcp_shm_t* _shm, size_t _index, const char* _dst, int _port, const pfcq_net_host_t* _host)
+{
+	pingtcp_shm_record_t* record = &_shm->records[_index];
+	uint32_t seq = record->seq;
+
+	__atomic_store_n(&record->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	pfcq_zero(record->dst, FQDN_MAX_LENGTH);
+	strncpy(record->dst, _dst, FQDN_MAX_LENGTH - 1);
+	record->port = _port;
+	memcpy(&record->host, _host, sizeof(pfcq_net_host_t));
+	__atomic_store_n(&record->seq, seq + 2, __ATOMIC_RELEASE);
+
+	return;
+}
+
+void pingtcp_shm_publish(pingtcp_shm_t* _shm, size_t _index, const pingtcp_stats_t* _stats)
+{
+	pingtcp_shm_record_t* record = &_shm->records[_index];
+	uint32_t seq = record->seq;
+
+	__atomic_store_n(&record->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&record->stats, _stats, sizeof(pingtcp_stats_t));
+	__atomic_store_n(&record->seq, seq + 2, __ATOMIC_RELEASE);
+
+	return;
+}
+
+int pingtcp_shm_open(pingtcp_shm_t* _shm, const char* _name)
+{
+	int fd = -1;
+	struct stat info;
+	void* segment = NULL;
+	const pingtcp_shm_header_t* header = NULL;
+
+	pfcq_zero(_shm, sizeof(pingtcp_shm_t));
+	_shm->name = __shm_name(_name);
+
+	fd = shm_open(_shm->name, O_RDONLY, 0);
+	if (fd == -1)
+		goto fail;
+	if (unlikely(fstat(fd, &info) == -1))
+		panic("fstat");
+	if ((size_t)info.st_size < sizeof(pingtcp_shm_header_t))
+		goto fail;
+	segment = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (unlikely(segment == MAP_FAILED))
+		panic("mmap");
+	if (unlikely(close(fd) == -1))
+		panic("close");
+	fd = -1;
+	_shm->header = segment;
+	_shm->size = info.st_size;
+
+	header = _shm->header;
+	if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+		header->version != SHM_VERSION ||
+		header->header_size != sizeof(pingtcp_shm_header_t) ||
+		header->record_size != sizeof(pingtcp_shm_record_t) ||
+		header->histogram_buckets != HISTOGRAM_BUCKETS ||
+		_shm->size < header->header_size + header->count * header->record_size)
+		goto fail;
+	_shm->records = (pingtcp_shm_record_t*)((char*)segment + header->header_size);
+
+	return 0;
+
+fail:
+	if (fd != -1)
+		if (unlikely(close(fd) == -1))
+			panic("close");
+	pingtcp_shm_close(_shm);
+
+	return -1;
+}
+
+size_t pingtcp_shm_count(pingtcp_shm_t* _shm)
+{
+	size_t count = __atomic_load_n(&_shm->header->count, __ATOMIC_ACQUIRE);
+	size_t size = sizeof(pingtcp_shm_header_t) + count * sizeof(pingtcp_shm_record_t);
+
+	/* Grown by the writer since mapped, only the part that is mapped is read otherwise */
+	if (size > _shm->size && unlikely(__shm_remap(_shm, size) != 0))
+		return (_shm->size - sizeof(pingtcp_shm_header_t)) / sizeof(pingtcp_shm_record_t);
+
+	return count;
+}
+
+void pingtcp_shm_read(const pingtcp_shm_t* _shm, size_t _index, pingtcp_shm_record_t* _record)
+{
+	const pingtcp_shm_record_t* record = &_shm->records[_index];
+	uint32_t before = 0;
+	uint32_t after = 0;
+
+	do
+	{
+		before = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+		if (before & 1)
+			continue;
+		memcpy(_record, record, sizeof(pingtcp_shm_record_t));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&record->seq, __ATOMIC_RELAXED);
+	} while ((before & 1) || before != after);
+
+	return;
+}
+
+void pingtcp_shm_close(pingtcp_shm_t* _shm)
+{
+	if (_shm->header)
+	{
+		if (_shm->writer)
+			__atomic_store_n(&_shm->header->running, 0, __ATOMIC_RELEASE);
+		if (unlikely(munmap(_shm->header, _shm->size) == -1))
+			panic("munmap");
+	}
+	if (_shm->writer)
+	{
+		if (unlikely(close(_shm->fd) == -1))
+			panic("close");
+		if (unlikely(shm_unlink(_shm->name) == -1))
+			panic("shm_unlink");
+	}
+	pfcq_free(_shm->name);
+	pfcq_zero(_shm, sizeof(pingtcp_shm_t));
+
+	return;
+}
+
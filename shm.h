@@ -0,0 +1,87 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifndef __SHM_H__
+#define __SHM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "engine.h"
+
+#define SHM_MAGIC			0x70746370U
+#define SHM_VERSION			2
+#define SHM_ALIGN			64
+
+/*
+ * Live statistics segment layout: a header followed by one record per target
+ * slot, an unused slot having an empty dst. The segment grows along with the
+ * targets table, and count is raised only once it has, so readers remap
+ * whenever count outgrows their mapping. Readers check magic, version and
+ * sizes before trusting the rest
+ */
+typedef struct pingtcp_shm_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t record_size;
+	uint32_t histogram_buckets;
+	uint32_t running;
+	uint64_t count;
+	int64_t pid;
+} __attribute__((aligned(SHM_ALIGN))) pingtcp_shm_header_t;
+
+/*
+ * Written by the probing process only, under a seqlock: seq is odd
+ * while an update is in progress, so readers retry instead of locking
+ */
+typedef struct pingtcp_shm_record
+{
+	uint32_t seq;
+	int32_t port;
+	char dst[FQDN_MAX_LENGTH];
+	pfcq_net_host_t host;
+	pingtcp_stats_t stats;
+} __attribute__((aligned(SHM_ALIGN))) pingtcp_shm_record_t;
+
+typedef struct pingtcp_shm
+{
+	char* name;
+	size_t size;
+	int writer;
+	int fd;
+	pingtcp_shm_header_t* header;
+	pingtcp_shm_record_t* records;
+} pingtcp_shm_t;
+
+void pingtcp_shm_create(pingtcp_shm_t* _shm, const char* _name, size_t _count) __attribute__((nonnull(1, 2)));
+int pingtcp_shm_grow(pingtcp_shm_t* _shm, size_t _count) __attribute__((nonnull(1), warn_unused_result));
+void pingtcp_shm_describe(pingtcp_shm_t* _shm, size_t _index, const char* _dst, int _port, const pfcq_net_host_t* _host) __attribute__((nonnull(1, 3, 5)));
+void pingtcp_shm_publish(pingtcp_shm_t* _shm, size_t _index, const pingtcp_stats_t* _stats) __attribute__((nonnull(1, 3)));
+int pingtcp_shm_open(pingtcp_shm_t* _shm, const char* _name) __attribute__((nonnull(1, 2), warn_unused_result));
+size_t pingtcp_shm_count(pingtcp_shm_t* _shm) __attribute__((nonnull(1), warn_unused_result));
+void pingtcp_shm_read(const pingtcp_shm_t* _shm, size_t _index, pingtcp_shm_record_t* _record) __attribute__((nonnull(1, 3)));
+void pingtcp_shm_close(pingtcp_shm_t* _shm) __attribute__((nonnull(1)));
+
+#endif /* __SHM_H__ */
+
@@ -0,0 +1,244 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "sniffer.h"
+
+/* The first loopback device, whose outgoing packets come back in as well */
+static unsigned int __loopback_index(int _fd)
+{
+	struct if_nameindex* interfaces = if_nameindex();
+	unsigned int ret = 0;
+
+	if (unlikely(!interfaces))
+		return ret;
+
+	for (struct if_nameindex* i = interfaces; i->if_index != 0 && ret == 0; i++)
+	{
+		struct ifreq request;
+
+		pfcq_zero(&request, sizeof(struct ifreq));
+		strncpy(request.ifr_name, i->if_name, IFNAMSIZ - 1);
+		if (ioctl(_fd, SIOCGIFFLAGS, &request) == 0 && (request.ifr_flags & IFF_LOOPBACK))
+			ret = i->if_index;
+	}
+	if_freenameindex(interfaces);
+
+	return ret;
+}
+
+/*
+ * The socket is SOCK_DGRAM, so offsets are from the network header whatever the link is.
+ * Passes TCP segments with SYN or RST set (IPv6 ones only without extension headers),
+ * skipping all fragments but the first and outgoing copies on loopback
+ */
+static int __sniffer_filter(int _fd, unsigned int _loopback)
+{
+	struct sock_filter code[] =
+	{
+		/* 0 */ BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+		/* 1 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 0, 2),
+		/* 2 */ BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_IFINDEX),
+		/* 3 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, _loopback, 16, 0),
+		/* 4 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+		/* 5 */ BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 4),
+		/* 6 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 4, 0, 7),
+		/* 7 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+		/* 8 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 0, 11),
+		/* 9 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),
+		/* 10 */ BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 9, 0),
+		/* 11 */ BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+		/* 12 */ BPF_STMT(BPF_LD | BPF_B | BPF_IND, 13),
+		/* 13 */ BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x06, 5, 6),
+		/* 14 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 6, 0, 5),
+		/* 15 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 6),
+		/* 16 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 0, 3),
+		/* 17 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 40 + 13),
+		/* 18 */ BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x06, 0, 1),
+		/* 19 */ BPF_STMT(BPF_RET | BPF_K, SNIFFER_SNAPLEN),
+		/* 20 */ BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog program =
+	{
+		.len = sizeof(code) / sizeof(code[0]),
+		.filter = code,
+	};
+
+	if (setsockopt(_fd, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) == -1)
+		return errno;
+
+	return 0;
+}
+
+/*
+ * Opened with no protocol, so that nothing is queued until the filter
+ * and the ring are in place, and bound to all protocols afterwards
+ */
+int pingtcp_sniffer_open(pingtcp_sniffer_t* _sniffer, const char* _interface)
+{
+	struct tpacket_req3 request;
+	struct sockaddr_ll address;
+	int version = TPACKET_V3;
+	int ret = 0;
+
+	pfcq_zero(_sniffer, sizeof(pingtcp_sniffer_t));
+	_sniffer->ring = MAP_FAILED;
+	pfcq_zero(&address, sizeof(struct sockaddr_ll));
+	address.sll_family = AF_PACKET;
+	address.sll_protocol = htons(ETH_P_ALL);
+	if (_interface)
+	{
+		address.sll_ifindex = if_nametoindex(_interface);
+		if (address.sll_ifindex == 0)
+			return ENODEV;
+	}
+
+	_sniffer->fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (_sniffer->fd == -1)
+		return errno;
+
+	_sniffer->loopback = __loopback_index(_sniffer->fd);
+	ret = __sniffer_filter(_sniffer->fd, _sniffer->loopback);
+	if (ret)
+		goto fail;
+
+	if (setsockopt(_sniffer->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1)
+	{
+		ret = errno;
+		goto fail;
+	}
+
+	pfcq_zero(&request, sizeof(struct tpacket_req3));
+	request.tp_block_size = SNIFFER_BLOCK_SIZE;
+	request.tp_block_nr = SNIFFER_BLOCKS;
+	request.tp_frame_size = SNIFFER_FRAME_SIZE;
+	request.tp_frame_nr = SNIFFER_BLOCK_SIZE / SNIFFER_FRAME_SIZE * SNIFFER_BLOCKS;
+	/* Retired partially filled, so that a trickle of handshakes is seen in time */
+	request.tp_retire_blk_tov = SNIFFER_BLOCK_TIMEOUT_MS;
+	if (setsockopt(_sniffer->fd, SOL_PACKET, PACKET_RX_RING, &request, sizeof(request)) == -1)
+	{
+		ret = errno;
+		goto fail;
+	}
+
+	_sniffer->block_size = SNIFFER_BLOCK_SIZE;
+	_sniffer->blocks = SNIFFER_BLOCKS;
+	_sniffer->ring_size = _sniffer->block_size * _sniffer->blocks;
+	_sniffer->ring = mmap(NULL, _sniffer->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, _sniffer->fd, 0);
+	if (_sniffer->ring == MAP_FAILED)
+		_sniffer->ring = mmap(NULL, _sniffer->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, _sniffer->fd, 0);
+	if (_sniffer->ring == MAP_FAILED)
+	{
+		ret = errno;
+		goto fail;
+	}
+
+	if (bind(_sniffer->fd, (struct sockaddr*)&address, sizeof(struct sockaddr_ll)) == -1)
+	{
+		ret = errno;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	pingtcp_sniffer_close(_sniffer);
+
+	return ret;
+}
+
+/*
+ * Parses every block the kernel has retired, returns the number of packets.
+ * Packets on loopback are both sent and received here, and only their
+ * inbound copies pass the filter, so they count as sent by this host
+ */
+size_t pingtcp_sniffer_read(pingtcp_sniffer_t* _sniffer, pingtcp_passive_t* _passive)
+{
+	size_t ret = 0;
+
+	for (;;)
+	{
+		struct tpacket_block_desc* block = (struct tpacket_block_desc*)(_sniffer->ring + _sniffer->current * _sniffer->block_size);
+		struct tpacket3_hdr* packet = NULL;
+		uint32_t count = 0;
+
+		if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+			break;
+
+		count = block->hdr.bh1.num_pkts;
+		packet = (struct tpacket3_hdr*)((uint8_t*)block + block->hdr.bh1.offset_to_first_pkt);
+		for (uint32_t i = 0; i < count; i++)
+		{
+			const struct sockaddr_ll* link = (const struct sockaddr_ll*)((uint8_t*)packet + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+			int inbound = link->sll_pkttype != PACKET_OUTGOING && (unsigned int)link->sll_ifindex != _sniffer->loopback;
+
+			pingtcp_passive_ip(_passive, (const uint8_t*)packet + packet->tp_net, packet->tp_snaplen, inbound,
+					(int64_t)packet->tp_sec * 1000000000LL + packet->tp_nsec);
+			packet = (struct tpacket3_hdr*)((uint8_t*)packet + packet->tp_next_offset);
+		}
+		ret += count;
+
+		/* Handed back to the kernel */
+		__atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		_sniffer->current = (_sniffer->current + 1) % _sniffer->blocks;
+	}
+	_sniffer->packets += ret;
+
+	return ret;
+}
+
+/* The kernel resets its counters on every read, so they are summed up here */
+void pingtcp_sniffer_stats(pingtcp_sniffer_t* _sniffer)
+{
+	struct tpacket_stats_v3 stats;
+	socklen_t length = sizeof(stats);
+
+	pfcq_zero(&stats, sizeof(stats));
+	if (unlikely(getsockopt(_sniffer->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &length) == -1))
+		panic("getsockopt");
+	_sniffer->drops += stats.tp_drops;
+
+	return;
+}
+
+void pingtcp_sniffer_close(pingtcp_sniffer_t* _sniffer)
+{
+	if (_sniffer->ring != MAP_FAILED && _sniffer->ring)
+		if (unlikely(munmap(_sniffer->ring, _sniffer->ring_size) == -1))
+			panic("munmap");
+	if (_sniffer->fd != -1)
+		if (unlikely(close(_sniffer->fd) == -1))
+			panic("close");
+	_sniffer->ring = NULL;
+	_sniffer->fd = -1;
+
+	return;
+}
@@ -0,0 +1,62 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifndef __SNIFFER_H__
+#define __SNIFFER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "passive.h"
+
+#define SNIFFER_BLOCK_SIZE		(1 << 20)
+#define SNIFFER_BLOCKS			64
+#define SNIFFER_FRAME_SIZE		2048
+#define SNIFFER_BLOCK_TIMEOUT_MS	10
+#define SNIFFER_SNAPLEN			128
+
+/*
+ * AF_PACKET socket with a TPACKET_V3 ring of SNIFFER_BLOCKS blocks.
+ * The kernel filters packets down to TCP SYNs, SYN-ACKs and RSTs
+ * and copies their headers straight into the ring, where they are
+ * parsed in place and handed back block by block
+ */
+typedef struct pingtcp_sniffer
+{
+	int fd;
+	unsigned int loopback;
+	uint8_t* ring;
+	size_t ring_size;
+	size_t block_size;
+	size_t blocks;
+	size_t current;
+	uint64_t packets;
+	uint64_t drops;
+} pingtcp_sniffer_t;
+
+/* A NULL interface means all of them. Returns 0 or the errno value of what failed */
+int pingtcp_sniffer_open(pingtcp_sniffer_t* _sniffer, const char* _interface) __attribute__((nonnull(1), warn_unused_result));
+size_t pingtcp_sniffer_read(pingtcp_sniffer_t* _sniffer, pingtcp_passive_t* _passive) __attribute__((nonnull(1, 2)));
+void pingtcp_sniffer_stats(pingtcp_sniffer_t* _sniffer) __attribute__((nonnull(1)));
+void pingtcp_sniffer_close(pingtcp_sniffer_t* _sniffer) __attribute__((nonnull(1)));
+
+#endif /* __SNIFFER_H__ */
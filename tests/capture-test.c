@@ -0,0 +1,329 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+#define PACKET_SIZE		40
+#define PACKETS			5
+#define TS_BASE_S		1700000000LL
+#define TIMEOUT_NS		1000000000LL
+
+#define TCP_SYN			0x02
+#define TCP_RST			0x04
+#define TCP_ACK			0x10
+
+/* A capture being put together in memory */
+typedef struct capture
+{
+	uint8_t data[4096];
+	size_t size;
+	int swapped;
+} capture_t;
+
+/*
+ * Two handshakes from 10.0.0.1 to 10.0.0.2: port 80 completes in 3 ms,
+ * port 81 is refused in 0.25 ms. The last ACK is what a cut capture loses
+ */
+static const struct
+{
+	int from_client;
+	uint16_t client_port;
+	uint16_t server_port;
+	uint8_t flags;
+	int64_t offset_us;
+} trace[PACKETS] = {
+	{ 1, 40000, 80, TCP_SYN, 0 },
+	{ 0, 40000, 80, TCP_SYN | TCP_ACK, 1000 },
+	{ 1, 40001, 81, TCP_SYN, 1200 },
+	{ 0, 40001, 81, TCP_RST | TCP_ACK, 1450 },
+	{ 1, 40000, 80, TCP_ACK, 3000 },
+};
+
+static void __put(capture_t* _capture, const void* _data, size_t _length)
+{
+	memcpy(_capture->data + _capture->size, _data, _length);
+	_capture->size += _length;
+
+	return;
+}
+
+static void __put16(capture_t* _capture, uint16_t _value)
+{
+	if (_capture->swapped)
+		_value = __builtin_bswap16(_value);
+	__put(_capture, &_value, sizeof(uint16_t));
+
+	return;
+}
+
+static void __put32(capture_t* _capture, uint32_t _value)
+{
+	if (_capture->swapped)
+		_value = __builtin_bswap32(_value);
+	__put(_capture, &_value, sizeof(uint32_t));
+
+	return;
+}
+
+/* IPv4 and TCP headers without options, checksums left out since nothing verifies them */
+static void __packet(uint8_t* _to, size_t _index)
+{
+	uint8_t client[4] = { 10, 0, 0, 1 };
+	uint8_t server[4] = { 10, 0, 0, 2 };
+	uint16_t src_port = trace[_index].from_client ? trace[_index].client_port : trace[_index].server_port;
+	uint16_t dst_port = trace[_index].from_client ? trace[_index].server_port : trace[_index].client_port;
+
+	memset(_to, 0, PACKET_SIZE);
+	_to[0] = 0x45;
+	_to[3] = PACKET_SIZE;
+	_to[8] = 64;
+	_to[9] = 6;
+	memcpy(_to + 12, trace[_index].from_client ? client : server, 4);
+	memcpy(_to + 16, trace[_index].from_client ? server : client, 4);
+	_to[20] = src_port >> 8;
+	_to[21] = src_port & 0xff;
+	_to[22] = dst_port >> 8;
+	_to[23] = dst_port & 0xff;
+	/* Distinct ISNs, so that every SYN starts an attempt of its own */
+	_to[24] = (uint8_t)(_index + 1);
+	_to[32] = 0x50;
+	_to[33] = trace[_index].flags;
+
+	return;
+}
+
+/* Ethernet frames or bare IP packets, in microseconds or nanoseconds */
+static void __pcap(capture_t* _capture, int _swapped, int _nanoseconds, int _ethernet, size_t _packets)
+{
+	static const uint8_t ethernet[14] = { 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 6, 0x08, 0x00 };
+	uint8_t packet[PACKET_SIZE];
+	size_t header = _ethernet ? sizeof(ethernet) : 0;
+
+	pfcq_zero(_capture, sizeof(capture_t));
+	_capture->swapped = _swapped;
+	__put32(_capture, _nanoseconds ? 0xa1b23c4d : 0xa1b2c3d4);
+	__put16(_capture, 2);
+	__put16(_capture, 4);
+	__put32(_capture, 0);
+	__put32(_capture, 0);
+	__put32(_capture, 65535);
+	__put32(_capture, _ethernet ? 1 : 101);
+
+	for (size_t i = 0; i < _packets; i++)
+	{
+		__packet(packet, i);
+		__put32(_capture, TS_BASE_S);
+		__put32(_capture, (uint32_t)(_nanoseconds ? trace[i].offset_us * 1000 : trace[i].offset_us));
+		__put32(_capture, header + PACKET_SIZE);
+		__put32(_capture, header + PACKET_SIZE);
+		__put(_capture, ethernet, header);
+		__put(_capture, packet, PACKET_SIZE);
+	}
+
+	return;
+}
+
+/* One section with a bare IP interface, nanosecond timestamps and a block of an unknown type in between */
+static void __pcapng(capture_t* _capture, int _swapped)
+{
+	static const uint8_t tsresol[4] = { 9, 0, 0, 0 };
+	static const uint8_t unknown[4] = { 0 };
+	uint8_t packet[PACKET_SIZE];
+
+	pfcq_zero(_capture, sizeof(capture_t));
+	_capture->swapped = _swapped;
+
+	__put32(_capture, 0x0a0d0d0a);
+	__put32(_capture, 28);
+	__put32(_capture, 0x1a2b3c4d);
+	__put16(_capture, 1);
+	__put16(_capture, 0);
+	__put32(_capture, 0xffffffff);
+	__put32(_capture, 0xffffffff);
+	__put32(_capture, 28);
+
+	__put32(_capture, 0x00000001);
+	__put32(_capture, 32);
+	__put16(_capture, 101);
+	__put16(_capture, 0);
+	__put32(_capture, 65535);
+	/* if_tsresol of 10^-9, padded to four bytes, then opt_endofopt */
+	__put16(_capture, 9);
+	__put16(_capture, 1);
+	__put(_capture, tsresol, sizeof(tsresol));
+	__put32(_capture, 0);
+	__put32(_capture, 32);
+
+	__put32(_capture, 0x00000bad);
+	__put32(_capture, 16);
+	__put(_capture, unknown, sizeof(unknown));
+	__put32(_capture, 16);
+
+	for (size_t i = 0; i < PACKETS; i++)
+	{
+		uint64_t ts = (uint64_t)TS_BASE_S * 1000000000ULL + (uint64_t)trace[i].offset_us * 1000ULL;
+
+		__packet(packet, i);
+		__put32(_capture, 0x00000006);
+		__put32(_capture, 32 + PACKET_SIZE);
+		__put32(_capture, 0);
+		__put32(_capture, (uint32_t)(ts >> 32));
+		__put32(_capture, (uint32_t)ts);
+		__put32(_capture, PACKET_SIZE);
+		__put32(_capture, PACKET_SIZE);
+		__put(_capture, packet, PACKET_SIZE);
+		__put32(_capture, 32 + PACKET_SIZE);
+	}
+
+	return;
+}
+
+/* Kept in an anonymous memory file, which the reader opens by its /proc path */
+static int __read(const char* _name, const uint8_t* _data, size_t _size, pingtcp_passive_t* _passive)
+{
+	char path[64];
+	int fd = memfd_create(_name, MFD_CLOEXEC);
+	int ret = 0;
+
+	if (unlikely(fd == -1))
+		panic("memfd_create");
+	if (unlikely(write(fd, _data, _size) != (ssize_t)_size))
+		panic("write");
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+	pingtcp_passive_init(_passive, TIMEOUT_NS);
+	ret = pingtcp_capture_read(path, _passive);
+	pingtcp_passive_finish(_passive);
+
+	if (unlikely(close(fd) == -1))
+		panic("close");
+
+	return ret;
+}
+
+static const pingtcp_stats_t* __destination(const pingtcp_passive_t* _passive, uint16_t _port)
+{
+	for (size_t i = 0; i < _passive->count; i++)
+		if (_passive->destinations[i].port == _port && strcmp(_passive->destinations[i].host, "10.0.0.2") == 0)
+			return &_passive->stats[i];
+
+	return NULL;
+}
+
+static int __check(const char* _name, const char* _what, double _got, double _expected)
+{
+	if (fabs(_got - _expected) <= 1e-6)
+		return 0;
+
+	fprintf(stderr, "%s: %s is %1.6lf, expected %1.6lf\n", _name, _what, _got, _expected);
+
+	return 1;
+}
+
+/* Both handshakes are found and timed, or only the refused one in a cut capture */
+static int __verify(const char* _name, const capture_t* _capture, size_t _size, int _complete)
+{
+	pingtcp_passive_t passive;
+	const pingtcp_stats_t* stats = NULL;
+	int ret = 0;
+	int res = __read(_name, _capture->data, _size, &passive);
+
+	if (res != 0)
+	{
+		fprintf(stderr, "%s: %s\n", _name, strerror(res));
+		pingtcp_passive_done(&passive);
+		return 1;
+	}
+
+	ret |= __check(_name, "packets", passive.packets, _complete ? PACKETS : PACKETS - 1);
+	ret |= __check(_name, "destinations", passive.count, 2);
+	ret |= __check(_name, "undecided", passive.undecided, _complete ? 0 : 1);
+	ret |= __check(_name, "first", passive.first_ns, TS_BASE_S * 1000000000LL);
+
+	stats = __destination(&passive, 80);
+	if (stats)
+	{
+		ret |= __check(_name, "port 80 ok", stats->ok, _complete ? 1 : 0);
+		ret |= __check(_name, "port 80 attempts", stats->attempt, _complete ? 1 : 0);
+		if (_complete)
+			ret |= __check(_name, "port 80 rtt", stats->rtt_min, 3.0);
+	} else
+	{
+		fprintf(stderr, "%s: port 80 is missing\n", _name);
+		ret = 1;
+	}
+
+	stats = __destination(&passive, 81);
+	if (stats)
+	{
+		ret |= __check(_name, "port 81 refused", stats->failures[PINGTCP_FAILURE_REFUSED].count, 1);
+		ret |= __check(_name, "port 81 time to fail", stats->failures[PINGTCP_FAILURE_REFUSED].time_min, 0.25);
+	} else
+	{
+		fprintf(stderr, "%s: port 81 is missing\n", _name);
+		ret = 1;
+	}
+
+	pingtcp_passive_done(&passive);
+
+	return ret;
+}
+
+int main(void)
+{
+	static const uint8_t garbage[32] = "this is not a capture at all...";
+	capture_t capture;
+	pingtcp_passive_t passive;
+	int ret = 0;
+	int res = 0;
+
+	__pcap(&capture, 0, 0, 1, PACKETS);
+	ret |= __verify("pcap ethernet", &capture, capture.size, 1);
+	__pcap(&capture, 1, 1, 0, PACKETS);
+	ret |= __verify("pcap swapped nanoseconds", &capture, capture.size, 1);
+	__pcapng(&capture, 0);
+	ret |= __verify("pcapng", &capture, capture.size, 1);
+	__pcapng(&capture, 1);
+	ret |= __verify("pcapng swapped", &capture, capture.size, 1);
+
+	/* Stopped writers leave a packet half written, which is left out */
+	__pcap(&capture, 0, 0, 0, PACKETS);
+	ret |= __verify("pcap cut", &capture, capture.size - PACKET_SIZE / 2, 0);
+	__pcapng(&capture, 0);
+	ret |= __verify("pcapng cut", &capture, capture.size - 8, 0);
+
+	res = __read("garbage", garbage, sizeof(garbage), &passive);
+	pingtcp_passive_done(&passive);
+	if (res != EINVAL)
+	{
+		fprintf(stderr, "garbage: got %s, expected %s\n", strerror(res), strerror(EINVAL));
+		ret = 1;
+	}
+
+	exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,205 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compare.h"
+
+static int __check(const char* _name, double _got, double _expected, double _tolerance)
+{
+	if (fabs(_got - _expected) <= _tolerance)
+		return 0;
+
+	fprintf(stderr, "%s: got %1.9lf, expected %1.9lf +- %1.9lf\n", _name, _got, _expected, _tolerance);
+
+	return 1;
+}
+
+static int __compare_double(const void* _a, const void* _b)
+{
+	double a = *(const double*)_a;
+	double b = *(const double*)_b;
+
+	return (a > b) - (a < b);
+}
+
+static void __fill(pingtcp_samples_t* _samples, const double* _values, size_t _count)
+{
+	pfcq_zero(_samples, sizeof(pingtcp_samples_t));
+	for (size_t i = 0; i < _count; i++)
+		pingtcp_samples_add(_samples, _values[i]);
+
+	return;
+}
+
+/* Expected values come from counting pairs directly, with the tie-corrected variance */
+static int __rank_test(const char* _name, const double* _a, size_t _a_count, const double* _b, size_t _b_count,
+		double _u, double _z, double _p, double _superiority)
+{
+	pingtcp_samples_t a;
+	pingtcp_samples_t b;
+	pingtcp_rank_test_t test;
+	char name[64];
+	int ret = 0;
+
+	__fill(&a, _a, _a_count);
+	__fill(&b, _b, _b_count);
+	pingtcp_compare_rank_test(&a, &b, &test);
+
+	snprintf(name, sizeof(name), "%s u", _name);
+	ret |= __check(name, test.u, _u, 1e-9);
+	snprintf(name, sizeof(name), "%s z", _name);
+	ret |= __check(name, test.z, _z, 1e-9);
+	snprintf(name, sizeof(name), "%s p", _name);
+	ret |= __check(name, test.p, _p, 1e-9);
+	snprintf(name, sizeof(name), "%s superiority", _name);
+	ret |= __check(name, test.superiority, _superiority, 1e-9);
+
+	pingtcp_samples_free(&b);
+	pingtcp_samples_free(&a);
+
+	return ret;
+}
+
+/* Without resampling, quickselect must agree with the nearest rank of a sorted copy */
+static int __quantiles(const char* _name, const double* _quantiles, size_t _count, size_t _samples, unsigned int _distinct)
+{
+	pingtcp_samples_t a;
+	pingtcp_samples_t b;
+	pingtcp_delta_t deltas[8];
+	pfcq_fprng_context_t prng;
+	double* sorted = pfcq_alloc(_samples * sizeof(double));
+	char name[64];
+	int ret = 0;
+
+	pfcq_zero(&a, sizeof(pingtcp_samples_t));
+	pfcq_zero(&b, sizeof(pingtcp_samples_t));
+	pfcq_fprng_init(&prng);
+	for (size_t i = 0; i < _samples; i++)
+	{
+		pingtcp_samples_add(&a, (double)(pfcq_fprng_get_u64(&prng) % _distinct));
+		pingtcp_samples_add(&b, 0);
+	}
+	memcpy(sorted, a.values, _samples * sizeof(double));
+	qsort(sorted, _samples, sizeof(double), __compare_double);
+
+	pingtcp_compare_deltas(&a, &b, _quantiles, _count, 0, &prng, deltas);
+	for (size_t i = 0; i < _count; i++)
+	{
+		size_t rank = (size_t)(_quantiles[i] * (double)_samples + 0.5);
+
+		if (rank < 1)
+			rank = 1;
+		if (rank > _samples)
+			rank = _samples;
+		snprintf(name, sizeof(name), "%s q%1.2lf", _name, _quantiles[i]);
+		ret |= __check(name, deltas[i].a, sorted[rank - 1], 0);
+		ret |= __check(name, deltas[i].delta, -sorted[rank - 1], 0);
+		ret |= __check(name, deltas[i].upper - deltas[i].lower, 0, 0);
+	}
+
+	pfcq_free(sorted);
+	pingtcp_samples_free(&b);
+	pingtcp_samples_free(&a);
+
+	return ret;
+}
+
+int main(void)
+{
+	static const double ascending[] = { 0.0, 0.01, 0.25, 0.5, 0.5, 0.9, 0.99, 1.0 };
+	static const double unordered[] = { 0.99, 0.5, 0.9, 0.1 };
+	static const double percentiles[] = { 0.5, 0.9, 0.99 };
+	static const double low[] = { 1, 2, 3, 4, 5 };
+	static const double high[] = { 6, 7, 8, 9, 10 };
+	static const double tied_a[] = { 1, 1, 1, 1, 2, 2, 2, 3 };
+	static const double tied_b[] = { 1, 2, 2, 3, 3, 3, 3, 3 };
+	double twos_a[25];
+	double twos_b[25];
+	double same[10];
+	pingtcp_samples_t a;
+	pingtcp_samples_t b;
+	pingtcp_delta_t deltas[3];
+	pfcq_fprng_context_t prng;
+	int ret = 0;
+
+	/* No overlap at all */
+	ret |= __rank_test("separated", low, 5, high, 5, 0, -2.506718245762049, 0.012185780355344818, 1);
+	ret |= __rank_test("separated reversed", high, 5, low, 5, 25, 2.506718245762049, 0.012185780355344818, 0);
+
+	/* Few distinct values, so that most ranks are shared */
+	ret |= __rank_test("tied", tied_a, 8, tied_b, 8, 13.5, -2.004127971368055, 0.04505635380146355, 0.7890625);
+	for (size_t i = 0; i < 25; i++)
+	{
+		twos_a[i] = i < 20 ? 5 : 6;
+		twos_b[i] = i < 10 ? 5 : 6;
+	}
+	ret |= __rank_test("two values", twos_a, 25, twos_b, 25, 187.5, -2.8463070811140527, 0.00442295199887756, 0.7);
+
+	/* Every value the same leaves no variance, which is no evidence of a difference */
+	for (size_t i = 0; i < 10; i++)
+		same[i] = 7;
+	ret |= __rank_test("identical", same, 10, same, 10, 50, 0, 1, 0.5);
+
+	ret |= __quantiles("ascending", ascending, sizeof(ascending) / sizeof(double), 1001, 1000000);
+	ret |= __quantiles("ties", ascending, sizeof(ascending) / sizeof(double), 1000, 5);
+	ret |= __quantiles("unordered", unordered, sizeof(unordered) / sizeof(double), 777, 50);
+	ret |= __quantiles("single", ascending, sizeof(ascending) / sizeof(double), 1, 10);
+
+	/* Constant sets resample into themselves, so the interval collapses onto the difference */
+	pfcq_fprng_init(&prng);
+	pfcq_zero(&a, sizeof(pingtcp_samples_t));
+	pfcq_zero(&b, sizeof(pingtcp_samples_t));
+	for (size_t i = 0; i < 100; i++)
+	{
+		pingtcp_samples_add(&a, 10);
+		pingtcp_samples_add(&b, 15);
+	}
+	pingtcp_compare_deltas(&a, &b, percentiles, 3, COMPARE_RESAMPLES, &prng, deltas);
+	for (size_t i = 0; i < 3; i++)
+	{
+		ret |= __check("constant delta", deltas[i].delta, 5, 0);
+		ret |= __check("constant lower", deltas[i].lower, 5, 0);
+		ret |= __check("constant upper", deltas[i].upper, 5, 0);
+	}
+	pingtcp_samples_free(&b);
+	pingtcp_samples_free(&a);
+
+	/* B is A shifted by 5 ms: the median interval holds 5 and stays narrow for 2000 samples */
+	for (size_t i = 0; i < 2000; i++)
+	{
+		pingtcp_samples_add(&a, 20.0 + (double)(i % 100) / 10.0);
+		pingtcp_samples_add(&b, 25.0 + (double)(i % 100) / 10.0);
+	}
+	pingtcp_compare_deltas(&a, &b, percentiles, 1, COMPARE_RESAMPLES, &prng, deltas);
+	ret |= __check("shifted delta", deltas[0].delta, 5, 1e-9);
+	if (!(deltas[0].lower <= 5.0 && deltas[0].upper >= 5.0 && deltas[0].upper - deltas[0].lower < 2.0))
+	{
+		fprintf(stderr, "shifted interval: got %1.3lf..%1.3lf, expected around 5 and narrower than 2\n", deltas[0].lower, deltas[0].upper);
+		ret = 1;
+	}
+	pingtcp_samples_free(&b);
+	pingtcp_samples_free(&a);
+
+	exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,65 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "histogram.h"
+
+static int __check(const char* _name, double _got, double _expected, double _tolerance)
+{
+	if (fabs(_got - _expected) <= _tolerance)
+		return 0;
+
+	fprintf(stderr, "%s: got %1.3lf ms, expected %1.3lf +- %1.3lf ms\n", _name, _got, _expected, _tolerance);
+
+	return 1;
+}
+
+int main(void)
+{
+	uint64_t histogram[HISTOGRAM_BUCKETS] = { 0 };
+	int ret = 0;
+
+	/* A steady target: 200 samples spread over 20.00..20.09 ms */
+	for (size_t i = 0; i < 200; i++)
+		pingtcp_histogram_add(histogram, 20.0 + (double)(i % 10) / 100.0);
+	ret |= __check("steady p50", pingtcp_histogram_quantile(histogram, 0.5, 20.0, 20.09), 20.045, 0.05);
+	ret |= __check("steady p90", pingtcp_histogram_quantile(histogram, 0.9, 20.0, 20.09), 20.081, 0.05);
+	ret |= __check("steady p99", pingtcp_histogram_quantile(histogram, 0.99, 20.0, 20.09), 20.09, 0.05);
+
+	/* Uniform over 1..100 ms, so every quantile is within the bucket width of the exact one */
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+		histogram[i] = 0;
+	for (size_t i = 1; i <= 10000; i++)
+		pingtcp_histogram_add(histogram, (double)i / 100.0);
+	ret |= __check("uniform p50", pingtcp_histogram_quantile(histogram, 0.5, 0.01, 100.0), 50.0, 50.0 / HISTOGRAM_SUBS / 2);
+	ret |= __check("uniform p90", pingtcp_histogram_quantile(histogram, 0.9, 0.01, 100.0), 90.0, 90.0 / HISTOGRAM_SUBS / 2);
+	ret |= __check("uniform p99", pingtcp_histogram_quantile(histogram, 0.99, 0.01, 100.0), 99.0, 99.0 / HISTOGRAM_SUBS / 2);
+
+	/* Never beyond the times seen */
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+		histogram[i] = 0;
+	pingtcp_histogram_add(histogram, 1000.0);
+	ret |= __check("single", pingtcp_histogram_quantile(histogram, 0.99, 1000.0, 1000.0), 1000.0, 0);
+
+	exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+}
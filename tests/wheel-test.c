@@ -0,0 +1,93 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "contrib/pfcq/pfcq.h"
+#include "wheel.h"
+
+#define TICK_NS		1000000LL
+
+typedef struct rearm
+{
+	pingtcp_timer_t timer;
+	int64_t period_ns;
+	size_t fired;
+	int64_t fired_ns[4];
+} rearm_t;
+
+static void __rearm(pingtcp_timer_t* _timer, int64_t _now_ns, void* _data)
+{
+	pingtcp_wheel_t* wheel = _data;
+	rearm_t* rearm = pingtcp_container_of(_timer, rearm_t, timer);
+
+	if (rearm->fired < sizeof(rearm->fired_ns) / sizeof(rearm->fired_ns[0]))
+		rearm->fired_ns[rearm->fired] = _now_ns;
+	rearm->fired++;
+	pingtcp_wheel_add(wheel, _timer, _now_ns + rearm->period_ns);
+
+	return;
+}
+
+/* Re-armed from its handler with the given period, the timer must fire exactly once per period */
+static int __check(int64_t _period_ticks)
+{
+	pingtcp_wheel_t wheel;
+	rearm_t rearm;
+	int64_t now_ns = 0;
+
+	pingtcp_wheel_init(&wheel, 0, TICK_NS, &wheel);
+	pfcq_zero(&rearm, sizeof(rearm_t));
+	pingtcp_timer_init(&rearm.timer, __rearm);
+	rearm.period_ns = _period_ticks * TICK_NS;
+	pingtcp_wheel_add(&wheel, &rearm.timer, 10 * TICK_NS);
+
+	for (now_ns = 0; now_ns <= 10 * TICK_NS + 3 * rearm.period_ns; now_ns += TICK_NS)
+		pingtcp_wheel_advance(&wheel, now_ns);
+
+	if (rearm.fired != 4)
+	{
+		fprintf(stderr, "period %ld ticks: fired %lu time(s) instead of 4\n", _period_ticks, rearm.fired);
+		return 1;
+	}
+	for (size_t i = 0; i < 4; i++)
+	{
+		if (rearm.fired_ns[i] != 10 * TICK_NS + (int64_t)i * rearm.period_ns)
+		{
+			fprintf(stderr, "period %ld ticks: firing %lu at %ld ns\n", _period_ticks, i, rearm.fired_ns[i]);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	static const int64_t periods[] = { 1, 255, 256, 257, 511, 512, 65536, 70000 };
+	int ret = 0;
+
+	/* One revolution of a level ahead lands in the very slot being expired */
+	for (size_t i = 0; i < sizeof(periods) / sizeof(periods[0]); i++)
+		ret |= __check(periods[i]);
+
+	exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,181 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <string.h>
+
+#include "contrib/pfcq/pfcq.h"
+#include "tls.h"
+
+/* The newest session replaces whatever the slot holds */
+static int __tls_session_new(SSL* _ssl, SSL_SESSION* _session)
+{
+	SSL_SESSION** slot = SSL_get_app_data(_ssl);
+
+	if (unlikely(!slot))
+		return 0;
+	if (*slot)
+		SSL_SESSION_free(*slot);
+	*slot = _session;
+
+	return 1;
+}
+
+/* SNI is only sent for names, never for addresses */
+static int __tls_is_address(const char* _dst)
+{
+	struct in6_addr address;
+
+	return inet_pton(AF_INET, _dst, &address) == 1 || inet_pton(AF_INET6, _dst, &address) == 1;
+}
+
+int pingtcp_tls_init(pingtcp_tls_t* _tls, const char* _server_name)
+{
+	pfcq_zero(_tls, sizeof(pingtcp_tls_t));
+
+	_tls->ctx = SSL_CTX_new(TLS_client_method());
+	if (unlikely(!_tls->ctx))
+		return ENOMEM;
+
+	SSL_CTX_set_verify(_tls->ctx, SSL_VERIFY_NONE, NULL);
+	/* Sessions are kept by the caller rather than in the internal cache */
+	SSL_CTX_set_session_cache_mode(_tls->ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(_tls->ctx, __tls_session_new);
+	/* Otherwise a blocking read would wait for application data past a ticket */
+	SSL_CTX_clear_mode(_tls->ctx, SSL_MODE_AUTO_RETRY);
+
+	if (_server_name)
+		_tls->server_name = pfcq_strdup(_server_name);
+
+	return 0;
+}
+
+struct ssl_st* pingtcp_tls_open(pingtcp_tls_t* _tls, int _fd, const char* _dst, struct ssl_session_st* _session, struct ssl_session_st** _ticket)
+{
+	SSL* ret = NULL;
+	const char* server_name = _tls->server_name ? _tls->server_name : _dst;
+
+	ret = SSL_new(_tls->ctx);
+	if (unlikely(!ret))
+		panic("SSL_new");
+	if (unlikely(SSL_set_fd(ret, _fd) != 1))
+		panic("SSL_set_fd");
+	SSL_set_app_data(ret, _ticket);
+	if (!__tls_is_address(server_name))
+		if (unlikely(SSL_set_tlsext_host_name(ret, server_name) != 1))
+			panic("SSL_set_tlsext_host_name");
+	if (_session)
+		if (unlikely(SSL_set_session(ret, _session) != 1))
+			panic("SSL_set_session");
+
+	return ret;
+}
+
+/* On failure, _error is the OpenSSL error code, or 0 if the connection just went away */
+pingtcp_tls_status_t pingtcp_tls_handshake(struct ssl_st* _ssl, unsigned long* _error)
+{
+	int res = 0;
+
+	ERR_clear_error();
+	res = SSL_connect(_ssl);
+	if (res == 1)
+		return PINGTCP_TLS_DONE;
+
+	switch (SSL_get_error(_ssl, res))
+	{
+		case SSL_ERROR_WANT_READ:
+			return PINGTCP_TLS_WANT_READ;
+		case SSL_ERROR_WANT_WRITE:
+			return PINGTCP_TLS_WANT_WRITE;
+		default:
+			*_error = ERR_get_error();
+			return PINGTCP_TLS_ERROR;
+	}
+}
+
+/* Processes whatever the server sent after the handshake, application data ending it */
+pingtcp_tls_status_t pingtcp_tls_read(struct ssl_st* _ssl)
+{
+	uint8_t byte = 0;
+	int res = 0;
+
+	ERR_clear_error();
+	res = SSL_read(_ssl, &byte, sizeof(byte));
+	if (res > 0)
+		return PINGTCP_TLS_DONE;
+
+	switch (SSL_get_error(_ssl, res))
+	{
+		case SSL_ERROR_WANT_READ:
+			return PINGTCP_TLS_WANT_READ;
+		case SSL_ERROR_WANT_WRITE:
+			return PINGTCP_TLS_WANT_WRITE;
+		default:
+			return PINGTCP_TLS_ERROR;
+	}
+}
+
+int pingtcp_tls_resumed(const struct ssl_st* _ssl)
+{
+	return SSL_session_reused(_ssl);
+}
+
+int pingtcp_tls_tickets_later(const struct ssl_st* _ssl)
+{
+	return SSL_version(_ssl) >= TLS1_3_VERSION;
+}
+
+const char* pingtcp_tls_reason(unsigned long _error)
+{
+	const char* ret = _error ? ERR_reason_error_string(_error) : NULL;
+
+	return ret ? ret : "connection closed";
+}
+
+/* Announced, but not waited for, since the socket is closed right after */
+void pingtcp_tls_close(struct ssl_st* _ssl)
+{
+	if (SSL_is_init_finished(_ssl))
+		SSL_shutdown(_ssl);
+	SSL_free(_ssl);
+	ERR_clear_error();
+
+	return;
+}
+
+void pingtcp_tls_session_free(struct ssl_session_st* _session)
+{
+	SSL_SESSION_free(_session);
+
+	return;
+}
+
+void pingtcp_tls_done(pingtcp_tls_t* _tls)
+{
+	SSL_CTX_free(_tls->ctx);
+	if (_tls->server_name)
+		pfcq_free(_tls->server_name);
+	pfcq_zero(_tls, sizeof(pingtcp_tls_t));
+
+	return;
+}
@@ -0,0 +1,64 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifndef __TLS_H__
+#define __TLS_H__
+
+#include <stdint.h>
+
+struct ssl_ctx_st;
+struct ssl_st;
+struct ssl_session_st;
+
+typedef enum pingtcp_tls_status
+{
+	PINGTCP_TLS_DONE = 0,
+	PINGTCP_TLS_WANT_READ,
+	PINGTCP_TLS_WANT_WRITE,
+	PINGTCP_TLS_ERROR
+} pingtcp_tls_status_t;
+
+/*
+ * Client context shared by all attempts. Certificates are not verified,
+ * since only the time the handshake takes is of interest. Sessions are handed
+ * over through the slot given to pingtcp_tls_open(), whenever the server
+ * issues one: during the handshake up to TLS 1.2, and after it as a
+ * NewSessionTicket with TLS 1.3, which is what pingtcp_tls_read() waits for
+ */
+typedef struct pingtcp_tls
+{
+	struct ssl_ctx_st* ctx;
+	char* server_name;
+} pingtcp_tls_t;
+
+int pingtcp_tls_init(pingtcp_tls_t* _tls, const char* _server_name) __attribute__((nonnull(1), warn_unused_result));
+struct ssl_st* pingtcp_tls_open(pingtcp_tls_t* _tls, int _fd, const char* _dst, struct ssl_session_st* _session, struct ssl_session_st** _ticket) __attribute__((nonnull(1, 3, 5), warn_unused_result));
+pingtcp_tls_status_t pingtcp_tls_handshake(struct ssl_st* _ssl, unsigned long* _error) __attribute__((nonnull(1, 2), warn_unused_result));
+pingtcp_tls_status_t pingtcp_tls_read(struct ssl_st* _ssl) __attribute__((nonnull(1), warn_unused_result));
+int pingtcp_tls_resumed(const struct ssl_st* _ssl) __attribute__((nonnull(1), warn_unused_result));
+int pingtcp_tls_tickets_later(const struct ssl_st* _ssl) __attribute__((nonnull(1), warn_unused_result));
+const char* pingtcp_tls_reason(unsigned long _error) __attribute__((warn_unused_result));
+void pingtcp_tls_close(struct ssl_st* _ssl) __attribute__((nonnull(1)));
+void pingtcp_tls_session_free(struct ssl_session_st* _session) __attribute__((nonnull(1)));
+void pingtcp_tls_done(pingtcp_tls_t* _tls) __attribute__((nonnull(1)));
+
+#endif /* __TLS_H__ */
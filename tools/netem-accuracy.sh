@@ -0,0 +1,164 @@
+#!/usr/bin/env bash
+# vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab
+
+#
+# pingtcp - small utility to measure TCP handshake time (torify-friendly)
+# Copyright (C) 2015 Lanet Network
+# Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, version 3 of the License
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+#
+# Checks that handshake times and loss reported by pingtcp match what
+# tc netem injects. Two network namespaces are joined by a veth pair,
+# the delay and loss are applied on the listener side, so that they hit
+# SYN-ACKs only, and every profile is probed by each engine mode.
+#
+# Usage: netem-accuracy.sh [path/to/pingtcp]
+#
+# Needs root, ip, tc with netem and python3 for the listener. Exits with 0
+# if every check passes, 1 if any fails and 77 if it cannot run here.
+# SAMPLES, INTERVAL_MS and TIMEOUT_MS tune each run.
+#
+
+set -u
+
+PINGTCP="$(readlink -f "${1:-./pingtcp}")"
+SAMPLES="${SAMPLES:-200}"
+INTERVAL_MS="${INTERVAL_MS:-10}"
+TIMEOUT_MS="${TIMEOUT_MS:-500}"
+
+NS_PROBE="pingtcp-probe-$$"
+NS_TARGET="pingtcp-target-$$"
+VETH_PROBE="ptp$$"
+VETH_TARGET="ptt$$"
+ADDRESS_PROBE="10.254.0.1"
+ADDRESS_TARGET="10.254.0.2"
+PORT=18080
+
+#
+# name|netem arguments|expected p50 ms|expected p90 ms|tolerance ms|expected loss %|loss tolerance %
+# Empty fields are not checked. Baseline has no netem, so it only bounds the overhead of pingtcp itself.
+# Netem jitter is uniform by default, so the 90th percentile of 20ms +-5ms is 24ms
+#
+PROFILES=(
+	"baseline||0||1|0|0"
+	"delay|delay 20ms|20|20|1|0|0"
+	"jitter|delay 20ms 5ms|20|24|1.5|0|0"
+	"loss|delay 5ms loss 10%|5||1|10|5"
+)
+MODES=(
+	"fixed|"
+	"adaptive|-a"
+)
+
+FAILED=0
+LISTENER=""
+
+skip()
+{
+	echo "SKIP: $*" >&2
+	exit 77
+}
+
+cleanup()
+{
+	[ -n "${LISTENER}" ] && kill "${LISTENER}" 2>/dev/null
+	ip netns del "${NS_PROBE}" 2>/dev/null
+	ip netns del "${NS_TARGET}" 2>/dev/null
+}
+
+check()
+{
+	local what="$1" measured="$2" expected="$3" tolerance="$4"
+
+	[ -z "${expected}" ] && return
+	if awk -v m="${measured}" -v e="${expected}" -v t="${tolerance}" 'BEGIN { d = m - e; if (d < 0) d = -d; exit !(m == m + 0 && d <= t) }'
+	then
+		printf "PASS: %-28s %10s, expected %s +-%s\n" "${what}" "${measured}" "${expected}" "${tolerance}"
+	else
+		printf "FAIL: %-28s %10s, expected %s +-%s\n" "${what}" "${measured}" "${expected}" "${tolerance}"
+		FAILED=1
+	fi
+}
+
+[ "$(id -u)" -eq 0 ] || skip "root is needed for network namespaces"
+[ -x "${PINGTCP}" ] || skip "${PINGTCP} is not executable"
+for tool in ip tc python3 awk
+do
+	command -v "${tool}" >/dev/null || skip "${tool} is not available"
+done
+
+trap cleanup EXIT
+
+ip netns add "${NS_PROBE}" || skip "unable to create network namespaces"
+ip netns add "${NS_TARGET}"
+ip link add "${VETH_PROBE}" netns "${NS_PROBE}" type veth peer name "${VETH_TARGET}" netns "${NS_TARGET}" || skip "veth is not available"
+ip -n "${NS_PROBE}" addr add "${ADDRESS_PROBE}/24" dev "${VETH_PROBE}"
+ip -n "${NS_TARGET}" addr add "${ADDRESS_TARGET}/24" dev "${VETH_TARGET}"
+for ns in "${NS_PROBE}" "${NS_TARGET}"
+do
+	ip -n "${ns}" link set lo up
+done
+ip -n "${NS_PROBE}" link set "${VETH_PROBE}" up
+ip -n "${NS_TARGET}" link set "${VETH_TARGET}" up
+
+ip netns exec "${NS_TARGET}" tc qdisc add dev "${VETH_TARGET}" root netem delay 1ms 2>/dev/null || skip "netem is not available"
+ip netns exec "${NS_TARGET}" tc qdisc del dev "${VETH_TARGET}" root
+
+# Connections are accepted and closed right away, so that the backlog never fills up
+ip netns exec "${NS_TARGET}" python3 -c '
+import socket, sys
+s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+s.bind((sys.argv[1], int(sys.argv[2])))
+s.listen(1024)
+while True:
+	c, _ = s.accept()
+	c.close()
+' "${ADDRESS_TARGET}" "${PORT}" &
+LISTENER=$!
+sleep 1
+
+for profile in "${PROFILES[@]}"
+do
+	IFS='|' read -r name netem p50 p90 tolerance loss loss_tolerance <<< "${profile}"
+
+	if [ -n "${netem}" ]
+	then
+		# shellcheck disable=SC2086
+		ip netns exec "${NS_TARGET}" tc qdisc replace dev "${VETH_TARGET}" root netem ${netem}
+	else
+		ip netns exec "${NS_TARGET}" tc qdisc del dev "${VETH_TARGET}" root 2>/dev/null
+	fi
+
+	for mode in "${MODES[@]}"
+	do
+		IFS='|' read -r mode_name mode_args <<< "${mode}"
+
+		# shellcheck disable=SC2086
+		output="$(ip netns exec "${NS_PROBE}" "${PINGTCP}" "${ADDRESS_TARGET}" "${PORT}" \
+			-c "${SAMPLES}" -i "${INTERVAL_MS}" -t "${TIMEOUT_MS}" -q ${mode_args})"
+
+		# What pingtcp reports itself, so that its histogram quantiles are checked as well
+		IFS='/' read -r measured_p50 measured_p90 _ <<< "$(sed -n 's/^rtt p50\/p90\/p99 = //p' <<< "${output}")"
+		measured_loss="$(sed -n 's/.* succeeded, \([0-9.]*\)% loss.*/\1/p' <<< "${output}")"
+
+		check "${name}/${mode_name} p50, ms" "${measured_p50:-nan}" "${p50}" "${tolerance}"
+		check "${name}/${mode_name} p90, ms" "${measured_p90:-nan}" "${p90}" "${tolerance}"
+		check "${name}/${mode_name} loss, %" "${measured_loss}" "${loss}" "${loss_tolerance}"
+	done
+done
+
+exit "${FAILED}"
@@ -0,0 +1,265 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "wheel.h"
+
+#include "contrib/pfcq/pfcq.h"
+
+#define WHEEL_MAX_DELTA		((1ULL << (WHEEL_SLOT_BITS * WHEEL_LEVELS)) - 1)
+
+static int __wheel_find(const uint64_t* _occupied, unsigned int _from)
+{
+	for (unsigned int i = 0; i <= WHEEL_WORDS; i++)
+	{
+		unsigned int word = ((_from >> 6) + i) % WHEEL_WORDS;
+		uint64_t bits = _occupied[word];
+
+		if (i == 0)
+			bits &= ~0ULL << (_from & 63);
+		else if (i == WHEEL_WORDS)
+			bits &= ~(~0ULL << (_from & 63));
+
+		if (bits)
+			return ((word << 6) + __builtin_ctzll(bits) - _from) & WHEEL_SLOT_MASK;
+	}
+
+	return -1;
+}
+
+static void __wheel_place(pingtcp_wheel_t* _wheel, pingtcp_timer_t* _timer)
+{
+	uint64_t expires = _timer->expires;
+	uint64_t delta = 0;
+	unsigned short int level = 0;
+
+	if (expires < _wheel->now)
+		expires = _wheel->now;
+	delta = expires - _wheel->now;
+	/* Too far away; parked in the last level and placed again on cascade */
+	if (unlikely(delta > WHEEL_MAX_DELTA))
+	{
+		delta = WHEEL_MAX_DELTA;
+		expires = _wheel->now + delta;
+	}
+
+	while (level < WHEEL_LEVELS - 1 && delta >= 1ULL << (WHEEL_SLOT_BITS * (level + 1)))
+		level++;
+
+	_timer->level = level;
+	_timer->slot = (expires >> (WHEEL_SLOT_BITS * level)) & WHEEL_SLOT_MASK;
+	_timer->next = _wheel->slots[level][_timer->slot];
+	if (_timer->next)
+		_timer->next->pprev = &_timer->next;
+	_timer->pprev = &_wheel->slots[level][_timer->slot];
+	_wheel->slots[level][_timer->slot] = _timer;
+	_wheel->occupied[level][_timer->slot >> 6] |= 1ULL << (_timer->slot & 63);
+
+	return;
+}
+
+static pingtcp_timer_t* __wheel_detach(pingtcp_wheel_t* _wheel, unsigned short int _level, unsigned short int _slot)
+{
+	pingtcp_timer_t* ret = _wheel->slots[_level][_slot];
+
+	_wheel->slots[_level][_slot] = NULL;
+	_wheel->occupied[_level][_slot >> 6] &= ~(1ULL << (_slot & 63));
+
+	return ret;
+}
+
+static void __wheel_cascade(pingtcp_wheel_t* _wheel, unsigned short int _level, unsigned short int _slot)
+{
+	pingtcp_timer_t* current = __wheel_detach(_wheel, _level, _slot);
+
+	while (current)
+	{
+		pingtcp_timer_t* next = current->next;
+		__wheel_place(_wheel, current);
+		current = next;
+	}
+
+	return;
+}
+
+static uint64_t __wheel_next_tick(const pingtcp_wheel_t* _wheel)
+{
+	uint64_t ret = UINT64_MAX;
+	int distance = 0;
+
+	distance = __wheel_find(_wheel->occupied[0], _wheel->now & WHEEL_SLOT_MASK);
+	if (distance >= 0)
+		ret = _wheel->now + distance;
+
+	for (unsigned short int level = 1; level < WHEEL_LEVELS; level++)
+	{
+		unsigned int shift = WHEEL_SLOT_BITS * level;
+		unsigned int current = (_wheel->now >> shift) & WHEEL_SLOT_MASK;
+
+		uint64_t cascade = 0;
+
+		/*
+		 * Unless the wheel stands right at its boundary, the current slot
+		 * of an upper level has been cascaded already and is due one revolution later
+		 */
+		if ((_wheel->now & ((1ULL << shift) - 1)) == 0)
+		{
+			distance = __wheel_find(_wheel->occupied[level], current);
+			if (distance < 0)
+				continue;
+			cascade = ((_wheel->now >> shift) + distance) << shift;
+		} else
+		{
+			distance = __wheel_find(_wheel->occupied[level], (current + 1) & WHEEL_SLOT_MASK);
+			if (distance < 0)
+				continue;
+			cascade = ((_wheel->now >> shift) + distance + 1) << shift;
+		}
+		if (cascade < ret)
+			ret = cascade;
+	}
+
+	return ret;
+}
+
+void pingtcp_wheel_init(pingtcp_wheel_t* _wheel, int64_t _now_ns, int64_t _tick_ns, void* _data)
+{
+	pfcq_zero(_wheel, sizeof(pingtcp_wheel_t));
+	_wheel->origin_ns = _now_ns;
+	_wheel->tick_ns = _tick_ns;
+	_wheel->data = _data;
+
+	return;
+}
+
+void pingtcp_timer_init(pingtcp_timer_t* _timer, pingtcp_timer_handler_t _handler)
+{
+	pfcq_zero(_timer, sizeof(pingtcp_timer_t));
+	_timer->handler = _handler;
+
+	return;
+}
+
+void pingtcp_wheel_add(pingtcp_wheel_t* _wheel, pingtcp_timer_t* _timer, int64_t _expires_ns)
+{
+	if (pingtcp_timer_pending(_timer))
+		pingtcp_wheel_del(_wheel, _timer);
+
+	/* Rounded up, so that a timer never fires before its deadline */
+	if (_expires_ns <= _wheel->origin_ns)
+		_timer->expires = 0;
+	else
+		_timer->expires = (_expires_ns - _wheel->origin_ns + _wheel->tick_ns - 1) / _wheel->tick_ns;
+
+	__wheel_place(_wheel, _timer);
+	_wheel->count++;
+
+	return;
+}
+
+void pingtcp_wheel_del(pingtcp_wheel_t* _wheel, pingtcp_timer_t* _timer)
+{
+	if (!pingtcp_timer_pending(_timer))
+		return;
+
+	*_timer->pprev = _timer->next;
+	if (_timer->next)
+		_timer->next->pprev = _timer->pprev;
+	if (!_wheel->slots[_timer->level][_timer->slot])
+		_wheel->occupied[_timer->level][_timer->slot >> 6] &= ~(1ULL << (_timer->slot & 63));
+	_timer->next = NULL;
+	_timer->pprev = NULL;
+	_wheel->count--;
+
+	return;
+}
+
+size_t pingtcp_wheel_advance(pingtcp_wheel_t* _wheel, int64_t _now_ns)
+{
+	size_t ret = 0;
+	uint64_t target = 0;
+
+	if (_now_ns < _wheel->origin_ns)
+		return ret;
+	target = (_now_ns - _wheel->origin_ns) / _wheel->tick_ns;
+
+	while (_wheel->now <= target)
+	{
+		uint64_t next = 0;
+		unsigned short int slot = 0;
+		pingtcp_timer_t* current = NULL;
+		pingtcp_timer_t* due = NULL;
+
+		/* Skip empty ticks at once instead of walking them one by one */
+		next = __wheel_next_tick(_wheel);
+		if (next > target)
+		{
+			_wheel->now = target + 1;
+			break;
+		}
+		_wheel->now = next;
+
+		if ((_wheel->now & WHEEL_SLOT_MASK) == 0)
+		{
+			for (unsigned short int level = 1; level < WHEEL_LEVELS; level++)
+			{
+				slot = (_wheel->now >> (WHEEL_SLOT_BITS * level)) & WHEEL_SLOT_MASK;
+				__wheel_cascade(_wheel, level, slot);
+				if (slot != 0)
+					break;
+			}
+		}
+
+		slot = _wheel->now & WHEEL_SLOT_MASK;
+		/* Timers armed by handlers are due no earlier than the next tick */
+		_wheel->now++;
+
+		/*
+		 * Detached first, since a timer armed by a handler one revolution ahead
+		 * lands in this very slot and must not fire until then. Popped one by one,
+		 * since a handler may cancel any other timer, including ones from this list
+		 */
+		due = __wheel_detach(_wheel, 0, slot);
+		if (due)
+			due->pprev = &due;
+		while ((current = due))
+		{
+			pingtcp_wheel_del(_wheel, current);
+			current->handler(current, _now_ns, _wheel->data);
+			ret++;
+		}
+	}
+
+	return ret;
+}
+
+int64_t pingtcp_wheel_next_ns(const pingtcp_wheel_t* _wheel)
+{
+	uint64_t next = 0;
+
+	if (_wheel->count == 0)
+		return WHEEL_NEVER;
+
+	next = __wheel_next_tick(_wheel);
+	if (next == UINT64_MAX)
+		return WHEEL_NEVER;
+
+	return _wheel->origin_ns + (int64_t)(next * _wheel->tick_ns);
+}
+
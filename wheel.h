@@ -0,0 +1,94 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifndef __WHEEL_H__
+#define __WHEEL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WHEEL_LEVELS		4
+#define WHEEL_SLOT_BITS		8
+#define WHEEL_SLOTS			(1 << WHEEL_SLOT_BITS)
+#define WHEEL_SLOT_MASK		(WHEEL_SLOTS - 1)
+#define WHEEL_WORDS			(WHEEL_SLOTS / 64)
+#define WHEEL_NEVER			INT64_MAX
+
+#define pingtcp_container_of(A, B, C)	((B*)((char*)(A) - offsetof(B, C)))
+
+struct pingtcp_timer;
+
+typedef void (*pingtcp_timer_handler_t)(struct pingtcp_timer* _timer, int64_t _now_ns, void* _data);
+
+/*
+ * Intrusive timer node, embedded into whatever has a deadline,
+ * so that arming and cancelling never allocate
+ */
+typedef struct pingtcp_timer
+{
+	struct pingtcp_timer* next;
+	struct pingtcp_timer** pprev;
+	uint64_t expires;
+	unsigned short int level;
+	unsigned short int slot;
+	pingtcp_timer_handler_t handler;
+} pingtcp_timer_t;
+
+/*
+ * Hierarchical timing wheel: WHEEL_LEVELS levels of WHEEL_SLOTS slots,
+ * each level being WHEEL_SLOTS times coarser than the previous one.
+ * Occupancy bitmaps make finding the next non-empty slot cheap.
+ * Handlers get the wheel owner data along with the expired timer
+ */
+typedef struct pingtcp_wheel
+{
+	uint64_t now;
+	int64_t origin_ns;
+	int64_t tick_ns;
+	size_t count;
+	void* data;
+	uint64_t occupied[WHEEL_LEVELS][WHEEL_WORDS];
+	pingtcp_timer_t* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} pingtcp_wheel_t;
+
+void pingtcp_wheel_init(pingtcp_wheel_t* _wheel, int64_t _now_ns, int64_t _tick_ns, void* _data) __attribute__((nonnull(1)));
+void pingtcp_timer_init(pingtcp_timer_t* _timer, pingtcp_timer_handler_t _handler) __attribute__((nonnull(1)));
+void pingtcp_wheel_add(pingtcp_wheel_t* _wheel, pingtcp_timer_t* _timer, int64_t _expires_ns) __attribute__((nonnull(1, 2)));
+void pingtcp_wheel_del(pingtcp_wheel_t* _wheel, pingtcp_timer_t* _timer) __attribute__((nonnull(1, 2)));
+size_t pingtcp_wheel_advance(pingtcp_wheel_t* _wheel, int64_t _now_ns) __attribute__((nonnull(1)));
+int64_t pingtcp_wheel_next_ns(const pingtcp_wheel_t* _wheel) __attribute__((nonnull(1), warn_unused_result));
+
+static inline int pingtcp_timer_pending(const pingtcp_timer_t* _timer) __attribute__((always_inline));
+static inline int64_t pingtcp_timer_expires_ns(const pingtcp_wheel_t* _wheel, const pingtcp_timer_t* _timer) __attribute__((always_inline));
+
+static inline int pingtcp_timer_pending(const pingtcp_timer_t* _timer)
+{
+	return _timer->pprev != NULL;
+}
+
+static inline int64_t pingtcp_timer_expires_ns(const pingtcp_wheel_t* _wheel, const pingtcp_timer_t* _timer)
+{
+	return _wheel->origin_ns + (int64_t)(_timer->expires * _wheel->tick_ns);
+}
+
+#endif /* __WHEEL_H__ */
+
@@ -0,0 +1,252 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "wire.h"
+
+#define BUFFER_INITIAL_SIZE		4096
+#define FRAME_LENGTH_SIZE		4
+
+static void __buffer_reserve(pingtcp_buffer_t* _buffer, size_t _length)
+{
+	size_t size = _buffer->size ? _buffer->size : BUFFER_INITIAL_SIZE;
+
+	if (likely(_buffer->used + _length <= _buffer->size))
+		return;
+
+	while (size < _buffer->used + _length)
+		size *= 2;
+	_buffer->data = _buffer->data ? pfcq_realloc(_buffer->data, size) : pfcq_alloc(size);
+	_buffer->size = size;
+
+	return;
+}
+
+void pingtcp_buffer_init(pingtcp_buffer_t* _buffer)
+{
+	pfcq_zero(_buffer, sizeof(pingtcp_buffer_t));
+
+	return;
+}
+
+void pingtcp_buffer_put_u8(pingtcp_buffer_t* _buffer, uint8_t _value)
+{
+	__buffer_reserve(_buffer, 1);
+	_buffer->data[_buffer->used++] = _value;
+
+	return;
+}
+
+void pingtcp_buffer_put_varint(pingtcp_buffer_t* _buffer, uint64_t _value)
+{
+	__buffer_reserve(_buffer, 10);
+	while (_value >= 0x80)
+	{
+		_buffer->data[_buffer->used++] = (uint8_t)(_value | 0x80);
+		_value >>= 7;
+	}
+	_buffer->data[_buffer->used++] = (uint8_t)_value;
+
+	return;
+}
+
+void pingtcp_buffer_put_zigzag(pingtcp_buffer_t* _buffer, int64_t _value)
+{
+	pingtcp_buffer_put_varint(_buffer, ((uint64_t)_value << 1) ^ (uint64_t)(_value >> 63));
+
+	return;
+}
+
+void pingtcp_buffer_put_string(pingtcp_buffer_t* _buffer, const char* _string)
+{
+	size_t length = strlen(_string);
+
+	pingtcp_buffer_put_varint(_buffer, length);
+	__buffer_reserve(_buffer, length);
+	memcpy(_buffer->data + _buffer->used, _string, length);
+	_buffer->used += length;
+
+	return;
+}
+
+/*
+ * The payload length is unknown until the frame is complete, so room for
+ * the widest varint allowed by WIRE_FRAME_MAX is kept and filled in afterwards
+ */
+size_t pingtcp_buffer_frame_begin(pingtcp_buffer_t* _buffer, pingtcp_wire_type_t _type)
+{
+	size_t ret = _buffer->used;
+
+	__buffer_reserve(_buffer, FRAME_LENGTH_SIZE);
+	_buffer->used += FRAME_LENGTH_SIZE;
+	pingtcp_buffer_put_u8(_buffer, _type);
+
+	return ret;
+}
+
+/* A frame too long to be taken in is dropped from the buffer, and EMSGSIZE is returned */
+int pingtcp_buffer_frame_end(pingtcp_buffer_t* _buffer, size_t _frame)
+{
+	size_t length = _buffer->used - _frame - FRAME_LENGTH_SIZE;
+
+	if (unlikely(length > WIRE_FRAME_MAX))
+	{
+		_buffer->used = _frame;
+		return EMSGSIZE;
+	}
+
+	/* Padded varint: continuation bits set on all but the last byte */
+	for (size_t i = 0; i < FRAME_LENGTH_SIZE; i++)
+	{
+		_buffer->data[_frame + i] = (uint8_t)((length & 0x7f) | (i < FRAME_LENGTH_SIZE - 1 ? 0x80 : 0));
+		length >>= 7;
+	}
+
+	return 0;
+}
+
+void pingtcp_buffer_consume(pingtcp_buffer_t* _buffer, size_t _length)
+{
+	if (_length >= _buffer->used)
+		_buffer->used = 0;
+	else
+	{
+		memmove(_buffer->data, _buffer->data + _length, _buffer->used - _length);
+		_buffer->used -= _length;
+	}
+
+	return;
+}
+
+void pingtcp_buffer_done(pingtcp_buffer_t* _buffer)
+{
+	if (_buffer->data)
+		pfcq_free(_buffer->data);
+	pfcq_zero(_buffer, sizeof(pingtcp_buffer_t));
+
+	return;
+}
+
+void pingtcp_reader_init(pingtcp_reader_t* _reader, const void* _data, size_t _size)
+{
+	pfcq_zero(_reader, sizeof(pingtcp_reader_t));
+	_reader->data = _data;
+	_reader->size = _size;
+
+	return;
+}
+
+uint8_t pingtcp_reader_get_u8(pingtcp_reader_t* _reader)
+{
+	if (unlikely(_reader->offset >= _reader->size))
+	{
+		_reader->error = 1;
+		return 0;
+	}
+
+	return _reader->data[_reader->offset++];
+}
+
+uint64_t pingtcp_reader_get_varint(pingtcp_reader_t* _reader)
+{
+	uint64_t ret = 0;
+
+	for (unsigned int shift = 0; shift < 64; shift += 7)
+	{
+		uint8_t byte = pingtcp_reader_get_u8(_reader);
+
+		if (unlikely(_reader->error))
+			return 0;
+		ret |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return ret;
+	}
+
+	_reader->error = 1;
+
+	return 0;
+}
+
+int64_t pingtcp_reader_get_zigzag(pingtcp_reader_t* _reader)
+{
+	uint64_t value = pingtcp_reader_get_varint(_reader);
+
+	return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+char* pingtcp_reader_get_string(pingtcp_reader_t* _reader)
+{
+	uint64_t length = pingtcp_reader_get_varint(_reader);
+
+	if (unlikely(_reader->error || length > _reader->size - _reader->offset))
+	{
+		_reader->error = 1;
+		return NULL;
+	}
+	_reader->offset += length;
+
+	return pfcq_bstring((const char*)_reader->data + _reader->offset - length, length);
+}
+
+/*
+ * Cut the next complete frame off the stream. Returns 0 if there is not
+ * enough data yet, and -1 if the stream is broken
+ */
+int pingtcp_reader_frame(pingtcp_reader_t* _reader, pingtcp_reader_t* _frame)
+{
+	size_t offset = _reader->offset;
+	uint64_t length = pingtcp_reader_get_varint(_reader);
+
+	if (unlikely(_reader->error))
+	{
+		/* A truncated varint is fine, an overlong one is not */
+		_reader->error = 0;
+		_reader->offset = offset;
+		return _reader->size - offset >= 10 ? -1 : 0;
+	}
+	if (unlikely(length > WIRE_FRAME_MAX))
+		return -1;
+	if (length > _reader->size - _reader->offset)
+	{
+		_reader->offset = offset;
+		return 0;
+	}
+
+	pingtcp_reader_init(_frame, _reader->data + _reader->offset, length);
+	_reader->offset += length;
+
+	return 1;
+}
+
+void pingtcp_wire_counters(const pingtcp_stats_t* _stats, int64_t* _counters)
+{
+	_counters[PINGTCP_WIRE_ATTEMPT] = _stats->attempt;
+	_counters[PINGTCP_WIRE_OK] = _stats->ok;
+	_counters[PINGTCP_WIRE_FAIL] = _stats->fail;
+	_counters[PINGTCP_WIRE_LATE] = _stats->late;
+	_counters[PINGTCP_WIRE_LOST] = _stats->lost;
+	_counters[PINGTCP_WIRE_RTT_COUNT] = _stats->rtt_count;
+	_counters[PINGTCP_WIRE_RTT_SUM_US] = (int64_t)(_stats->rtt_sum * 1000.0);
+
+	return;
+}
+
@@ -0,0 +1,108 @@
+/* vim: set tabstop=4:softtabstop=4:shiftwidth=4:noexpandtab */
+
+/*
+ * pingtcp - small utility to measure TCP handshake time (torify-friendly)
+ * Copyright (C) 2015 Lanet Network
+ * Programmed by Oleksandr Natalenko <o.natalenko@lanet.ua>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifndef __WIRE_H__
+#define __WIRE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "engine.h"
+
+#define WIRE_VERSION		3
+#define WIRE_FRAME_MAX		(16 * 1024 * 1024)
+
+/*
+ * Agent to aggregator stream: frames of a varint payload length followed by
+ * the payload, which starts with the message type. All integers are LEB128
+ * varints, signed ones zigzag-encoded, strings are length-prefixed.
+ *
+ * HELLO:  version, histogram buckets, vantage point name
+ * TARGET: target id, port, destination, instance
+ * REPORT: entries up to the end of the frame, one per target with changes
+ *         since the previous report: id delta, running totals (attempt, ok,
+ *         fail, late, lost, rtt count, rtt sum in us), number of changed
+ *         histogram buckets and (bucket delta, total count) pairs
+ *
+ * The aggregator answers with ACK: number of frames of the connection
+ * it has taken in so far.
+ *
+ * Totals rather than deltas make a report safe to lose or to repeat: the
+ * aggregator adds the difference from what it has seen of the same instance
+ * of the target, which changes whenever the target is added again
+ */
+typedef enum pingtcp_wire_type
+{
+	PINGTCP_WIRE_HELLO = 1,
+	PINGTCP_WIRE_TARGET,
+	PINGTCP_WIRE_REPORT,
+	PINGTCP_WIRE_ACK
+} pingtcp_wire_type_t;
+
+typedef enum pingtcp_wire_counter
+{
+	PINGTCP_WIRE_ATTEMPT = 0,
+	PINGTCP_WIRE_OK,
+	PINGTCP_WIRE_FAIL,
+	PINGTCP_WIRE_LATE,
+	PINGTCP_WIRE_LOST,
+	PINGTCP_WIRE_RTT_COUNT,
+	PINGTCP_WIRE_RTT_SUM_US,
+	PINGTCP_WIRE_COUNTERS
+} pingtcp_wire_counter_t;
+
+typedef struct pingtcp_buffer
+{
+	uint8_t* data;
+	size_t size;
+	size_t used;
+} pingtcp_buffer_t;
+
+typedef struct pingtcp_reader
+{
+	const uint8_t* data;
+	size_t size;
+	size_t offset;
+	int error;
+} pingtcp_reader_t;
+
+void pingtcp_buffer_init(pingtcp_buffer_t* _buffer) __attribute__((nonnull(1)));
+void pingtcp_buffer_put_u8(pingtcp_buffer_t* _buffer, uint8_t _value) __attribute__((nonnull(1)));
+void pingtcp_buffer_put_varint(pingtcp_buffer_t* _buffer, uint64_t _value) __attribute__((nonnull(1)));
+void pingtcp_buffer_put_zigzag(pingtcp_buffer_t* _buffer, int64_t _value) __attribute__((nonnull(1)));
+void pingtcp_buffer_put_string(pingtcp_buffer_t* _buffer, const char* _string) __attribute__((nonnull(1, 2)));
+size_t pingtcp_buffer_frame_begin(pingtcp_buffer_t* _buffer, pingtcp_wire_type_t _type) __attribute__((nonnull(1), warn_unused_result));
+int pingtcp_buffer_frame_end(pingtcp_buffer_t* _buffer, size_t _frame) __attribute__((nonnull(1), warn_unused_result));
+void pingtcp_buffer_consume(pingtcp_buffer_t* _buffer, size_t _length) __attribute__((nonnull(1)));
+void pingtcp_buffer_done(pingtcp_buffer_t* _buffer) __attribute__((nonnull(1)));
+
+void pingtcp_reader_init(pingtcp_reader_t* _reader, const void* _data, size_t _size) __attribute__((nonnull(1)));
+uint8_t pingtcp_reader_get_u8(pingtcp_reader_t* _reader) __attribute__((nonnull(1)));
+uint64_t pingtcp_reader_get_varint(pingtcp_reader_t* _reader) __attribute__((nonnull(1)));
+int64_t pingtcp_reader_get_zigzag(pingtcp_reader_t* _reader) __attribute__((nonnull(1)));
+char* pingtcp_reader_get_string(pingtcp_reader_t* _reader) __attribute__((nonnull(1), warn_unused_result));
+int pingtcp_reader_frame(pingtcp_reader_t* _reader, pingtcp_reader_t* _frame) __attribute__((nonnull(1, 2), warn_unused_result));
+
+void pingtcp_wire_counters(const pingtcp_stats_t* _stats, int64_t* _counters) __attribute__((nonnull(1, 2)));
+
+#endif /* __WIRE_H__ */
+